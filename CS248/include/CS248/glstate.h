@@ -0,0 +1,84 @@
+#ifndef CS248_GLSTATE_H
+#define CS248_GLSTATE_H
+
+#define GLEW_STATIC
+#include "GL/glew.h"
+
+#include <stddef.h>
+
+namespace CS248 {
+
+/**
+ * Shadow copy of the OpenGL state that rendering code changes most often:
+ * the current program, texture bindings per unit, buffer bindings, enabled
+ * vertex attribute arrays and blend/depth state.
+ * Setting state through GLState skips the GL call if the value is already
+ * current. State that has never been set through GLState (or was
+ * invalidated) is unknown, so the first call always goes through.
+ * Code that changes tracked state with direct GL calls (glPopAttrib for
+ * instance) must call invalidate() afterwards. Only a single GL context is
+ * supported.
+ */
+class GLState {
+ public:
+
+  /**
+   * Number of state changes passed on to GL and skipped as redundant
+   * since the last reset_stats().
+   */
+  struct Stats {
+    size_t issued;
+    size_t avoided;
+  };
+
+  static void use_program(GLuint program);
+
+  /**
+   * Binds texture to target on the given unit (0 for GL_TEXTURE0, ...).
+   * The active texture unit is switched only when the binding changes, so
+   * code that modifies a texture after binding it has to be sure the
+   * binding was new (as it is for a freshly generated name), or select the
+   * unit with active_texture() first.
+   */
+  static void bind_texture(GLuint unit, GLenum target, GLuint texture);
+  static void active_texture(GLuint unit);
+
+  static void bind_buffer(GLenum target, GLuint buffer);
+  static void bind_buffer_base(GLenum target, GLuint index, GLuint buffer);
+  static void bind_buffer_range(GLenum target, GLuint index, GLuint buffer,
+                                GLintptr offset, GLsizeiptr size);
+
+  /**
+   * Binds a vertex array object. Attribute array state and the element
+   * array binding belong to the VAO, so they become unknown.
+   */
+  static void bind_vertex_array(GLuint vao);
+
+  static void enable_vertex_attrib_array(GLuint index);
+  static void disable_vertex_attrib_array(GLuint index);
+
+  static void enable(GLenum cap);
+  static void disable(GLenum cap);
+  static void blend_func(GLenum sfactor, GLenum dfactor);
+  static void depth_func(GLenum func);
+  static void depth_mask(GLboolean flag);
+
+  /**
+   * Delete GL objects, clearing any bindings of them that are tracked
+   * (GL unbinds deleted objects, and their names may be reused).
+   */
+  static void delete_textures(GLsizei n, const GLuint *textures);
+  static void delete_buffers(GLsizei n, const GLuint *buffers);
+
+  /**
+   * Forgets all tracked state.
+   */
+  static void invalidate();
+
+  static const Stats &stats();
+  static void reset_stats();
+};
+
+} // namespace CS248
+
+#endif // CS248_GLSTATE_H
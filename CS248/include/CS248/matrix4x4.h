@@ -78,6 +78,21 @@ class Matrix4x4 {
   */
   static Matrix4x4 scaling(Vector3D s);
 
+  /**
+  * Returns the perspective projection gluPerspective builds: fovy is the vertical field of view in Degrees, z_near and z_far are the (positive) distances of the clipping planes.
+  */
+  static Matrix4x4 perspective(double fovy, double aspect, double z_near, double z_far);
+
+  /**
+  * Returns the parallel projection glOrtho builds for the eye space box [left,right] x [bottom,top] x [-z_far,-z_near].
+  */
+  static Matrix4x4 orthographic(double left, double right, double bottom, double top, double z_near, double z_far);
+
+  /**
+  * Returns the world to eye space transform gluLookAt builds for a viewer at eye looking at center, with up pointing up.
+  */
+  static Matrix4x4 look_at(Vector3D eye, Vector3D center, Vector3D up);
+
   // No Cross products for 4 by 4 matrix.
 
   /**
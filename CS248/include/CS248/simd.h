@@ -0,0 +1,310 @@
+#ifndef CS248_SIMD_H
+#define CS248_SIMD_H
+
+#include "CS248.h"
+#include "vector3D.h"
+#include "vector4D.h"
+#include "matrix4x4.h"
+
+#include <stddef.h>
+
+// SSE2 is part of every x86-64 target, other targets get a plain C++
+// version of the same operations.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CS248_SIMD_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace CS248 {
+
+/**
+ * Four floats, operated on lane by lane. These functions are the only place
+ * that depends on the instruction set; the types below are built on them.
+ */
+#ifdef CS248_SIMD_SSE
+
+typedef __m128 float4;
+
+inline float4 f4_set(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+inline float4 f4_splat(float s) { return _mm_set1_ps(s); }
+inline float4 f4_load(const float *p) { return _mm_loadu_ps(p); }
+inline void f4_store(float *p, float4 a) { _mm_storeu_ps(p, a); }
+
+inline float4 f4_add(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 f4_sub(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 f4_mul(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 f4_div(float4 a, float4 b) { return _mm_div_ps(a, b); }
+inline float4 f4_min(float4 a, float4 b) { return _mm_min_ps(a, b); }
+inline float4 f4_max(float4 a, float4 b) { return _mm_max_ps(a, b); }
+inline float4 f4_abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+
+// (a[i], a[i], a[i], a[i])
+template <int i> inline float4 f4_lane(float4 a) {
+  return _mm_shuffle_ps(a, a, _MM_SHUFFLE(i, i, i, i));
+}
+
+// (a.y, a.z, a.x, a.w)
+inline float4 f4_yzx(float4 a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+inline float f4_first(float4 a) { return _mm_cvtss_f32(a); }
+
+// true if any lane of a is less than the same lane of b
+inline bool f4_any_less(float4 a, float4 b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)) != 0; }
+
+// bit i set if lane i of a is less than lane i of b
+inline int f4_less_bits(float4 a, float4 b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+
+// columns become rows
+inline void f4_transpose(float4 &a, float4 &b, float4 &c, float4 &d) {
+  _MM_TRANSPOSE4_PS(a, b, c, d);
+}
+
+#else
+
+struct float4 { float f[4]; };
+
+inline float4 f4_set(float x, float y, float z, float w) { float4 r = {{ x, y, z, w }}; return r; }
+inline float4 f4_splat(float s) { return f4_set(s, s, s, s); }
+inline float4 f4_load(const float *p) { return f4_set(p[0], p[1], p[2], p[3]); }
+inline void f4_store(float *p, float4 a) { for (int i = 0; i < 4; i++) p[i] = a.f[i]; }
+
+#define CS248_F4_LANEWISE(name, expr) \
+  inline float4 name(float4 a, float4 b) { \
+    float4 r; for (int i = 0; i < 4; i++) r.f[i] = (expr); return r; \
+  }
+CS248_F4_LANEWISE(f4_add, a.f[i] + b.f[i])
+CS248_F4_LANEWISE(f4_sub, a.f[i] - b.f[i])
+CS248_F4_LANEWISE(f4_mul, a.f[i] * b.f[i])
+CS248_F4_LANEWISE(f4_div, a.f[i] / b.f[i])
+CS248_F4_LANEWISE(f4_min, b.f[i] < a.f[i] ? b.f[i] : a.f[i])
+CS248_F4_LANEWISE(f4_max, a.f[i] < b.f[i] ? b.f[i] : a.f[i])
+#undef CS248_F4_LANEWISE
+
+inline float4 f4_abs(float4 a) {
+  for (int i = 0; i < 4; i++) a.f[i] = std::fabs(a.f[i]);
+  return a;
+}
+
+template <int i> inline float4 f4_lane(float4 a) { return f4_splat(a.f[i]); }
+inline float4 f4_yzx(float4 a) { return f4_set(a.f[1], a.f[2], a.f[0], a.f[3]); }
+inline float f4_first(float4 a) { return a.f[0]; }
+
+inline bool f4_any_less(float4 a, float4 b) {
+  return a.f[0] < b.f[0] || a.f[1] < b.f[1] || a.f[2] < b.f[2] || a.f[3] < b.f[3];
+}
+
+inline int f4_less_bits(float4 a, float4 b) {
+  int bits = 0;
+  for (int i = 0; i < 4; i++) bits |= (a.f[i] < b.f[i]) << i;
+  return bits;
+}
+
+inline void f4_transpose(float4 &a, float4 &b, float4 &c, float4 &d) {
+  float4 m[4] = { a, b, c, d };
+  for (int i = 0; i < 4; i++) {
+    a.f[i] = m[i].f[0]; b.f[i] = m[i].f[1];
+    c.f[i] = m[i].f[2]; d.f[i] = m[i].f[3];
+  }
+}
+
+#endif  // CS248_SIMD_SSE
+
+/**
+ * Single precision 3D vector for the render hot path. Held in a float4
+ * whose fourth lane is ignored. Vector3D remains the general purpose type;
+ * convert at the boundaries.
+ */
+class Vec3f {
+ public:
+
+  float4 v;
+
+  Vec3f() : v( f4_splat(0.f) ) { }
+  Vec3f( float x, float y, float z ) : v( f4_set(x, y, z, 0.f) ) { }
+  explicit Vec3f( float4 v ) : v( v ) { }
+  explicit Vec3f( const Vector3D& u ) : v( f4_set(u.x, u.y, u.z, 0.f) ) { }
+
+  float x() const { float f[4]; f4_store(f, v); return f[0]; }
+  float y() const { float f[4]; f4_store(f, v); return f[1]; }
+  float z() const { float f[4]; f4_store(f, v); return f[2]; }
+
+  /**
+   * Writes x, y, z to out[0..2].
+   */
+  void store( float* out ) const {
+    float f[4]; f4_store(f, v);
+    out[0] = f[0]; out[1] = f[1]; out[2] = f[2];
+  }
+
+  Vector3D to_double() const {
+    float f[4]; f4_store(f, v);
+    return Vector3D(f[0], f[1], f[2]);
+  }
+
+  Vec3f operator+( const Vec3f& u ) const { return Vec3f(f4_add(v, u.v)); }
+  Vec3f operator-( const Vec3f& u ) const { return Vec3f(f4_sub(v, u.v)); }
+  Vec3f operator*( const Vec3f& u ) const { return Vec3f(f4_mul(v, u.v)); }
+  Vec3f operator*( float c ) const { return Vec3f(f4_mul(v, f4_splat(c))); }
+  Vec3f operator-() const { return Vec3f(f4_sub(f4_splat(0.f), v)); }
+};
+
+inline float dot( const Vec3f& a, const Vec3f& b ) {
+  float4 p = f4_mul(a.v, b.v);
+  return f4_first(f4_add(f4_add(p, f4_lane<1>(p)), f4_lane<2>(p)));
+}
+
+inline Vec3f cross( const Vec3f& a, const Vec3f& b ) {
+  // (a * b.yzx - a.yzx * b).yzx
+  float4 c = f4_sub(f4_mul(a.v, f4_yzx(b.v)), f4_mul(f4_yzx(a.v), b.v));
+  return Vec3f(f4_yzx(c));
+}
+
+// componentwise; not called min/max/abs so they don't hide the std ones
+inline Vec3f vmin( const Vec3f& a, const Vec3f& b ) { return Vec3f(f4_min(a.v, b.v)); }
+inline Vec3f vmax( const Vec3f& a, const Vec3f& b ) { return Vec3f(f4_max(a.v, b.v)); }
+inline Vec3f vabs( const Vec3f& a ) { return Vec3f(f4_abs(a.v)); }
+
+/**
+ * Single precision 4D vector, the float counterpart of Vector4D.
+ */
+class Vec4f {
+ public:
+
+  float4 v;
+
+  Vec4f() : v( f4_splat(0.f) ) { }
+  Vec4f( float x, float y, float z, float w ) : v( f4_set(x, y, z, w) ) { }
+  explicit Vec4f( float4 v ) : v( v ) { }
+  explicit Vec4f( const Vector4D& u ) : v( f4_set(u.x, u.y, u.z, u.w) ) { }
+
+  /**
+   * Initializes to (u, w).
+   */
+  Vec4f( const Vec3f& u, float w ) {
+    float f[4]; f4_store(f, u.v);
+    v = f4_set(f[0], f[1], f[2], w);
+  }
+
+  void store( float* out ) const { f4_store(out, v); }
+
+  Vector4D to_double() const {
+    float f[4]; f4_store(f, v);
+    return Vector4D(f[0], f[1], f[2], f[3]);
+  }
+
+  Vec4f operator+( const Vec4f& u ) const { return Vec4f(f4_add(v, u.v)); }
+  Vec4f operator-( const Vec4f& u ) const { return Vec4f(f4_sub(v, u.v)); }
+  Vec4f operator*( const Vec4f& u ) const { return Vec4f(f4_mul(v, u.v)); }
+  Vec4f operator*( float c ) const { return Vec4f(f4_mul(v, f4_splat(c))); }
+};
+
+inline float dot( const Vec4f& a, const Vec4f& b ) {
+  float4 p = f4_mul(a.v, b.v);
+  float4 s = f4_add(p, f4_lane<1>(p));
+  return f4_first(f4_add(f4_add(s, f4_lane<2>(p)), f4_lane<3>(p)));
+}
+
+/**
+ * Single precision 4x4 matrix, stored as four columns like OpenGL expects
+ * it. The float counterpart of Matrix4x4 for per-frame transforms.
+ */
+class Mat4f {
+ public:
+
+  float4 c[4];  // columns
+
+  /**
+   * Constructor. Initializes to the identity.
+   */
+  Mat4f() {
+    c[0] = f4_set(1.f, 0.f, 0.f, 0.f);
+    c[1] = f4_set(0.f, 1.f, 0.f, 0.f);
+    c[2] = f4_set(0.f, 0.f, 1.f, 0.f);
+    c[3] = f4_set(0.f, 0.f, 0.f, 1.f);
+  }
+
+  explicit Mat4f( const Matrix4x4& m ) {
+    for (int j = 0; j < 4; j++)
+      c[j] = f4_set(m(0, j), m(1, j), m(2, j), m(3, j));
+  }
+
+  Matrix4x4 to_double() const;
+
+  /**
+   * Writes the matrix column-major to out[0..15], as glUniformMatrix4fv
+   * and std140 mat4 members take it.
+   */
+  void store( float* out ) const {
+    for (int j = 0; j < 4; j++) f4_store(out + 4 * j, c[j]);
+  }
+
+  /**
+   * Writes the upper left 3x3 block to out[0..11] in the std140 layout of a
+   * mat3: three columns, each padded to four floats.
+   */
+  void store_3x3( float* out ) const;
+
+  Mat4f operator*( const Mat4f& B ) const {
+    Mat4f R;
+    for (int j = 0; j < 4; j++) R.c[j] = apply(B.c[j]);
+    return R;
+  }
+
+  Vec4f operator*( const Vec4f& x ) const { return Vec4f(apply(x.v)); }
+
+  /**
+   * Applies the matrix to the point p (w = 1), without a perspective divide.
+   */
+  Vec3f transform_point( const Vec3f& p ) const {
+    float4 r = f4_add(f4_add(f4_mul(c[0], f4_lane<0>(p.v)), f4_mul(c[1], f4_lane<1>(p.v))),
+                      f4_add(f4_mul(c[2], f4_lane<2>(p.v)), c[3]));
+    return Vec3f(r);
+  }
+
+  /**
+   * Applies the upper 3x3 block to the direction d (w = 0).
+   */
+  Vec3f transform_vector( const Vec3f& d ) const {
+    float4 r = f4_add(f4_add(f4_mul(c[0], f4_lane<0>(d.v)), f4_mul(c[1], f4_lane<1>(d.v))),
+                      f4_mul(c[2], f4_lane<2>(d.v)));
+    return Vec3f(r);
+  }
+
+  Mat4f T() const {
+    Mat4f R = *this;
+    f4_transpose(R.c[0], R.c[1], R.c[2], R.c[3]);
+    return R;
+  }
+
+  /**
+   * Returns the inverse, assuming the matrix is affine (bottom row 0 0 0 1)
+   * and invertible. Much cheaper than a general inverse.
+   */
+  Mat4f affine_inverse() const;
+
+ private:
+
+  // x[0] * c[0] + x[1] * c[1] + x[2] * c[2] + x[3] * c[3]
+  float4 apply( float4 x ) const {
+    return f4_add(f4_add(f4_mul(c[0], f4_lane<0>(x)), f4_mul(c[1], f4_lane<1>(x))),
+                  f4_add(f4_mul(c[2], f4_lane<2>(x)), f4_mul(c[3], f4_lane<3>(x))));
+  }
+};
+
+/**
+ * Applies the affine transform m to n points. in and out may be the same.
+ */
+void transform_points( const Mat4f& m, const Vec3f* in, Vec3f* out, size_t n );
+
+/**
+ * Transforms n axis-aligned boxes (given by their min and max corners) by
+ * the affine transform m, and writes the axis-aligned boxes bounding the
+ * results. Same result as transforming all eight corners, at the cost of
+ * transforming one point and one vector.
+ */
+void transform_boxes( const Mat4f& m, const Vec3f* mins, const Vec3f* maxs,
+                      Vec3f* out_mins, Vec3f* out_maxs, size_t n );
+
+} // namespace CS248
+
+#endif // CS248_SIMD_H
@@ -0,0 +1,255 @@
+#include "glstate.h"
+
+namespace CS248 {
+
+// Tracked value; state that isn't known always gets set.
+template <typename T>
+struct Slot {
+  bool known;
+  T value;
+
+  // returns true if v is the current value, otherwise records it
+  bool update(T v) {
+    if (known && value == v) return true;
+    known = true;
+    value = v;
+    return false;
+  }
+};
+
+struct BufferRange {
+  GLuint buffer;
+  GLintptr offset;
+  GLsizeiptr size;  // -1 for glBindBufferBase
+
+  bool operator==(const BufferRange &r) const {
+    return buffer == r.buffer && offset == r.offset && size == r.size;
+  }
+};
+
+#define GLSTATE_MAX_UNITS    32
+#define GLSTATE_MAX_INDICES  16
+#define GLSTATE_MAX_ATTRIBS  16
+
+static const GLenum texture_targets[] = {
+  GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_3D, GL_TEXTURE_CUBE_MAP,
+  GL_TEXTURE_BUFFER
+};
+
+static const GLenum buffer_targets[] = {
+  GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER,
+  GL_SHADER_STORAGE_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_TEXTURE_BUFFER,
+  GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GL_PIXEL_UNPACK_BUFFER
+};
+
+static const GLenum indexed_buffer_targets[] = {
+  GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER
+};
+
+static const GLenum capabilities[] = {
+  GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_LIGHTING, GL_TEXTURE_2D,
+  GL_POLYGON_OFFSET_FILL, GL_SCISSOR_TEST, GL_STENCIL_TEST
+};
+
+#define GLSTATE_COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+static struct {
+  Slot<GLuint> program;
+  Slot<GLuint> active_unit;
+  Slot<GLuint> textures[GLSTATE_MAX_UNITS][GLSTATE_COUNT(texture_targets)];
+  Slot<GLuint> buffers[GLSTATE_COUNT(buffer_targets)];
+  Slot<BufferRange> indexed_buffers[GLSTATE_COUNT(indexed_buffer_targets)][GLSTATE_MAX_INDICES];
+  Slot<GLuint> vertex_array;
+  Slot<bool> attribs[GLSTATE_MAX_ATTRIBS];
+  Slot<bool> caps[GLSTATE_COUNT(capabilities)];
+  Slot<GLenum> blend_src, blend_dst;
+  Slot<GLenum> depth_func;
+  Slot<GLboolean> depth_mask;
+} state;  // zero initialized, so everything starts out unknown
+
+static GLState::Stats counters = { 0, 0 };
+
+// Index of e in the table, or -1 if it isn't tracked.
+static int find(const GLenum *table, size_t n, GLenum e) {
+  for (size_t i = 0; i < n; i++)
+    if (table[i] == e) return (int) i;
+  return -1;
+}
+
+#define GLSTATE_FIND(table, e) find(table, GLSTATE_COUNT(table), e)
+
+// Bookkeeping for a tracked change, returns true if the GL call is needed.
+static inline bool needed(bool redundant) {
+  if (redundant) {
+    counters.avoided++;
+    return false;
+  }
+  counters.issued++;
+  return true;
+}
+
+static inline bool untracked() {
+  counters.issued++;
+  return true;
+}
+
+void GLState::use_program(GLuint program) {
+  if (needed(state.program.update(program)))
+    glUseProgram(program);
+}
+
+void GLState::bind_texture(GLuint unit, GLenum target, GLuint texture) {
+  int t = GLSTATE_FIND(texture_targets, target);
+  if (t >= 0 && unit < GLSTATE_MAX_UNITS) {
+    if (!needed(state.textures[unit][t].update(texture)))
+      return;
+  } else {
+    untracked();
+  }
+
+  if (needed(state.active_unit.update(unit)))
+    glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(target, texture);
+}
+
+void GLState::active_texture(GLuint unit) {
+  if (needed(state.active_unit.update(unit)))
+    glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::bind_buffer(GLenum target, GLuint buffer) {
+  int t = GLSTATE_FIND(buffer_targets, target);
+  if (t >= 0 ? needed(state.buffers[t].update(buffer)) : untracked())
+    glBindBuffer(target, buffer);
+}
+
+// glBindBufferBase/Range also change the generic binding of target.
+static bool update_indexed(GLenum target, GLuint index, const BufferRange &r) {
+  int t = GLSTATE_FIND(buffer_targets, target);
+  if (t >= 0) state.buffers[t].update(r.buffer);
+
+  int i = GLSTATE_FIND(indexed_buffer_targets, target);
+  if (i < 0 || index >= GLSTATE_MAX_INDICES)
+    return untracked();
+  return needed(state.indexed_buffers[i][index].update(r));
+}
+
+void GLState::bind_buffer_base(GLenum target, GLuint index, GLuint buffer) {
+  BufferRange r = { buffer, 0, -1 };
+  if (update_indexed(target, index, r))
+    glBindBufferBase(target, index, buffer);
+}
+
+void GLState::bind_buffer_range(GLenum target, GLuint index, GLuint buffer,
+                                GLintptr offset, GLsizeiptr size) {
+  BufferRange r = { buffer, offset, size };
+  if (update_indexed(target, index, r))
+    glBindBufferRange(target, index, buffer, offset, size);
+}
+
+void GLState::bind_vertex_array(GLuint vao) {
+  if (!needed(state.vertex_array.update(vao)))
+    return;
+
+  glBindVertexArray(vao);
+
+  for (int i = 0; i < GLSTATE_MAX_ATTRIBS; i++)
+    state.attribs[i].known = false;
+  state.buffers[GLSTATE_FIND(buffer_targets, GL_ELEMENT_ARRAY_BUFFER)].known = false;
+}
+
+void GLState::enable_vertex_attrib_array(GLuint index) {
+  if (index < GLSTATE_MAX_ATTRIBS ? needed(state.attribs[index].update(true)) : untracked())
+    glEnableVertexAttribArray(index);
+}
+
+void GLState::disable_vertex_attrib_array(GLuint index) {
+  if (index < GLSTATE_MAX_ATTRIBS ? needed(state.attribs[index].update(false)) : untracked())
+    glDisableVertexAttribArray(index);
+}
+
+void GLState::enable(GLenum cap) {
+  int c = GLSTATE_FIND(capabilities, cap);
+  if (c >= 0 ? needed(state.caps[c].update(true)) : untracked())
+    glEnable(cap);
+}
+
+void GLState::disable(GLenum cap) {
+  int c = GLSTATE_FIND(capabilities, cap);
+  if (c >= 0 ? needed(state.caps[c].update(false)) : untracked())
+    glDisable(cap);
+}
+
+void GLState::blend_func(GLenum sfactor, GLenum dfactor) {
+  bool redundant = state.blend_src.update(sfactor);
+  redundant = state.blend_dst.update(dfactor) && redundant;
+  if (needed(redundant))
+    glBlendFunc(sfactor, dfactor);
+}
+
+void GLState::depth_func(GLenum func) {
+  if (needed(state.depth_func.update(func)))
+    glDepthFunc(func);
+}
+
+void GLState::depth_mask(GLboolean flag) {
+  if (needed(state.depth_mask.update(flag)))
+    glDepthMask(flag);
+}
+
+void GLState::delete_textures(GLsizei n, const GLuint *textures) {
+  for (GLsizei k = 0; k < n; k++)
+    for (int u = 0; u < GLSTATE_MAX_UNITS; u++)
+      for (size_t t = 0; t < GLSTATE_COUNT(texture_targets); t++)
+        if (state.textures[u][t].value == textures[k])
+          state.textures[u][t].value = 0;
+
+  glDeleteTextures(n, textures);
+}
+
+void GLState::delete_buffers(GLsizei n, const GLuint *buffers) {
+  for (GLsizei k = 0; k < n; k++) {
+    for (size_t t = 0; t < GLSTATE_COUNT(buffer_targets); t++)
+      if (state.buffers[t].value == buffers[k])
+        state.buffers[t].value = 0;
+    for (size_t t = 0; t < GLSTATE_COUNT(indexed_buffer_targets); t++)
+      for (int i = 0; i < GLSTATE_MAX_INDICES; i++)
+        if (state.indexed_buffers[t][i].value.buffer == buffers[k])
+          state.indexed_buffers[t][i].known = false;
+  }
+
+  glDeleteBuffers(n, buffers);
+}
+
+void GLState::invalidate() {
+  state.program.known = false;
+  state.active_unit.known = false;
+  for (int u = 0; u < GLSTATE_MAX_UNITS; u++)
+    for (size_t t = 0; t < GLSTATE_COUNT(texture_targets); t++)
+      state.textures[u][t].known = false;
+  for (size_t t = 0; t < GLSTATE_COUNT(buffer_targets); t++)
+    state.buffers[t].known = false;
+  for (size_t t = 0; t < GLSTATE_COUNT(indexed_buffer_targets); t++)
+    for (int i = 0; i < GLSTATE_MAX_INDICES; i++)
+      state.indexed_buffers[t][i].known = false;
+  state.vertex_array.known = false;
+  for (int i = 0; i < GLSTATE_MAX_ATTRIBS; i++)
+    state.attribs[i].known = false;
+  for (size_t c = 0; c < GLSTATE_COUNT(capabilities); c++)
+    state.caps[c].known = false;
+  state.blend_src.known = false;
+  state.blend_dst.known = false;
+  state.depth_func.known = false;
+  state.depth_mask.known = false;
+}
+
+const GLState::Stats &GLState::stats() {
+  return counters;
+}
+
+void GLState::reset_stats() {
+  counters.issued = 0;
+  counters.avoided = 0;
+}
+
+} // namespace CS248
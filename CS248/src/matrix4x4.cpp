@@ -311,6 +311,46 @@ namespace CS248 {
     return B;
   }
 
+  Matrix4x4 Matrix4x4::perspective(double fovy, double aspect, double z_near, double z_far) {
+    Matrix4x4 B;
+    double f = 1. / tan(fovy * M_PI / 360.);
+    double d = z_near - z_far;
+
+    B(0, 0) = f / aspect; B(0, 1) = 0.; B(0, 2) = 0.;                  B(0, 3) = 0.;
+    B(1, 0) = 0.;         B(1, 1) = f;  B(1, 2) = 0.;                  B(1, 3) = 0.;
+    B(2, 0) = 0.;         B(2, 1) = 0.; B(2, 2) = (z_far + z_near) / d; B(2, 3) = 2. * z_far * z_near / d;
+    B(3, 0) = 0.;         B(3, 1) = 0.; B(3, 2) = -1.;                 B(3, 3) = 0.;
+
+    return B;
+  }
+
+  Matrix4x4 Matrix4x4::orthographic(double left, double right, double bottom, double top,
+                                    double z_near, double z_far) {
+    Matrix4x4 B;
+    double w = right - left, h = top - bottom, d = z_far - z_near;
+
+    B(0, 0) = 2. / w; B(0, 1) = 0.;     B(0, 2) = 0.;      B(0, 3) = -(right + left) / w;
+    B(1, 0) = 0.;     B(1, 1) = 2. / h; B(1, 2) = 0.;      B(1, 3) = -(top + bottom) / h;
+    B(2, 0) = 0.;     B(2, 1) = 0.;     B(2, 2) = -2. / d; B(2, 3) = -(z_far + z_near) / d;
+    B(3, 0) = 0.;     B(3, 1) = 0.;     B(3, 2) = 0.;      B(3, 3) = 1.;
+
+    return B;
+  }
+
+  Matrix4x4 Matrix4x4::look_at(Vector3D eye, Vector3D center, Vector3D up) {
+    Vector3D f = (center - eye).unit();
+    Vector3D s = cross(f, up).unit();
+    Vector3D u = cross(s, f);
+
+    Matrix4x4 B;
+    B(0, 0) =  s.x; B(0, 1) =  s.y; B(0, 2) =  s.z; B(0, 3) = -dot(s, eye);
+    B(1, 0) =  u.x; B(1, 1) =  u.y; B(1, 2) =  u.z; B(1, 3) = -dot(u, eye);
+    B(2, 0) = -f.x; B(2, 1) = -f.y; B(2, 2) = -f.z; B(2, 3) =  dot(f, eye);
+    B(3, 0) = 0.;   B(3, 1) = 0.;   B(3, 2) = 0.;   B(3, 3) = 1.;
+
+    return B;
+  }
+
   Matrix4x4 outer( const Vector4D& u, const Vector4D& v ) {
     Matrix4x4 B;
 
@@ -1,4 +1,5 @@
 #include "osdtext.h"
+#include "glstate.h"
 
 #include <iostream>
 
@@ -84,18 +85,16 @@ int OSDText::init(bool use_hdpi) {
 
 void OSDText::render() {
 
-  glUseProgram(program);
+  GLState::use_program(program);
 
-  glEnable( GL_BLEND );
-  glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+  GLState::enable( GL_BLEND );
+  GLState::blend_func( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
 
   vector<OSDLine>::iterator it = lines.begin();
   while(it != lines.end()) {
     draw_line(*it);
     ++it;
   }
-
-  glUseProgram(0);
 }
 
 void OSDText::clear() {
@@ -201,9 +200,8 @@ void OSDText::draw_line(OSDLine line) {
 
   // gen texture
   GLuint tex;
-  glActiveTexture(GL_TEXTURE0);
   glGenTextures(1, &tex);
-  glBindTexture(GL_TEXTURE_2D, tex);
+  GLState::bind_texture(0, GL_TEXTURE_2D, tex);
   glUniform1i(uniform_tex, 0);
 
   // require 1 byte alignment when uploading texture data
@@ -218,8 +216,8 @@ void OSDText::draw_line(OSDLine line) {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
   // set up the VBO for our vertex data
-  glEnableVertexAttribArray(attribute_coord);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  GLState::enable_vertex_attrib_array(attribute_coord);
+  GLState::bind_buffer(GL_ARRAY_BUFFER, vbo);
   glVertexAttribPointer(attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, 0);
 
   // loop through all characters
@@ -256,8 +254,8 @@ void OSDText::draw_line(OSDLine line) {
     line.y += (g->advance.y >> 6) * sy;
   }
 
-  glDisableVertexAttribArray(attribute_coord);
-  glDeleteTextures(1, &tex);
+  GLState::disable_vertex_attrib_array(attribute_coord);
+  GLState::delete_textures(1, &tex);
 
 }
 
@@ -0,0 +1,70 @@
+#include "simd.h"
+
+namespace CS248 {
+
+Matrix4x4 Mat4f::to_double() const {
+  Matrix4x4 m;
+  for (int j = 0; j < 4; j++) {
+    float f[4];
+    f4_store(f, c[j]);
+    for (int i = 0; i < 4; i++) m(i, j) = f[i];
+  }
+  return m;
+}
+
+void Mat4f::store_3x3( float* out ) const {
+  for (int j = 0; j < 3; j++) {
+    f4_store(out + 4 * j, c[j]);
+    out[4 * j + 3] = 0.f;
+  }
+}
+
+Mat4f Mat4f::affine_inverse() const {
+  Vec3f a(c[0]), b(c[1]), d(c[2]);
+
+  // The rows of the inverse of the 3x3 block [a b d] are the cross
+  // products of its columns divided by the determinant.
+  Vec3f r0 = cross(b, d);
+  Vec3f r1 = cross(d, a);
+  Vec3f r2 = cross(a, b);
+  float inv_det = 1.f / dot(a, r0);
+  r0 = r0 * inv_det;
+  r1 = r1 * inv_det;
+  r2 = r2 * inv_det;
+
+  Mat4f R;
+  R.c[0] = r0.v;
+  R.c[1] = r1.v;
+  R.c[2] = r2.v;
+  R.c[3] = f4_set(0.f, 0.f, 0.f, 1.f);
+  f4_transpose(R.c[0], R.c[1], R.c[2], R.c[3]);
+
+  // translation: -inverse(3x3) * t, and the bottom row back to 0 0 0 1
+  Vec3f t = R.transform_vector(Vec3f(c[3]));
+  R.c[3] = f4_sub(f4_set(0.f, 0.f, 0.f, 1.f), t.v);
+  return R;
+}
+
+void transform_points( const Mat4f& m, const Vec3f* in, Vec3f* out, size_t n ) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = m.transform_point(in[i]);
+}
+
+void transform_boxes( const Mat4f& m, const Vec3f* mins, const Vec3f* maxs,
+                      Vec3f* out_mins, Vec3f* out_maxs, size_t n ) {
+
+  // the extent of the transformed box along each axis is the absolute
+  // value of the 3x3 block applied to the half extent
+  Mat4f abs_m;
+  for (int j = 0; j < 3; j++) abs_m.c[j] = f4_abs(m.c[j]);
+
+  Vec3f half(0.5f, 0.5f, 0.5f);
+  for (size_t i = 0; i < n; i++) {
+    Vec3f center = m.transform_point((mins[i] + maxs[i]) * half);
+    Vec3f extent = abs_m.transform_vector((maxs[i] - mins[i]) * half);
+    out_mins[i] = center - extent;
+    out_maxs[i] = center + extent;
+  }
+}
+
+} // namespace CS248
@@ -1,4 +1,5 @@
 #include "viewer.h"
+#include "glstate.h"
 
 #include <stdio.h>
 #include <cmath>
@@ -115,8 +116,8 @@ void Viewer::init() {
   }
 
   // enable alpha blending
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  GLState::enable(GL_BLEND);
+  GLState::blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
   // resize components to current window size, get DPI
   glfwGetFramebufferSize(window, (int*) &buffer_w, (int*) &buffer_h );
@@ -279,8 +280,9 @@ void Viewer::drawError() {
     glPushMatrix();
     glLoadIdentity();
     glTranslatef(0, 0, -1);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_LIGHTING);
+    GLState::use_program(0);
+    GLState::disable(GL_DEPTH_TEST);
+    GLState::disable(GL_LIGHTING);
     
     // Style based on error type
     std::string errorTitle;
@@ -346,8 +348,8 @@ void Viewer::drawError() {
     glMatrixMode(GL_MODELVIEW);
     glPopMatrix();
     glPopAttrib();
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_LIGHTING);
+    GLState::enable(GL_DEPTH_TEST);
+    GLState::enable(GL_LIGHTING);
 }
 
 
@@ -0,0 +1,142 @@
+#include "CS248/matrix4x4.h"
+#include "CS248/simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+using namespace CS248;
+
+// Times the float (Mat4f) and double (Matrix4x4) versions of the operations
+// the renderer does per frame, and checks that they agree.
+
+#define ITERATIONS 200000
+#define POINTS     4096
+
+static double now_ms() {
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static double rnd() { return rand() / (double) RAND_MAX * 2. - 1.; }
+
+static Matrix4x4 random_affine() {
+  return Matrix4x4::translation(Vector3D(rnd(), rnd(), rnd()) * 10.) *
+         Matrix4x4::rotation(rnd() * 3., Matrix4x4::Axis::X) *
+         Matrix4x4::rotation(rnd() * 3., Matrix4x4::Axis::Y) *
+         Matrix4x4::scaling(Vector3D(1.5 + rnd(), 1.5 + rnd(), 1.5 + rnd()));
+}
+
+static double max_error(const Matrix4x4 &a, const Matrix4x4 &b) {
+  double e = 0.;
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++)
+      e = std::max(e, std::fabs(a(i, j) - b(i, j)));
+  return e;
+}
+
+static void report(const char *name, double double_ms, double float_ms, double error) {
+  printf("%-18s double %8.2f ms   float %8.2f ms   %5.1fx   max error %g\n",
+         name, double_ms, float_ms, double_ms / float_ms, error);
+}
+
+int main(int argc, char *argv[]) {
+
+  srand(1);
+
+  Matrix4x4 A = random_affine();
+  Matrix4x4 B = Matrix4x4::perspective(60., 1.5, 0.1, 100.) *
+                Matrix4x4::look_at(Vector3D(3, 4, 5), Vector3D(0, 0, 0), Vector3D(0, 1, 0));
+  Mat4f Af(A), Bf(B);
+
+  // the sums keep the compiler from dropping the loops
+  double sink = 0.;
+  double t0, t1, t2;
+
+  Matrix4x4 C;
+  Mat4f Cf;
+
+  t0 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { C = B * A; sink += C(1, 1); }
+  t1 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { Cf = Bf * Af; sink += f4_first(Cf.c[1]); }
+  t2 = now_ms();
+  report("multiply", t1 - t0, t2 - t1, max_error((Bf * Af).to_double(), B * A));
+
+  t0 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { C = A.inv(); sink += C(2, 3); }
+  t1 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { Cf = Af.affine_inverse(); sink += f4_first(Cf.c[3]); }
+  t2 = now_ms();
+  report("inverse (affine)", t1 - t0, t2 - t1, max_error(Af.affine_inverse().to_double(), A.inv()));
+
+  t0 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { C = B.T(); sink += C(0, 3); }
+  t1 = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) { Cf = Bf.T(); sink += f4_first(Cf.c[3]); }
+  t2 = now_ms();
+  report("transpose", t1 - t0, t2 - t1, max_error(Bf.T().to_double(), B.T()));
+
+  // batch point and box transforms
+  std::vector<Vector4D> points(POINTS), points_out(POINTS);
+  std::vector<Vec3f> pointsf(POINTS), pointsf_out(POINTS);
+  for (int i = 0; i < POINTS; i++) {
+    Vector3D p(rnd(), rnd(), rnd());
+    points[i] = Vector4D(p, 1.);
+    pointsf[i] = Vec3f(p);
+  }
+
+  int rounds = ITERATIONS / 1000;
+  t0 = now_ms();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < POINTS; i++) points_out[i] = A * points[i];
+    sink += points_out[r].x;
+  }
+  t1 = now_ms();
+  for (int r = 0; r < rounds; r++) {
+    transform_points(Af, &pointsf[0], &pointsf_out[0], POINTS);
+    sink += pointsf_out[r].x();
+  }
+  t2 = now_ms();
+  double error = 0.;
+  for (int i = 0; i < POINTS; i++)
+    error = std::max(error, (pointsf_out[i].to_double() - points_out[i].to3D()).norm());
+  report("points", t1 - t0, t2 - t1, error);
+
+  std::vector<Vec3f> mins(POINTS), maxs(POINTS), out_mins(POINTS), out_maxs(POINTS);
+  for (int i = 0; i < POINTS; i++) {
+    mins[i] = pointsf[i];
+    maxs[i] = pointsf[i] + Vec3f(1.f, 2.f, 0.5f);
+  }
+
+  t0 = now_ms();
+  Vector3D lo, hi;
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < POINTS; i++) {
+      // all eight corners, the way BBox::transform does it
+      Vector3D a = mins[i].to_double(), b = maxs[i].to_double();
+      lo = Vector3D(INF_D, INF_D, INF_D);
+      hi = Vector3D(-INF_D, -INF_D, -INF_D);
+      for (int k = 0; k < 8; k++) {
+        Vector3D c = (A * Vector4D(k & 1 ? b.x : a.x, k & 2 ? b.y : a.y,
+                                   k & 4 ? b.z : a.z, 1.)).to3D();
+        lo = Vector3D(std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z));
+        hi = Vector3D(std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z));
+      }
+    }
+    sink += lo.x + hi.x;
+  }
+  t1 = now_ms();
+  for (int r = 0; r < rounds; r++) {
+    transform_boxes(Af, &mins[0], &maxs[0], &out_mins[0], &out_maxs[0], POINTS);
+    sink += out_mins[r].x();
+  }
+  t2 = now_ms();
+  error = std::max((out_mins[POINTS - 1].to_double() - lo).norm(),
+                   (out_maxs[POINTS - 1].to_double() - hi).norm());
+  report("boxes", t1 - t0, t2 - t1, error);
+
+  printf("(%g)\n", sink);
+  return 0;
+}
@@ -0,0 +1,498 @@
+#version 330 compatibility
+
+//
+// Lighting pass of deferred shading (see DynamicScene::GBuffer), drawn as
+// one triangle over the screen. Every pixel rebuilds the surface from the
+// G-buffer and is lit by the directional lights and the point and spot
+// lights of its light cluster, the screen tile and depth slice it is in.
+// The lighting matches shader_shadow.frag for surfaces flagged
+// GBUFFER_SHADOW_RECEIVER and shader.frag for the others. The surface's
+// depth is written back, so that forward draws after this pass are hidden
+// behind it.
+//
+// Built with IMPOSTOR, it shades the quads of octahedral impostors drawn
+// by impostor.vert instead, lit the same way. Built with SPHERE, the quads
+// of ray-cast spheres drawn by sphere.vert.
+//
+
+//
+// Per-frame shadow transforms, camera and lighting environment. The layout
+// must match FrameUniforms in src/uniform_buffers.h
+//
+
+#define MAX_NUM_LIGHTS 10
+#define NUM_CASCADES 4
+
+// values of shadow_filter, see DynamicScene::Scene::ShadowFilter
+#define SHADOW_FILTER_PCF 0
+#define SHADOW_FILTER_VSM 1
+
+layout(std140) uniform FrameUniforms {
+    vec3  camera_position;                          // world space camera position
+    int   num_directional_lights;
+    int   num_point_lights;
+    int   num_spot_lights;
+    int   num_shadowed_lights;                      // the first spot lights cast shadows
+    vec3  directional_light_vectors[MAX_NUM_LIGHTS];
+    mat4  world2cascade[NUM_CASCADES];              // world to light space transforms of the cascades
+    vec4  cascade_ends;                             // view depth each cascade ends at
+    vec3  camera_direction;                         // world space view direction
+    int   num_cascades;                             // cascades of the first directional light, 0 if unshadowed
+    int   first_cascade_layer;                      // layer of cascade 0 in the shadow map array
+    int   shadow_filter;                            // SHADOW_FILTER_PCF or SHADOW_FILTER_VSM
+    float spot_shadow_near;                         // depth range of the spot light shadow maps
+    float spot_shadow_far;
+    ivec4 cluster_count;                            // light clusters across, up and along the view
+    vec4  cluster_scale;                            // clusters per pixel, depth slice scale and bias
+};
+
+//
+// G-buffer, see gbuffer.frag for the encoding
+//
+
+#define GBUFFER_SHADOW_RECEIVER 1
+#define GBUFFER_MAX_SPEC_EXP    1023.
+
+uniform sampler2D gbufferAlbedo;     // diffuse color, material flags
+uniform sampler2D gbufferNormal;     // octahedral normal, specular exponent
+uniform sampler2D gbufferDepth;
+
+uniform mat4 clip2world;             // inverse of the camera's view-projection
+
+uniform sampler2DArrayShadow shadowTextureArray;  // shadow maps, one layer per shadowed light
+uniform sampler2DArray shadowMomentsArray;        // blurred depth and depth^2 of the same maps (VSM)
+
+//
+// Transform and scale of every shadow map layer (see shader_shadow.frag)
+//
+
+uniform samplerBuffer shadowMapTransforms;
+
+#define SHADOW_MAP_TEXELS 5
+
+mat4 ShadowMapTransform(int layer)
+{
+    int base = SHADOW_MAP_TEXELS * layer;
+    return mat4(texelFetch(shadowMapTransforms, base),
+                texelFetch(shadowMapTransforms, base + 1),
+                texelFetch(shadowMapTransforms, base + 2),
+                texelFetch(shadowMapTransforms, base + 3));
+}
+
+float ShadowMapScale(int layer)
+{
+    return texelFetch(shadowMapTransforms, SHADOW_MAP_TEXELS * layer + 4).x;
+}
+
+//
+// Point and spot lights, binned into clusters of the view frustum (see
+// DynamicScene::LightClusters and shader_shadow.frag)
+//
+
+uniform samplerBuffer  clusterLights;
+uniform usamplerBuffer clusterGrid;          // first index and count per cluster
+uniform usamplerBuffer clusterLightIndices;
+
+#define LIGHT_TEXELS 3
+#define LIGHT_POINT  0.
+#define LIGHT_SPOT   1.
+
+// range of clusterLightIndices of the cluster the surface point p is in
+uvec2 ClusterRange(vec3 p)
+{
+    float view_depth = max(dot(p - camera_position, camera_direction), 1e-6);
+    vec3 c = vec3(gl_FragCoord.xy * cluster_scale.xy, log(view_depth) * cluster_scale.z + cluster_scale.w);
+    ivec3 cluster = clamp(ivec3(floor(c)), ivec3(0), cluster_count.xyz - 1);
+    return texelFetch(clusterGrid, (cluster.z * cluster_count.y + cluster.y) * cluster_count.x + cluster.x).rg;
+}
+
+#define PI 3.14159265358979323846
+
+//
+// OctahedralDecode -- inverse of OctahedralEncode() in gbuffer.frag
+//
+vec3 OctahedralDecode(vec2 e)
+{
+    e = e * 2. - 1.;
+    vec3 n = vec3(e, 1. - abs(e.x) - abs(e.y));
+    if (n.z < 0.) {
+        vec2 signs = vec2(n.x >= 0. ? 1. : -1., n.y >= 0. ? 1. : -1.);
+        n.xy = (1. - abs(n.yx)) * signs;
+    }
+    return normalize(n);
+}
+
+//
+// Phong_BRDF -- as in the mesh shaders
+//
+vec3 Phong_BRDF(vec3 L, vec3 V, vec3 N, vec3 diffuse_color, vec3 specular_color, float specular_exponent)
+{
+    vec3 R = 2. * dot(L, N) * N - L;
+    R = normalize(R);
+
+    if (dot((V + L), N) < 0. || dot(L, N) < 0. || dot(R, V) < 0.) {
+        return diffuse_color * dot(L, N);
+    }
+
+    return (diffuse_color * dot(L, N)) + (specular_color * pow(dot(R, V), specular_exponent));
+}
+
+//
+// VarianceVisibility, CascadeVisibility and SpotVisibility -- shadow
+// lookups of shader_shadow.frag
+//
+#define VSM_MIN_VARIANCE     0.000001
+#define VSM_BLEED_REDUCTION  0.3
+
+float VarianceVisibility(vec3 uv_layer, float depth)
+{
+    vec2 moments = texture(shadowMomentsArray, uv_layer).rg;
+    if (depth <= moments.x)
+        return 1.;
+
+    float variance = max(moments.y - moments.x * moments.x, VSM_MIN_VARIANCE);
+    float d = depth - moments.x;
+    float p_max = variance / (variance + d * d);
+    return clamp((p_max - VSM_BLEED_REDUCTION) / (1. - VSM_BLEED_REDUCTION), 0., 1.);
+}
+
+float CascadeVisibility(vec3 p)
+{
+    float view_depth = dot(p - camera_position, camera_direction);
+    if (view_depth > cascade_ends[num_cascades - 1])
+        return 1.;
+
+    int c = 0;
+    while (c < num_cascades - 1 && view_depth > cascade_ends[c])
+        c++;
+
+    vec3 p_light = (world2cascade[c] * vec4(p, 1)).xyz;
+    float layer = float(first_cascade_layer + c);
+
+    if (shadow_filter == SHADOW_FILTER_VSM)
+        return VarianceVisibility(vec3(p_light.xy, layer), p_light.z);
+
+    float texel = 1. / float(textureSize(shadowTextureArray, 0).x);
+    float lit = 0.;
+    for (int j=0; j<2; j++) {
+        for (int k=0; k<2; k++) {
+            vec2 offset = (vec2(j,k) - 0.5) * texel;
+            lit += texture(shadowTextureArray, vec4(p_light.xy + offset, layer, p_light.z - 0.001));
+        }
+    }
+    return lit / 4.;
+}
+
+float SpotVisibility(vec3 p, int layer)
+{
+    vec4 position_shadowlight = ShadowMapTransform(layer) * vec4(p, 1);
+    vec2 shadow_uv = position_shadowlight.xy / position_shadowlight.w;
+    float surface_depth = (position_shadowlight.z - 0.05) / position_shadowlight.w;
+    float scale = ShadowMapScale(layer);
+    float half_texel = 0.5 / float(textureSize(shadowTextureArray, 0).x);
+
+    if (shadow_filter == SHADOW_FILTER_VSM) {
+        vec2 uv = clamp(shadow_uv, vec2(half_texel), vec2(scale - half_texel));
+        float depth = (position_shadowlight.w - spot_shadow_near) / (spot_shadow_far - spot_shadow_near);
+        return VarianceVisibility(vec3(uv, layer), depth);
+    }
+
+    float pcf_step_size = 256. / 1.5;
+    float visibility = 0.;
+    for (int j=-1; j<=1; j++) {
+        for (int k=-1; k<=1; k++) {
+            vec2 offset = vec2(j,k) / pcf_step_size * scale;
+            vec2 uv = clamp(shadow_uv + offset, vec2(half_texel), vec2(scale - half_texel));
+            visibility += texture(shadowTextureArray, vec4(uv, layer, surface_depth));
+        }
+    }
+    return visibility / 9.;
+}
+
+//
+// Shade -- lights a surface point as shader_shadow.frag does for receivers
+// and as shader.frag does for the others
+//
+vec3 Shade(vec3 position, vec3 diffuseColor, vec3 N, float specularExponent, bool receiver)
+{
+    vec3 specularColor = vec3(1.0, 1.0, 1.0);
+    vec3 V = normalize(camera_position - position);
+
+    vec3 Lo = (receiver ? 0.2 : 0.1) * diffuseColor;   // ambient
+
+    for (int i = 0; i < num_directional_lights; ++i) {
+        vec3 L = normalize(-directional_light_vectors[i]);
+        vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
+        float visibility = 1.;
+        if (receiver && i == 0 && num_cascades > 0)
+            visibility = CascadeVisibility(position);
+        Lo += visibility * brdf_color;
+    }
+
+    uvec2 cluster = ClusterRange(position);
+    for (uint k = cluster.x; k < cluster.x + cluster.y; ++k) {
+        int light = int(texelFetch(clusterLightIndices, int(k)).r);
+        vec4 light_position = texelFetch(clusterLights, LIGHT_TEXELS * light);
+
+        if (light_position.w == LIGHT_POINT) {
+            vec3 light_vector = light_position.xyz - position;
+            float distance = length(light_vector);
+            vec3 brdf_color = Phong_BRDF(normalize(light_vector), V, N, diffuseColor, specularColor, specularExponent);
+            Lo += brdf_color / (0.01 + distance * distance);
+            continue;
+        }
+
+        if (!receiver)
+            continue;  // shader.frag leaves out spot lights
+
+        vec4 spot_direction = texelFetch(clusterLights, LIGHT_TEXELS * light + 1);
+        vec4 spot_intensity = texelFetch(clusterLights, LIGHT_TEXELS * light + 2);
+        vec3 intensity = spot_intensity.rgb;
+        float cone_angle = spot_direction.w;
+
+        vec3 dir_to_surface = position - light_position.xyz;
+        float angle = acos(dot(normalize(dir_to_surface), spot_direction.xyz)) * 180.0 / PI;
+
+        // D^2 falloff, and a linear falloff over the outer 20% of the cone
+        float smoothing = 0.1;
+        if (angle > cone_angle * (1.0 + smoothing))
+            continue;
+        intensity /= 1. + dot(dir_to_surface, dir_to_surface);
+        if (angle >= cone_angle * (1.0 - smoothing))
+            intensity *= 1. - (angle / cone_angle - 0.9) / 0.2;
+
+        int layer = int(spot_intensity.w);
+        if (layer >= 0)
+            intensity *= SpotVisibility(position, layer);
+
+        vec3 L = normalize(-spot_direction.xyz);
+        Lo += intensity * Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
+    }
+
+    return Lo;
+}
+
+#ifdef IMPOSTOR
+
+//
+// Octahedral impostors (see DynamicScene::ImpostorAtlas): the G-buffer
+// textures hold the atlas instead, and the pixels of the quad drawn by
+// impostor.vert look the surface up in the views nearest to the direction
+// the object is seen from. IMPOSTOR_FRAMES and IMPOSTOR_MARGIN must match
+// src/dynamic_scene/impostor_atlas.h
+//
+
+#define IMPOSTOR_FRAMES 8
+#define IMPOSTOR_MARGIN 1.1
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
+
+uniform vec4 impostorSphere;            // world space center and radius
+
+varying vec3 impostor_position;         // world space point on the quad
+
+//
+// OctahedralEncode -- as in gbuffer.frag
+//
+vec2 OctahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.) {
+        vec2 signs = vec2(n.x >= 0. ? 1. : -1., n.y >= 0. ? 1. : -1.);
+        e = (1. - abs(n.yx)) * signs;
+    }
+    return e * 0.5 + 0.5;
+}
+
+//
+// ImpostorBasis -- axes of the view whose eye is in direction d from the
+// center, as ImpostorAtlas::begin_view() builds them
+//
+void ImpostorBasis(vec3 d, out vec3 right, out vec3 up)
+{
+    vec3 ref = abs(d.y) < 0.999 ? vec3(0, 1, 0) : vec3(0, 0, 1);
+    right = normalize(cross(ref, d));
+    up = cross(d, right);
+}
+
+//
+// ImpostorView -- looks the eye ray o + t * ray (o relative to the center)
+// up in view v. The ray is cut with the view's plane through the center,
+// then moved to the depth stored there to make up for parallax. Returns
+// the sample's coverage; albedo and normal_spec come premultiplied by it.
+//
+float ImpostorView(ivec2 v, vec3 o, vec3 ray, float lod_step,
+                   out vec3 albedo, out vec3 normal_spec, out vec3 p, out float flags)
+{
+    vec3 d = OctahedralDecode((vec2(v) + 0.5) / float(IMPOSTOR_FRAMES));
+    vec3 right, up;
+    ImpostorBasis(d, right, up);
+
+    float radius = impostorSphere.w;
+    float rd = dot(ray, d);
+    float od = dot(o, d);
+    if (rd > -1e-3)
+        return 0.;  // seen edge on
+
+    vec2 uv;
+    float t = -od / rd;
+    for (int k = 0; k < 2; k++) {
+        p = o + t * ray;
+        vec2 local = clamp(vec2(dot(p, right), dot(p, up)) / (radius * IMPOSTOR_MARGIN), -1., 1.);
+        uv = (vec2(v) + 0.5 + 0.5 * local) / float(IMPOSTOR_FRAMES);
+
+        // depth 0 is the sphere's side towards the view's eye
+        float depth = textureLod(gbufferDepth, uv, 0.).r;
+        if (depth == 1.)
+            break;
+        t = (-(depth * 2. - 1.) * radius - od) / rd;
+    }
+
+    vec4 a = textureGrad(gbufferAlbedo, uv, vec2(lod_step, 0.), vec2(0., lod_step));
+    vec4 n = textureGrad(gbufferNormal, uv, vec2(lod_step, 0.), vec2(0., lod_step));
+    albedo = a.rgb;
+    normal_spec = n.rgb;
+    flags = textureLod(gbufferAlbedo, uv, 0.).a;
+    return 1. - a.a;
+}
+
+void main(void)
+{
+    vec3 center = impostorSphere.xyz;
+    float radius = impostorSphere.w;
+    vec3 o = camera_position - center;
+    vec3 ray = normalize(impostor_position - camera_position);
+
+    // atlas texels per pixel, from how far the quad moves per pixel
+    float pixel = max(length(dFdx(impostor_position)), length(dFdy(impostor_position)));
+    float lod_step = pixel / (2. * radius * IMPOSTOR_MARGIN * float(IMPOSTOR_FRAMES));
+
+    // the four views around the direction the object is seen from,
+    // weighted bilinearly over the octahedral grid
+    vec2 g = OctahedralEncode(normalize(o)) * float(IMPOSTOR_FRAMES) - 0.5;
+    ivec2 base = ivec2(floor(g));
+    vec2 f = g - vec2(base);
+
+    float coverage = 0.;
+    vec3 albedo = vec3(0.);
+    vec3 N = vec3(0.);
+    float spec = 0.;
+    vec3 p = vec3(0.);
+    float flags = 0.;
+    float best = 0.;
+    for (int k = 0; k < 4; k++) {
+        ivec2 corner = ivec2(k & 1, k >> 1);
+        ivec2 v = clamp(base + corner, ivec2(0), ivec2(IMPOSTOR_FRAMES - 1));
+        vec2 wv = mix(1. - f, f, vec2(corner));
+        float w = wv.x * wv.y;
+
+        vec3 a, ns, pk;
+        float fk;
+        float c = w * ImpostorView(v, o, ray, lod_step, a, ns, pk, fk);
+        if (c <= 0.)
+            continue;
+        coverage += c;
+        albedo += w * a;
+        N += c * OctahedralDecode(ns.rg * w / c);
+        spec += w * ns.b;
+        p += c * pk;
+        if (c > best) {
+            best = c;
+            flags = fk;
+        }
+    }
+
+    if (coverage < 0.5)
+        discard;
+
+    vec3 position = center + p / coverage;
+    bool receiver = (int(flags * 255. + 0.5) & GBUFFER_SHADOW_RECEIVER) != 0;
+    float specularExponent = spec / coverage * GBUFFER_MAX_SPEC_EXP;
+    gl_FragColor = vec4(Shade(position, albedo / coverage, normalize(N), specularExponent, receiver), 1);
+
+    vec4 clip = view_projection * vec4(position, 1);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
+
+#elif defined(SPHERE)
+
+//
+// Ray-cast spheres (see DynamicScene::Sphere): every pixel of a quad drawn
+// by sphere.vert cuts the ray through it with the exact sphere, misses are
+// discarded and hits are lit like shadow receivers, writing the depth of
+// the hit. Built with SPHERE_DEPTH as well it only writes the depth of the
+// sphere's far side, for shadow maps: polygon offset doesn't move written
+// depths, and this keeps the lit side from shadowing itself.
+//
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
+
+flat in vec4 sphere;                    // world space center and radius
+flat in vec4 material;                  // diffuse color, specular exponent
+varying vec3 sphere_position;           // world space point on the quad
+
+void main(void)
+{
+    vec3 center = sphere.xyz;
+    float radius = sphere.w;
+
+    // the ray from the eye, or along the view through the quad
+    vec3 origin = sphere_position;
+    vec3 ray = -eye.xyz;
+    if (eye.w != 0.) {
+        origin = eye.xyz;
+        ray = normalize(sphere_position - eye.xyz);
+    }
+
+    vec3 oc = origin - center;
+    float b = dot(oc, ray);
+    float h = b * b - dot(oc, oc) + radius * radius;
+    if (h < 0.)
+        discard;
+
+#ifdef SPHERE_DEPTH
+    vec3 position = origin + (-b + sqrt(h)) * ray;
+#else
+    vec3 position = origin + (-b - sqrt(h)) * ray;
+    vec3 N = (position - center) / radius;
+    gl_FragColor = vec4(Shade(position, material.rgb, N, material.a, true), 1);
+#endif
+
+    vec4 clip = view_projection * vec4(position, 1);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
+
+#else
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gbufferDepth, pixel, 0).r;
+    if (depth == 1.)
+        discard;  // no surface
+
+    vec4 albedo = texelFetch(gbufferAlbedo, pixel, 0);
+    vec4 normal_spec = texelFetch(gbufferNormal, pixel, 0);
+    int flags = int(albedo.a * 255. + 0.5);
+    bool receiver = (flags & GBUFFER_SHADOW_RECEIVER) != 0;
+
+    // window coordinates and depth back to world space
+    vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gbufferDepth, 0)) * 2. - 1.;
+    vec4 p = clip2world * vec4(ndc, depth * 2. - 1., 1.);
+    vec3 position = p.xyz / p.w;
+
+    float specularExponent = normal_spec.b * GBUFFER_MAX_SPEC_EXP;
+    vec3 N = OctahedralDecode(normal_spec.rg);
+
+    gl_FragColor = vec4(Shade(position, albedo.rgb, N, specularExponent, receiver), 1);
+    gl_FragDepth = depth;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#version 330 compatibility
+
+//
+// Plain grey material meshes are drawn with while their own program is
+// still being compiled (see DynamicScene::Scene::get_ready_shader()). It
+// pairs with any of the mesh vertex shaders and only needs their world
+// space outputs: no textures, lights or uniforms.
+//
+
+varying vec3 position;                  // world space position
+varying vec3 dir2camera;                // world space vector from surface point to camera
+
+void main(void)
+{
+    // facet normal from the screen space derivatives of the position, lit
+    // from the camera
+    vec3 N = normalize(cross(dFdx(position), dFdy(position)));
+    float ndotv = abs(dot(N, normalize(dir2camera)));
+    gl_FragColor = vec4(vec3(0.5) * (0.3 + 0.7 * ndotv), 1.0);
+}
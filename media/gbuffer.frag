@@ -0,0 +1,99 @@
+#version 330 compatibility
+
+//
+// Geometry pass of deferred shading (see DynamicScene::GBuffer). Pairs
+// with the mesh vertex shaders and evaluates the same material inputs as
+// shader.frag and shader_shadow.frag -- albedo, normal and specular
+// exponent -- but stores them instead of lighting the surface; that is
+// left to deferred_lighting.frag. Mirror materials aren't drawn with it.
+//
+// Always built as a permutation (see
+// DynamicScene::Scene::get_gbuffer_shader_permutation()), with
+// SHADOW_RECEIVER true for meshes whose own program is shadowed.
+//
+
+#ifdef MULTI_DRAW
+
+struct ObjectData {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+layout(std430) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+flat in int object_index;        // entry of objects[] this draw uses
+
+#define spec_exp                objects[object_index].spec_exp
+
+#else
+
+// the layout must match ObjectUniforms in src/uniform_buffers.h
+layout(std140) uniform ObjectUniforms {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+#endif
+
+#define GBUFFER_SHADOW_RECEIVER 1
+#define GBUFFER_MAX_SPEC_EXP    1023.
+
+uniform sampler2D diffuseTextureSampler;
+uniform sampler2D normalTextureSampler;
+
+varying vec3 normal;
+varying vec2 texcoord;
+varying mat3 tan2world;
+varying vec3 vertex_diffuse_color;
+
+//
+// OctahedralEncode -- maps a unit vector to [0,1]^2 by projecting it onto
+// the octahedron |x| + |y| + |z| = 1 and folding the lower half over the
+// upper one
+//
+vec2 OctahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.) {
+        vec2 signs = vec2(n.x >= 0. ? 1. : -1., n.y >= 0. ? 1. : -1.);
+        e = (1. - abs(n.yx)) * signs;
+    }
+    return e * 0.5 + 0.5;
+}
+
+void main(void)
+{
+    vec3 diffuseColor;
+    if (TEXTURE_MAPPING) {
+        diffuseColor = texture2D(diffuseTextureSampler, texcoord).rgb;
+    } else {
+        diffuseColor = vertex_diffuse_color;
+    }
+
+    vec3 N;
+    if (NORMAL_MAPPING) {
+        vec3 normalVal = texture2D(normalTextureSampler, texcoord).rgb * 2.0 - 1.0;
+        N = normalize(tan2world * normalize(normalVal));
+    } else {
+        N = normalize(normal);
+    }
+
+    int flags = SHADOW_RECEIVER ? GBUFFER_SHADOW_RECEIVER : 0;
+    float spec = clamp(floor(spec_exp + 0.5), 0., GBUFFER_MAX_SPEC_EXP);
+
+    gl_FragData[0] = vec4(diffuseColor, float(flags) / 255.);
+    gl_FragData[1] = vec4(OctahedralEncode(N), spec / GBUFFER_MAX_SPEC_EXP, 1.);
+}
@@ -0,0 +1,67 @@
+#version 330 compatibility
+
+//
+// Camera-facing quad of an octahedral impostor (see
+// DynamicScene::ImpostorAtlas), drawn with corners (+-1, +-1). It covers
+// the outline of the object's bounding sphere as the camera sees it;
+// deferred_lighting.frag, built with IMPOSTOR, shades it from the atlas.
+//
+
+//
+// World to clip space transform of the camera. The layout must match
+// PassUniforms in src/uniform_buffers.h
+//
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
+
+//
+// Per-frame camera and lighting environment, only the camera position is
+// used here. The layout must match FrameUniforms in src/uniform_buffers.h
+//
+
+#define MAX_NUM_LIGHTS 10
+#define NUM_CASCADES 4
+
+layout(std140) uniform FrameUniforms {
+    vec3  camera_position;                          // world space camera position
+    int   num_directional_lights;
+    int   num_point_lights;
+    int   num_spot_lights;
+    int   num_shadowed_lights;                      // the first spot lights cast shadows
+    vec3  directional_light_vectors[MAX_NUM_LIGHTS];
+    mat4  world2cascade[NUM_CASCADES];              // world to light space transforms of the cascades
+    vec4  cascade_ends;                             // view depth each cascade ends at
+    vec3  camera_direction;                         // world space view direction
+    int   num_cascades;                             // cascades of the first directional light, 0 if unshadowed
+    int   first_cascade_layer;                      // layer of cascade 0 in the shadow map array
+    int   shadow_filter;                            // SHADOW_FILTER_PCF or SHADOW_FILTER_VSM
+    float spot_shadow_near;                         // depth range of the spot light shadow maps
+    float spot_shadow_far;
+    ivec4 cluster_count;                            // light clusters across, up and along the view
+    vec4  cluster_scale;                            // clusters per pixel, depth slice scale and bias
+};
+
+uniform vec4 impostorSphere;            // world space center and radius
+
+varying vec3 impostor_position;         // world space point on the quad
+
+void main() {
+    vec3 center = impostorSphere.xyz;
+    float radius = impostorSphere.w;
+    vec3 to_eye = camera_position - center;
+    float dist = length(to_eye);
+
+    vec3 d = to_eye / dist;
+    vec3 ref = abs(d.y) < 0.999 ? vec3(0, 1, 0) : vec3(0, 0, 1);
+    vec3 right = normalize(cross(ref, d));
+    vec3 up = cross(d, right);
+
+    // radius of the sphere's outline in the plane through its center
+    float extent = radius * dist / sqrt(max(dist * dist - radius * radius, 1e-6));
+
+    impostor_position = center + (gl_Vertex.x * right + gl_Vertex.y * up) * extent;
+    gl_Position = view_projection * vec4(impostor_position, 1);
+}
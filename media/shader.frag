@@ -1,12 +1,101 @@
+#version 330 compatibility
+
+//
+// Per-object transforms and material parameters. Different materials will
+// set the flags to true/false for different looks. The layout must match
+// ObjectUniforms in src/uniform_buffers.h. When meshes are drawn in batches
+// (MULTI_DRAW), every draw of a batch reads its own entry of ObjectBuffer.
+//
+
+#ifdef MULTI_DRAW
+
+struct ObjectData {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+layout(std430) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+flat in int object_index;        // entry of objects[] this draw uses
+
+#define obj2world               objects[object_index].obj2world
+#define obj2worldNorm           objects[object_index].obj2worldNorm
+#define useTextureMapping       objects[object_index].useTextureMapping
+#define useNormalMapping        objects[object_index].useNormalMapping
+#define useEnvironmentMapping   objects[object_index].useEnvironmentMapping
+#define useMirrorBRDF           objects[object_index].useMirrorBRDF
+#define spec_exp                objects[object_index].spec_exp
+
+#else
+
+layout(std140) uniform ObjectUniforms {
+    mat4  obj2world;                // object to world space transform
+    mat3  obj2worldNorm;            // object to world transform for normals
+    bool  useTextureMapping;        // true if basic texture mapping (diffuse) should be used
+    bool  useNormalMapping;         // true if normal mapping should be used
+    bool  useEnvironmentMapping;    // true if environment mapping should be used
+    bool  useMirrorBRDF;            // true if mirror brdf should be used (default: phong)
+    float spec_exp;                 // parameter to Phong BRDF
+};
+
+#endif
+
+//
+// Per-frame shadow transforms, camera and lighting environment. Scenes may
+// contain directional, point and spot light sources. The layout must match
+// FrameUniforms in src/uniform_buffers.h
+//
+
+#define MAX_NUM_LIGHTS 10
+#define NUM_CASCADES 4
+
+layout(std140) uniform FrameUniforms {
+    vec3  camera_position;                          // world space camera position
+    int   num_directional_lights;
+    int   num_point_lights;
+    int   num_spot_lights;
+    int   num_shadowed_lights;                      // the first spot lights cast shadows
+    vec3  directional_light_vectors[MAX_NUM_LIGHTS];
+    mat4  world2cascade[NUM_CASCADES];              // world to light space transforms of the cascades
+    vec4  cascade_ends;                             // view depth each cascade ends at
+    vec3  camera_direction;                         // world space view direction
+    int   num_cascades;                             // cascades of the first directional light, 0 if unshadowed
+    int   first_cascade_layer;                      // layer of cascade 0 in the shadow map array
+    int   shadow_filter;                            // SHADOW_FILTER_PCF or SHADOW_FILTER_VSM
+    float spot_shadow_near;                         // depth range of the spot light shadow maps
+    float spot_shadow_far;
+    ivec4 cluster_count;                            // light clusters across, up and along the view
+    vec4  cluster_scale;                            // clusters per pixel, depth slice scale and bias
+};
+
+#ifdef PERMUTATION
+
 //
-// Parameters that control fragment shader behavior. Different materials
-// will set these flags to true/false for different looks
+// Material features and the directional light count compiled in as
+// constants (see DynamicScene::Scene::get_shader_permutation()), so that
+// branches and loops on them are resolved by the compiler
 //
 
-uniform bool useTextureMapping;     // true if basic texture mapping (diffuse) should be used
-uniform bool useNormalMapping;      // true if normal mapping should be used
-uniform bool useEnvironmentMapping; // true if environment mapping should be used
-uniform bool useMirrorBRDF;         // true if mirror brdf should be used (default: phong)
+#undef useTextureMapping
+#undef useNormalMapping
+#undef useEnvironmentMapping
+#undef useMirrorBRDF
+
+#define useTextureMapping       TEXTURE_MAPPING
+#define useNormalMapping        NORMAL_MAPPING
+#define useEnvironmentMapping   ENVIRONMENT_MAPPING
+#define useMirrorBRDF           MIRROR_BRDF
+
+#define num_directional_lights  NUM_DIRECTIONAL_LIGHTS
+
+#endif
 
 //
 // texture maps
@@ -17,22 +106,32 @@ uniform sampler2D normalTextureSampler;
 uniform sampler2D environmentTextureSampler;
 
 //
-// lighting environment definition. Scenes may contain directional
-// and point light sources, as well as an environment map
+// Point and spot lights, binned into clusters of the view frustum (see
+// DynamicScene::LightClusters). Each cluster has a range of
+// clusterLightIndices that lists the lights reaching into it. Every light
+// takes LIGHT_TEXELS texels of clusterLights:
+//
+//   position, LIGHT_POINT or LIGHT_SPOT
+//   spot light direction, cone angle (degrees)
+//   spot light intensity, shadow map layer (-1 if unshadowed)
 //
 
-#define MAX_NUM_LIGHTS 10
-uniform int num_directional_lights;
-uniform vec3 directional_light_vectors[MAX_NUM_LIGHTS];
-uniform int num_point_lights;
-uniform vec3 point_light_positions[MAX_NUM_LIGHTS];
+uniform samplerBuffer  clusterLights;
+uniform usamplerBuffer clusterGrid;          // first index and count per cluster
+uniform usamplerBuffer clusterLightIndices;
 
-//
-// material-specific uniforms
-//
+#define LIGHT_TEXELS 3
+#define LIGHT_POINT  0.
+#define LIGHT_SPOT   1.
 
-// parameters to Phong BRDF
-uniform float spec_exp;
+// range of clusterLightIndices of the cluster the surface point p is in
+uvec2 ClusterRange(vec3 p)
+{
+    float view_depth = max(dot(p - camera_position, camera_direction), 1e-6);
+    vec3 c = vec3(gl_FragCoord.xy * cluster_scale.xy, log(view_depth) * cluster_scale.z + cluster_scale.w);
+    ivec3 cluster = clamp(ivec3(floor(c)), ivec3(0), cluster_count.xyz - 1);
+    return texelFetch(clusterGrid, (cluster.z * cluster_count.y + cluster.y) * cluster_count.x + cluster.x).rg;
+}
 
 // values that are varying per fragment (computed by the vertex shader)
 
@@ -214,9 +313,16 @@ void main(void)
 	    Lo += light_magnitude * brdf_color;
     }
 
-    // for all point lights
-    for (int i = 0; i < num_point_lights; ++i) {
-		vec3 light_vector = point_light_positions[i] - position;
+    // for the point lights of the fragment's cluster (this shader leaves
+    // out spot lights)
+    uvec2 cluster = ClusterRange(position);
+    for (uint k = cluster.x; k < cluster.x + cluster.y; ++k) {
+        int light = int(texelFetch(clusterLightIndices, int(k)).r);
+        vec4 light_position = texelFetch(clusterLights, LIGHT_TEXELS * light);
+        if (light_position.w != LIGHT_POINT)
+            continue;
+
+		vec3 light_vector = light_position.xyz - position;
         vec3 L = normalize(light_vector);
         float distance = length(light_vector);
         vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
@@ -1,8 +1,111 @@
-uniform mat4 obj2world;                 // object to world transform
-uniform mat3 obj2worldNorm;             // object to world transform for normals
-uniform vec3 camera_position;           // world space camera position           
+#version 330 compatibility
 
-uniform bool useNormalMapping;         // true if normal mapping should be used
+//
+// Per-object transforms and material parameters. Different materials will
+// set the flags to true/false for different looks. The layout must match
+// ObjectUniforms in src/uniform_buffers.h. When meshes are drawn in batches
+// (MULTI_DRAW), every draw of a batch reads its own entry of ObjectBuffer.
+//
+
+#ifdef MULTI_DRAW
+
+struct ObjectData {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+layout(std430) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+flat out int object_index;       // entry of objects[] this draw uses
+
+#define obj2world               objects[object_index].obj2world
+#define obj2worldNorm           objects[object_index].obj2worldNorm
+#define useTextureMapping       objects[object_index].useTextureMapping
+#define useNormalMapping        objects[object_index].useNormalMapping
+#define useEnvironmentMapping   objects[object_index].useEnvironmentMapping
+#define useMirrorBRDF           objects[object_index].useMirrorBRDF
+#define spec_exp                objects[object_index].spec_exp
+
+#else
+
+layout(std140) uniform ObjectUniforms {
+    mat4  obj2world;                // object to world space transform
+    mat3  obj2worldNorm;            // object to world transform for normals
+    bool  useTextureMapping;        // true if basic texture mapping (diffuse) should be used
+    bool  useNormalMapping;         // true if normal mapping should be used
+    bool  useEnvironmentMapping;    // true if environment mapping should be used
+    bool  useMirrorBRDF;            // true if mirror brdf should be used (default: phong)
+    float spec_exp;                 // parameter to Phong BRDF
+};
+
+#endif
+
+//
+// Per-pass world to clip space transform of the camera (or of the light, in
+// shadow passes). The layout must match PassUniforms in src/uniform_buffers.h
+//
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
+
+//
+// Per-frame shadow transforms, camera and lighting environment. Scenes may
+// contain directional, point and spot light sources. The layout must match
+// FrameUniforms in src/uniform_buffers.h
+//
+
+#define MAX_NUM_LIGHTS 10
+#define NUM_CASCADES 4
+
+layout(std140) uniform FrameUniforms {
+    vec3  camera_position;                          // world space camera position
+    int   num_directional_lights;
+    int   num_point_lights;
+    int   num_spot_lights;
+    int   num_shadowed_lights;                      // the first spot lights cast shadows
+    vec3  directional_light_vectors[MAX_NUM_LIGHTS];
+    mat4  world2cascade[NUM_CASCADES];              // world to light space transforms of the cascades
+    vec4  cascade_ends;                             // view depth each cascade ends at
+    vec3  camera_direction;                         // world space view direction
+    int   num_cascades;                             // cascades of the first directional light, 0 if unshadowed
+    int   first_cascade_layer;                      // layer of cascade 0 in the shadow map array
+    int   shadow_filter;                            // SHADOW_FILTER_PCF or SHADOW_FILTER_VSM
+    float spot_shadow_near;                         // depth range of the spot light shadow maps
+    float spot_shadow_far;
+    ivec4 cluster_count;                            // light clusters across, up and along the view
+    vec4  cluster_scale;                            // clusters per pixel, depth slice scale and bias
+};
+
+#ifdef PERMUTATION
+
+//
+// Material features and the directional light count compiled in as
+// constants (see DynamicScene::Scene::get_shader_permutation()), so that
+// branches and loops on them are resolved by the compiler
+//
+
+#undef useTextureMapping
+#undef useNormalMapping
+#undef useEnvironmentMapping
+#undef useMirrorBRDF
+
+#define useTextureMapping       TEXTURE_MAPPING
+#define useNormalMapping        NORMAL_MAPPING
+#define useEnvironmentMapping   ENVIRONMENT_MAPPING
+#define useMirrorBRDF           MIRROR_BRDF
+
+#define num_directional_lights  NUM_DIRECTIONAL_LIGHTS
+
+#endif
 
 // per vertex input attributes 
 attribute vec3 vtx_position;            // object space position
@@ -20,8 +123,16 @@ varying vec2 texcoord;
 varying vec3 dir2camera;                // world space vector from surface point to camera
 varying mat3 tan2world;                 // tangent space rotation matrix multiplied by obj2WorldNorm
 
+// computed exactly as in shadow_pass.vert, which draws the depth the color
+// pass is tested against for equality after a depth prepass
+invariant gl_Position;
+
 void main(void)
 {
+#ifdef MULTI_DRAW
+    object_index = gl_DrawIDARB;
+#endif
+
     position = vec3(obj2world * vec4(vtx_position, 1));
 
     if (useNormalMapping) {
@@ -65,5 +176,5 @@ void main(void)
     vertex_diffuse_color = vtx_diffuse_color;
     texcoord = vtx_texcoord;
     dir2camera = camera_position - position;
-    gl_Position = gl_ModelViewProjectionMatrix * vec4(vtx_position, 1);
+    gl_Position = view_projection * vec4(position, 1);
 }
@@ -1,12 +1,105 @@
+#version 330 compatibility
+
+//
+// Per-object transforms and material parameters. Different materials will
+// set the flags to true/false for different looks. The layout must match
+// ObjectUniforms in src/uniform_buffers.h. When meshes are drawn in batches
+// (MULTI_DRAW), every draw of a batch reads its own entry of ObjectBuffer.
+//
+
+#ifdef MULTI_DRAW
+
+struct ObjectData {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+layout(std430) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+flat in int object_index;        // entry of objects[] this draw uses
+
+#define obj2world               objects[object_index].obj2world
+#define obj2worldNorm           objects[object_index].obj2worldNorm
+#define useTextureMapping       objects[object_index].useTextureMapping
+#define useNormalMapping        objects[object_index].useNormalMapping
+#define useEnvironmentMapping   objects[object_index].useEnvironmentMapping
+#define useMirrorBRDF           objects[object_index].useMirrorBRDF
+#define spec_exp                objects[object_index].spec_exp
+
+#else
+
+layout(std140) uniform ObjectUniforms {
+    mat4  obj2world;                // object to world space transform
+    mat3  obj2worldNorm;            // object to world transform for normals
+    bool  useTextureMapping;        // true if basic texture mapping (diffuse) should be used
+    bool  useNormalMapping;         // true if normal mapping should be used
+    bool  useEnvironmentMapping;    // true if environment mapping should be used
+    bool  useMirrorBRDF;            // true if mirror brdf should be used (default: phong)
+    float spec_exp;                 // parameter to Phong BRDF
+};
+
+#endif
+
 //
-// Parameters that control fragment shader behavior. Different materials
-// will set these flags to true/false for different looks
+// Per-frame shadow transforms, camera and lighting environment. Scenes may
+// contain directional, point and spot light sources. The layout must match
+// FrameUniforms in src/uniform_buffers.h
 //
 
-uniform bool useTextureMapping;     // true if basic texture mapping (diffuse) should be used
-uniform bool useNormalMapping;      // true if normal mapping should be used
-uniform bool useEnvironmentMapping; // true if environment mapping should be used
-uniform bool useMirrorBRDF;         // true if mirror brdf should be used (default: phong)
+#define MAX_NUM_LIGHTS 10
+#define NUM_CASCADES 4
+
+// values of shadow_filter, see DynamicScene::Scene::ShadowFilter
+#define SHADOW_FILTER_PCF 0
+#define SHADOW_FILTER_VSM 1
+
+layout(std140) uniform FrameUniforms {
+    vec3  camera_position;                          // world space camera position
+    int   num_directional_lights;
+    int   num_point_lights;
+    int   num_spot_lights;
+    int   num_shadowed_lights;                      // the first spot lights cast shadows
+    vec3  directional_light_vectors[MAX_NUM_LIGHTS];
+    mat4  world2cascade[NUM_CASCADES];              // world to light space transforms of the cascades
+    vec4  cascade_ends;                             // view depth each cascade ends at
+    vec3  camera_direction;                         // world space view direction
+    int   num_cascades;                             // cascades of the first directional light, 0 if unshadowed
+    int   first_cascade_layer;                      // layer of cascade 0 in the shadow map array
+    int   shadow_filter;                            // SHADOW_FILTER_PCF or SHADOW_FILTER_VSM
+    float spot_shadow_near;                         // depth range of the spot light shadow maps
+    float spot_shadow_far;
+    ivec4 cluster_count;                            // light clusters across, up and along the view
+    vec4  cluster_scale;                            // clusters per pixel, depth slice scale and bias
+};
+
+#ifdef PERMUTATION
+
+//
+// Material features and the directional light count compiled in as
+// constants (see DynamicScene::Scene::get_shader_permutation()), so that
+// branches and loops on them are resolved by the compiler
+//
+
+#undef useTextureMapping
+#undef useNormalMapping
+#undef useEnvironmentMapping
+#undef useMirrorBRDF
+
+#define useTextureMapping       TEXTURE_MAPPING
+#define useNormalMapping        NORMAL_MAPPING
+#define useEnvironmentMapping   ENVIRONMENT_MAPPING
+#define useMirrorBRDF           MIRROR_BRDF
+
+#define num_directional_lights  NUM_DIRECTIONAL_LIGHTS
+
+#endif
 
 //
 // texture maps
@@ -16,35 +109,63 @@ uniform sampler2D diffuseTextureSampler;
 uniform sampler2D normalTextureSampler;
 uniform sampler2D environmentTextureSampler;
 
-uniform sampler2D shadowTextureSampler0;
-uniform sampler2D shadowTextureSampler1;
-
+uniform sampler2DArrayShadow shadowTextureArray;  // shadow maps, one layer per shadowed light
+uniform sampler2DArray shadowMomentsArray;        // blurred depth and depth^2 of the same maps (VSM)
 
 //
-// lighting environment definition. Scenes may contain directional
-// and point light sources, as well as an environment map
+// World to light space transform and scale of every shadow map layer (see
+// DynamicScene::Scene::update_frame_uniforms), SHADOW_MAP_TEXELS texels per
+// layer: the four columns of the transform, then the part of its layer the
+// map uses in x. The number of maps is only bounded by the shadow memory
+// budget, so they are not part of FrameUniforms.
 //
 
-#define MAX_NUM_LIGHTS 10
-uniform int  num_directional_lights;
-uniform vec3 directional_light_vectors[MAX_NUM_LIGHTS];
+uniform samplerBuffer shadowMapTransforms;
 
-uniform int  num_point_lights;
-uniform vec3 point_light_positions[MAX_NUM_LIGHTS];
+#define SHADOW_MAP_TEXELS 5
 
-uniform int   num_spot_lights;
-uniform vec3  spot_light_positions[MAX_NUM_LIGHTS];
-uniform vec3  spot_light_directions[MAX_NUM_LIGHTS];
-uniform vec3  spot_light_intensities[MAX_NUM_LIGHTS];
-uniform float spot_light_angles[MAX_NUM_LIGHTS];
+mat4 ShadowMapTransform(int layer)
+{
+    int base = SHADOW_MAP_TEXELS * layer;
+    return mat4(texelFetch(shadowMapTransforms, base),
+                texelFetch(shadowMapTransforms, base + 1),
+                texelFetch(shadowMapTransforms, base + 2),
+                texelFetch(shadowMapTransforms, base + 3));
+}
 
+float ShadowMapScale(int layer)
+{
+    return texelFetch(shadowMapTransforms, SHADOW_MAP_TEXELS * layer + 4).x;
+}
 
 //
-// material-specific uniforms
+// Point and spot lights, binned into clusters of the view frustum (see
+// DynamicScene::LightClusters). Each cluster has a range of
+// clusterLightIndices that lists the lights reaching into it. Every light
+// takes LIGHT_TEXELS texels of clusterLights:
+//
+//   position, LIGHT_POINT or LIGHT_SPOT
+//   spot light direction, cone angle (degrees)
+//   spot light intensity, shadow map layer (-1 if unshadowed)
 //
 
-// parameters to Phong BRDF
-uniform float spec_exp;
+uniform samplerBuffer  clusterLights;
+uniform usamplerBuffer clusterGrid;          // first index and count per cluster
+uniform usamplerBuffer clusterLightIndices;
+
+#define LIGHT_TEXELS 3
+#define LIGHT_POINT  0.
+#define LIGHT_SPOT   1.
+
+// range of clusterLightIndices of the cluster the surface point p is in
+uvec2 ClusterRange(vec3 p)
+{
+    float view_depth = max(dot(p - camera_position, camera_direction), 1e-6);
+    vec3 c = vec3(gl_FragCoord.xy * cluster_scale.xy, log(view_depth) * cluster_scale.z + cluster_scale.w);
+    ivec3 cluster = clamp(ivec3(floor(c)), ivec3(0), cluster_count.xyz - 1);
+    return texelFetch(clusterGrid, (cluster.z * cluster_count.y + cluster.y) * cluster_count.x + cluster.x).rg;
+}
+
 
 // values that are varying per fragment (computed by the vertex shader)
 
@@ -55,9 +176,6 @@ varying vec3 dir2camera;   // vector from surface point to camera
 varying mat3 tan2world;    // tangent space to world space transform
 varying vec3 vertex_diffuse_color; // surface color
 
-varying vec4 position_shadowlight0; // surface position in light space
-varying vec4 position_shadowlight1; // surface position in light space
-
 #define PI 3.14159265358979323846
 
 
@@ -100,6 +218,66 @@ vec3 Phong_BRDF(vec3 L, vec3 V, vec3 N, vec3 diffuse_color, vec3 specular_color,
     return diffuse_color;
 }
 
+//
+// VarianceVisibility --
+//
+// Upper bound on the fraction of light that gets past the occluders of a
+// variance shadow map texel (Chebyshev's inequality), for a receiver at
+// the given depth. The bound is remapped to cut off the light that leaks
+// through where occluders overlap.
+//
+#define VSM_MIN_VARIANCE     0.000001
+#define VSM_BLEED_REDUCTION  0.3
+
+float VarianceVisibility(vec3 uv_layer, float depth)
+{
+    vec2 moments = texture(shadowMomentsArray, uv_layer).rg;
+    if (depth <= moments.x)
+        return 1.;
+
+    float variance = max(moments.y - moments.x * moments.x, VSM_MIN_VARIANCE);
+    float d = depth - moments.x;
+    float p_max = variance / (variance + d * d);
+    return clamp((p_max - VSM_BLEED_REDUCTION) / (1. - VSM_BLEED_REDUCTION), 0., 1.);
+}
+
+//
+// CascadeVisibility --
+//
+// Fraction of the first directional light that reaches the surface point,
+// looked up in the cascade covering the point's view depth: four filtered
+// comparisons (3x3 texels), or one VSM fetch. Points beyond the last
+// cascade are lit.
+//
+float CascadeVisibility(vec3 p)
+{
+    float view_depth = dot(p - camera_position, camera_direction);
+    if (view_depth > cascade_ends[num_cascades - 1])
+        return 1.;
+
+    int c = 0;
+    while (c < num_cascades - 1 && view_depth > cascade_ends[c])
+        c++;
+
+    // orthographic, so no divide by w
+    vec3 p_light = (world2cascade[c] * vec4(p, 1)).xyz;
+    float layer = float(first_cascade_layer + c);
+
+    // orthographic depth is linear already
+    if (shadow_filter == SHADOW_FILTER_VSM)
+        return VarianceVisibility(vec3(p_light.xy, layer), p_light.z);
+
+    float texel = 1. / float(textureSize(shadowTextureArray, 0).x);
+    float lit = 0.;
+    for (int j=0; j<2; j++) {
+        for (int k=0; k<2; k++) {
+            vec2 offset = (vec2(j,k) - 0.5) * texel;
+            lit += texture(shadowTextureArray, vec4(p_light.xy + offset, layer, p_light.z - 0.001));
+        }
+    }
+    return lit / 4.;
+}
+
 //
 // SampleEnvironmentMap -- returns incoming radiance from specified direction
 //
@@ -212,30 +390,39 @@ void main(void)
 	for (int i = 0; i < num_directional_lights; ++i) {
 	    vec3 L = normalize(-directional_light_vectors[i]);
 		vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
-	    Lo += light_magnitude * brdf_color;
+	    float visibility = 1.;
+	    if (i == 0 && num_cascades > 0)
+	        visibility = CascadeVisibility(position);
+	    Lo += visibility * light_magnitude * brdf_color;
     }
 
-    // for all point lights
-    for (int i = 0; i < num_point_lights; ++i) {
-		vec3 light_vector = point_light_positions[i] - position;
-        vec3 L = normalize(light_vector);
-        float distance = length(light_vector);
-        vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
-        float falloff = 1.0 / (0.01 + distance * distance);
-        Lo += light_magnitude * falloff * brdf_color;
-    }
+    // for the point and spot lights of the fragment's cluster
+    uvec2 cluster = ClusterRange(position);
+    for (uint k = cluster.x; k < cluster.x + cluster.y; ++k) {
+        int light = int(texelFetch(clusterLightIndices, int(k)).r);
+        vec4 light_position = texelFetch(clusterLights, LIGHT_TEXELS * light);
+
+        if (light_position.w == LIGHT_POINT) {
+            vec3 light_vector = light_position.xyz - position;
+            vec3 L = normalize(light_vector);
+            float distance = length(light_vector);
+            vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
+            float falloff = 1.0 / (0.01 + distance * distance);
+            Lo += light_magnitude * falloff * brdf_color;
+            continue;
+        }
 
-    // for all spot lights
-	for (int i = 0; i < num_spot_lights; ++i) {
+        vec4 spot_direction = texelFetch(clusterLights, LIGHT_TEXELS * light + 1);
+        vec4 spot_intensity = texelFetch(clusterLights, LIGHT_TEXELS * light + 2);
     
-        vec3 intensity = spot_light_intensities[i];   // intensity of light: this is intensity in RGB
-        vec3 light_pos = spot_light_positions[i];     // location of spotlight
-        float cone_angle = spot_light_angles[i];      // spotlight falls off to zero in directions whose
+        vec3 intensity = spot_intensity.rgb;          // intensity of light: this is intensity in RGB
+        vec3 light_pos = light_position.xyz;          // location of spotlight
+        float cone_angle = spot_direction.w;          // spotlight falls off to zero in directions whose
                                                       // angle from the light direction is grester than
                                                       // cone angle. Caution: this value is in units of degrees!
 
         vec3 dir_to_surface = position - light_pos;
-        float angle = acos(dot(normalize(dir_to_surface), spot_light_directions[i])) * 180.0 / PI;
+        float angle = acos(dot(normalize(dir_to_surface), spot_direction.xyz)) * 180.0 / PI;
 
         //
         // CS248 TODO: Part 4: compute the attenuation of the spotlight due to two factors:
@@ -283,53 +470,42 @@ void main(void)
             }
         }
 
-        if (i<2) {
-
-           if (i == 0) {
-                // CS248 TODO: Part 4: comute shadowing for spotlight 0 here 
-                float pcf_step_size = 256.;
-                float num_in_shadow = 0.;
-                for (int j=-2; j<=2; j++) {
-                  for (int k=-2; k<=2; k++) {
-                     vec2 offset = vec2(j,k) / pcf_step_size;
-                     // sample shadow map at shadow_uv + offset
-                     // and test if the surface is in shadow according to this sample
-                    vec2 shadow_uv = position_shadowlight0.xy / position_shadowlight0.w;
-                    float shadowVal = texture2D(shadowTextureSampler0, shadow_uv + offset).z;
-                    if (((position_shadowlight0.z - 0.05) / position_shadowlight0.w) > shadowVal) {
-                        num_in_shadow += 1.;
-                    }
+        int layer = int(spot_intensity.w);
+        if (layer >= 0) {
+
+            // CS248 TODO: Part 4: comute shadowing for spotlight i here
+            // (the light's map covers [0, scale]^2 of its layer)
+            vec4 position_shadowlight = ShadowMapTransform(layer) * vec4(position, 1);
+            vec2 shadow_uv = position_shadowlight.xy / position_shadowlight.w;
+            float surface_depth = (position_shadowlight.z - 0.05) / position_shadowlight.w;
+            float scale = ShadowMapScale(layer);
+            float half_texel = 0.5 / float(textureSize(shadowTextureArray, 0).x);
+
+            float visibility = 0.;
+            if (shadow_filter == SHADOW_FILTER_VSM) {
+                // the moments hold depth linear between the near and far plane
+                vec2 uv = clamp(shadow_uv, vec2(half_texel), vec2(scale - half_texel));
+                float depth = (position_shadowlight.w - spot_shadow_near) / (spot_shadow_far - spot_shadow_near);
+                visibility = VarianceVisibility(vec3(uv, layer), depth);
+            } else {
+                float pcf_step_size = 256. / 1.5;
+                for (int j=-1; j<=1; j++) {
+                  for (int k=-1; k<=1; k++) {
+                     vec2 offset = vec2(j,k) / pcf_step_size * scale;
+                     // each lookup at shadow_uv + offset (layer i of the
+                     // array holds spot light i's map) compares the surface depth
+                     // with the 2x2 nearest texels and returns the filtered
+                     // fraction that is lit
+                     vec2 uv = clamp(shadow_uv + offset, vec2(half_texel), vec2(scale - half_texel));
+                     visibility += texture(shadowTextureArray, vec4(uv, layer, surface_depth));
                   }
                 }
-                // record the fraction (out of 25) of shadow tests that are in shadow
-                // and attenuate illumination accordingly
-                float shadow_frac = num_in_shadow / 25.;
-                intensity = intensity * (1. - shadow_frac);
-
-           } else if (i == 1) {
-                // CS248 TODO: Part 4: comute shadowing for spotlight 1 here 
-                float pcf_step_size = 256.;
-                float num_in_shadow = 0.;
-                for (int j=-2; j<=2; j++) {
-                  for (int k=-2; k<=2; k++) {
-                     vec2 offset = vec2(j,k) / pcf_step_size;
-                     // sample shadow map at shadow_uv + offset
-                     // and test if the surface is in shadow according to this sample
-                    vec2 shadow_uv = position_shadowlight1.xy / position_shadowlight1.w;
-                    float shadowVal = texture2D(shadowTextureSampler1, shadow_uv + offset).z;
-                    if (((position_shadowlight1.z - 0.05) / position_shadowlight1.w) > shadowVal) {
-                        num_in_shadow += 1.;
-                    }
-                  }
-                }
-                // record the fraction (out of 25) of shadow tests that are in shadow
-                // and attenuate illumination accordingly
-                float shadow_frac = num_in_shadow / 25.;
-                intensity = intensity * (1. - shadow_frac);
-           }
+                visibility /= 9.;
+            }
+            intensity = intensity * visibility;
         }
 
-	    vec3 L = normalize(-spot_light_directions[i]);
+	    vec3 L = normalize(-spot_direction.xyz);
 		vec3 brdf_color = Phong_BRDF(L, V, N, diffuseColor, specularColor, specularExponent);
 
 	    Lo += intensity * brdf_color;
@@ -0,0 +1,52 @@
+#version 330 compatibility
+
+//
+// One direction of the separable blur that prefilters variance shadow
+// maps. With FROM_DEPTH the pass reads a layer of the shadow map array
+// and writes depth and depth^2 blurred across, otherwise it blurs those
+// moments down. Only the scale x scale corner of a layer holds its map,
+// lookups are clamped to it.
+//
+
+#ifdef FROM_DEPTH
+uniform sampler2DArray source;  // shadow map depths
+#else
+uniform sampler2D source;       // moments blurred across
+#endif
+
+uniform int   layer;         // of source, FROM_DEPTH only
+uniform vec2  blur_step;     // one texel along the blur direction
+uniform float scale;         // part of the layer the map uses
+uniform vec2  depth_range;   // near and far plane of a perspective map, 0 if orthographic
+
+// binomial weights (out of 64) of the texels 0, 1, 2 and 3 away from the center
+const float weights[4] = float[4](20., 15., 6., 1.);
+
+vec2 Moments(vec2 uv, float half_texel) {
+    uv = clamp(uv, vec2(half_texel), vec2(scale - half_texel));
+#ifdef FROM_DEPTH
+    float d = texture(source, vec3(uv, layer)).r;
+    if (depth_range.y > 0.) {
+        // window depth to depth linear between the near and far plane
+        float n = depth_range.x;
+        float f = depth_range.y;
+        float z = 2. * n * f / (f + n - (2. * d - 1.) * (f - n));
+        d = (z - n) / (f - n);
+    }
+    return vec2(d, d * d);
+#else
+    return texture(source, uv).rg;
+#endif
+}
+
+void main() {
+    vec2 texel = 1. / vec2(textureSize(source, 0).xy);
+    vec2 uv = gl_FragCoord.xy * texel;
+    float half_texel = 0.5 * texel.x;
+
+    vec2 m = weights[0] * Moments(uv, half_texel);
+    for (int k = 1; k < 4; k++)
+        m += weights[k] * (Moments(uv + k * blur_step, half_texel) +
+                           Moments(uv - k * blur_step, half_texel));
+    gl_FragColor = vec4(m / 64., 0, 1);
+}
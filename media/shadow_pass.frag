@@ -1,4 +1,6 @@
+#version 330 compatibility
+
+// Shadow maps only have a depth attachment, so there is nothing to write.
 
 void main() {
-   gl_FragColor = vec4(1.0, 1.0, 0.0, 1.0);
-}
\ No newline at end of file
+}
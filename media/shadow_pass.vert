@@ -1,9 +1,102 @@
+#version 330 compatibility
 
-attribute vec3 vtx_position;            // object space position
+//
+// Depth pass from a shadowed light. The modelview-projection matrix is the
+// light's, the object to world transform comes from the same per-object
+// data the mesh shaders use (see shader.vert).
+//
 
-void main() {
-   gl_Position = gl_ModelViewProjectionMatrix * vec4(vtx_position, 1);
-}
+#ifdef MULTI_DRAW
+
+struct ObjectData {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+layout(std430) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+#define obj2world objects[gl_DrawIDARB].obj2world
+
+#else
+
+layout(std140) uniform ObjectUniforms {
+    mat4  obj2world;
+    mat3  obj2worldNorm;
+    bool  useTextureMapping;
+    bool  useNormalMapping;
+    bool  useEnvironmentMapping;
+    bool  useMirrorBRDF;
+    float spec_exp;
+};
+
+#endif
+
+//
+// World to clip space transform of the light. The layout must match
+// PassUniforms in src/uniform_buffers.h
+//
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
 
+#ifdef LAYERED
 
+//
+// Layered pass, rendering several shadow maps at once: every draw is
+// instanced once per map, and instance i goes to array layer
+// layer_index[i].x with transform layer_view_projection[i]. A map only
+// covers the layer_scale[i].x corner of its layer, the rest of the layer is
+// clipped away. The layout must match LayeredPassUniforms in
+// src/uniform_buffers.h
+//
 
+#define MAX_SHADOW_MAPS 14
+
+layout(std140) uniform LayeredPassUniforms {
+    mat4  layer_view_projection[MAX_SHADOW_MAPS];
+    ivec4 layer_index[MAX_SHADOW_MAPS];
+    vec4  layer_scale[MAX_SHADOW_MAPS];
+};
+
+#ifndef VERTEX_LAYER
+flat out int layer;                     // picked up by shadow_pass.geom
+#endif
+
+#endif
+
+attribute vec3 vtx_position;            // object space position
+
+// the camera's depth prepass draws with this shader, the mesh shaders must
+// then reproduce its depth exactly (see Scene::DepthPrepassMode)
+invariant gl_Position;
+
+void main() {
+#ifdef LAYERED
+   vec4 p = layer_view_projection[gl_InstanceID] * (obj2world * vec4(vtx_position, 1));
+   float scale = layer_scale[gl_InstanceID].x;
+
+   // squeeze the light's view into the corner of the layer and clip what
+   // would land outside of it
+   gl_Position = vec4(p.xy * scale + (scale - 1.0) * p.w, p.zw);
+   gl_ClipDistance[0] = p.w - p.x;
+   gl_ClipDistance[1] = p.w - p.y;
+#ifdef VERTEX_LAYER
+   gl_Layer = layer_index[gl_InstanceID].x;
+#else
+   layer = layer_index[gl_InstanceID].x;
+#endif
+#else
+   // same operations as in shader.vert
+   vec3 position = vec3(obj2world * vec4(vtx_position, 1));
+   gl_Position = view_projection * vec4(position, 1);
+#endif
+}
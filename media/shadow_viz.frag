@@ -1,11 +1,13 @@
-uniform sampler2D myTexture;
+#version 330 compatibility
+
+uniform sampler2DArray myTexture;  // shadow maps, one layer per light
 
 varying vec2 vTexCoord;
 
 void main(void) {
 
-   // visualize depth
-   float depth = texture2D(myTexture, vTexCoord).x;
+   // visualize depth of the first layer
+   float depth = texture(myTexture, vec3(vTexCoord, 0)).x;
    gl_FragColor = vec4(depth, depth, depth, 1.0); 
 
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+#version 330 compatibility
+
 
 varying vec2 vTexCoord;
 
@@ -0,0 +1,54 @@
+#version 330 compatibility
+
+//
+// Quads of ray-cast spheres (see DynamicScene::Sphere), drawn instanced
+// with one sphere per instance and corners (+-1, +-1). Each quad faces the
+// pass's eye and covers the outline of its sphere as the eye sees it;
+// deferred_lighting.frag, built with SPHERE, cuts the exact sphere out of
+// it.
+//
+
+//
+// World to clip space transform of the camera or light, and its eye. The
+// layout must match PassUniforms in src/uniform_buffers.h
+//
+
+layout(std140) uniform PassUniforms {
+    mat4 view_projection;
+    vec4 eye;                           // eye position (w = 1), or direction to it (w = 0)
+};
+
+// per vertex and per instance input attributes, see InstanceData in
+// src/uniform_buffers.h
+attribute vec3 vtx_position;            // corner of the quad
+attribute vec4 instance_sphere;         // world space center and radius
+attribute vec4 instance_material;       // diffuse color, specular exponent
+
+flat out vec4 sphere;
+flat out vec4 material;
+varying vec3 sphere_position;           // world space point on the quad
+
+void main() {
+    vec3 center = instance_sphere.xyz;
+    float radius = instance_sphere.w;
+
+    // orthographic views see the sphere's outline at its radius, for
+    // perspective ones it is the cone from the eye cut through the center
+    vec3 d = eye.xyz;
+    float extent = radius;
+    if (eye.w != 0.) {
+        d = eye.xyz - center;
+        float dist = length(d);
+        d /= dist;
+        extent = radius * dist / sqrt(max(dist * dist - radius * radius, 1e-6));
+    }
+
+    vec3 ref = abs(d.y) < 0.999 ? vec3(0, 1, 0) : vec3(0, 0, 1);
+    vec3 right = normalize(cross(ref, d));
+    vec3 up = cross(d, right);
+
+    sphere = instance_sphere;
+    material = instance_material;
+    sphere_position = center + (vtx_position.x * right + vtx_position.y * up) * extent;
+    gl_Position = view_projection * vec4(sphere_position, 1);
+}
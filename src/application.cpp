@@ -6,8 +6,10 @@
 #include "dynamic_scene/spot_light.h"
 #include "dynamic_scene/sphere.h"
 #include "dynamic_scene/mesh.h"
+#include "program_cache.h"
 
 #include "CS248/lodepng.h"
+#include "CS248/glstate.h"
 
 //#define GLFW_INCLUDE_GLCOREARB
 #include "GLFW/glfw3.h"
@@ -73,14 +75,20 @@ void Application::init() {
 
   show_coordinates = false;
   show_hud = true;
+  scene_cpu_ms = 0;
+  scene_gpu_ms = 0;
+  glGenQueries(GPU_TIMER_QUERIES, gpu_timer_queries);
+  gpu_timer_frame = 0;
+  program_cache_reported = false;
 
   // Lighting needs to be explicitly enabled.
-  glEnable(GL_LIGHTING);
+  GLState::enable(GL_LIGHTING);
+  GLState::enable(GL_DEPTH_TEST);
 
   // Enable anti-aliasing and circular points.
-  glEnable(GL_LINE_SMOOTH);
+  GLState::enable(GL_LINE_SMOOTH);
   // glEnable( GL_POLYGON_SMOOTH ); // XXX causes cracks!
-  glEnable(GL_POINT_SMOOTH);
+  GLState::enable(GL_POINT_SMOOTH);
   glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
   // glHint( GL_POLYGON_SMOOTH_HINT, GL_NICEST );
   glHint(GL_POINT_SMOOTH_HINT, GL_NICEST);
@@ -120,8 +128,9 @@ void Application::enter_2D_GL_draw_mode() {
   glPushMatrix();
   glLoadIdentity();
   glTranslatef(0, 0, -1);
-  glDisable(GL_DEPTH_TEST);
-  glDisable(GL_LIGHTING);
+  GLState::use_program(0);
+  GLState::disable(GL_DEPTH_TEST);
+  GLState::disable(GL_LIGHTING);
 }
 
 void Application::exit_2D_GL_draw_mode() {
@@ -130,8 +139,8 @@ void Application::exit_2D_GL_draw_mode() {
   glMatrixMode(GL_MODELVIEW);
   glPopMatrix();
   glPopAttrib();
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_LIGHTING);
+  GLState::enable(GL_DEPTH_TEST);
+  GLState::enable(GL_LIGHTING);
 }
 
 void Application::render() {
@@ -145,7 +154,29 @@ void Application::render() {
     pickDrawCountdown--;
   }
 
-  // pass 1, generate shadow map for the first directional light source
+  // the query issued GPU_TIMER_QUERIES frames ago is reused for this frame
+  GLuint gpu_timer = gpu_timer_queries[gpu_timer_frame % GPU_TIMER_QUERIES];
+  if (gpu_timer_frame >= GPU_TIMER_QUERIES) {
+    GLint available = 0;
+    glGetQueryObjectiv(gpu_timer, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 ns = 0;
+      glGetQueryObjectui64v(gpu_timer, GL_QUERY_RESULT, &ns);
+      scene_gpu_ms = 0.9 * scene_gpu_ms + 0.1 * ns * 1e-6;
+    }
+  }
+  gpu_timer_frame++;
+
+  auto scene_start = chrono::steady_clock::now();
+  glBeginQuery(GL_TIME_ELAPSED, gpu_timer);
+  scene->begin_frame();
+  GLState::reset_stats();
+
+  // the directional light's shadow cascades follow the camera
+  update_gl_camera();
+
+  // pass 1, generate shadow maps for the spot lights and the first
+  // directional light source
 
   if (scene->requires_shadow_pass())
      scene->render_shadow_pass();
@@ -159,43 +190,36 @@ void Application::render() {
 
   if (visualize_shadow_map) {
     scene->visualize_shadow_map();
+    glEndQuery(GL_TIME_ELAPSED);
   } else {
   
-    set_projection_matrix();
-    update_gl_camera();
-    
     if (show_coordinates)
         draw_coordinates();
 
     scene->render_in_opengl();
+    glEndQuery(GL_TIME_ELAPSED);
+
+    chrono::duration<double, milli> scene_time = chrono::steady_clock::now() - scene_start;
+    scene_cpu_ms = 0.9 * scene_cpu_ms + 0.1 * scene_time.count();
 
     if (show_hud)
         draw_hud();
   }
-}
 
-void Application::update_gl_camera() {
-  // Call resize() every time we draw, since it doesn't seem
-  // to get called by the Viewer upon initial window creation
-  // (this should probably be fixed!).
-  GLint view[4];
-  glGetIntegerv(GL_VIEWPORT, view);
-  if (view[2] != screenW || view[3] != screenH) {
-    resize(view[2], view[3]);
+  if (!program_cache_reported) {
+    if (ProgramCache::enabled()) {
+      const ProgramCache::Stats &pcs = ProgramCache::stats();
+      printf("Program cache: %d loaded, %d built (%d rejected), %.1f ms loading, %.1f ms saved\n",
+             pcs.hits, pcs.misses, pcs.rejected, pcs.load_ms, pcs.saved_ms);
+    }
+    program_cache_reported = true;
   }
+}
 
-  // Control the camera to look at the mesh.
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-
-  const Vector3D &c = camera.position();
-  const Vector3D &r = camera.view_point();
-  const Vector3D &u = camera.up_dir();
-
-  //cout << camera.position() << endl;
-
-  gluLookAt(c.x, c.y, c.z, r.x, r.y, r.z, u.x, u.y, u.z);
-
+void Application::update_gl_camera() {
+  // The scene builds the view and projection transforms from the camera
+  // when it renders. The Viewer calls resize() after init() and whenever
+  // the framebuffer changes size, so the camera's aspect ratio is current.
   scene->camera = &camera;
 }
 
@@ -204,16 +228,6 @@ void Application::resize(size_t w, size_t h) {
   screenH = h;
   camera.set_screen_size(w, h);
   textManager.resize(w, h);
-  set_projection_matrix();
-}
-
-void Application::set_projection_matrix() {
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(camera.v_fov(),
-                 camera.aspect_ratio(),
-                 camera.near_clip(),
-                 camera.far_clip());
 }
 
 string Application::name() { return "Shader Assignment"; }
@@ -249,7 +263,10 @@ void Application::load(SceneInfo *sceneInfo) {
   Vector3D c_dir = Vector3D();
 
   vector<DynamicScene::PatternObject> patterns;
-  std::string shader_prefix = "";
+  // with batched drawing, the mesh shaders read per-draw data from a
+  // storage buffer (see Scene::draw_queue)
+  std::string shader_prefix = DynamicScene::GeometryArena::supported() ?
+                              DynamicScene::GeometryArena::shader_prefix() : "";
 
   int len = nodes.size();
   for (int i = 0; i < len; i++) {
@@ -365,7 +382,6 @@ void Application::init_camera(CameraInfo &cameraInfo,
                               const Matrix4x4 &transform) {
   camera.configure(cameraInfo, screenW, screenH);
   canonicalCamera.configure(cameraInfo, screenW, screenH);
-  set_projection_matrix();
 }
 
 void Application::reset_camera() { camera.copy_placement(canonicalCamera); }
@@ -487,6 +503,28 @@ void Application::char_event(unsigned int codepoint) {
         case 'V':
           visualize_shadow_map = !visualize_shadow_map;
           break;
+        case 'f':
+        case 'F':
+          scene->set_shadow_filter(scene->get_shadow_filter() == DynamicScene::Scene::SHADOW_FILTER_PCF ?
+                                   DynamicScene::Scene::SHADOW_FILTER_VSM :
+                                   DynamicScene::Scene::SHADOW_FILTER_PCF);
+          break;
+        case 'd':
+        case 'D':
+          scene->set_render_mode(scene->get_render_mode() == DynamicScene::Scene::RENDER_MODE_FORWARD ?
+                                 DynamicScene::Scene::RENDER_MODE_DEFERRED :
+                                 DynamicScene::Scene::RENDER_MODE_FORWARD);
+          break;
+        case 'z':
+        case 'Z':
+          // auto, on, off
+          scene->set_depth_prepass_mode((DynamicScene::Scene::DepthPrepassMode)
+                                        ((scene->get_depth_prepass_mode() + 1) % 3));
+          break;
+        case 'i':
+        case 'I':
+          scene->set_use_impostors(!scene->get_use_impostors());
+          break;
         case 'c':
         case 'C':
           printf("Current camera info:\n");
@@ -555,15 +593,8 @@ void Application::toggle_pattern_action() {
 }
 
 Vector3D Application::getMouseProjection(double dist) {
-  // get projection matrix from OpenGL stack.
-  GLdouble projection[16];
-  glGetDoublev(GL_PROJECTION_MATRIX, projection);
-  Matrix4x4 projection_matrix(projection);
-
-  // get view matrix from OpenGL stack.
-  GLdouble modelview[16];
-  glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
-  Matrix4x4 modelview_matrix(modelview);
+  Matrix4x4 projection_matrix = camera.projection_matrix();
+  Matrix4x4 view_matrix = camera.view_matrix();
 
   // ray in clip coordinates
   double x = mouseX * 2 / screenW - 1;
@@ -578,7 +609,7 @@ Vector3D Application::getMouseProjection(double dist) {
   ray_eye.w = 0.0;
 
   // ray in world coordinates
-  Vector4D ray_wor4 = modelview_matrix * ray_eye;
+  Vector4D ray_wor4 = view_matrix.inv() * ray_eye;
   Vector3D ray_wor(ray_wor4.x, ray_wor4.y, ray_wor4.z);
 
   Vector3D ray_orig(camera.position());
@@ -658,10 +689,7 @@ void Application::to_shader_mode() {
 }
 
 Matrix4x4 Application::get_world_to_3DH() {
-  Matrix4x4 P, M;
-  glGetDoublev(GL_PROJECTION_MATRIX, &P(0, 0));
-  glGetDoublev(GL_MODELVIEW_MATRIX, &M(0, 0));
-  return P * M;
+  return camera.projection_matrix() * camera.view_matrix();
 }
 
 inline void Application::draw_string(float x, float y, string str, size_t size,
@@ -672,10 +700,19 @@ inline void Application::draw_string(float x, float y, string str, size_t size,
 }
 
 void Application::draw_coordinates() {
-  glDisable(GL_DEPTH_TEST);
-  glDisable(GL_LIGHTING);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+  // immediate mode drawing still goes through the fixed-function matrices
+  Matrix4x4 projection = camera.projection_matrix();
+  Matrix4x4 view = camera.view_matrix();
+  glMatrixMode(GL_PROJECTION);
+  glLoadMatrixd(&projection(0, 0));
+  glMatrixMode(GL_MODELVIEW);
+  glLoadMatrixd(&view(0, 0));
+
+  GLState::use_program(0);
+  GLState::disable(GL_DEPTH_TEST);
+  GLState::disable(GL_LIGHTING);
+  GLState::enable(GL_BLEND);
+  GLState::blend_func(GL_SRC_ALPHA, GL_ONE);
   glLineWidth(2.);
 
   glBegin(GL_LINES);
@@ -702,8 +739,8 @@ void Application::draw_coordinates() {
   }
   glEnd();
 
-  glEnable(GL_LIGHTING);
-  glEnable(GL_DEPTH_TEST);
+  GLState::enable(GL_LIGHTING);
+  GLState::enable(GL_DEPTH_TEST);
 }
 
 void Application::draw_hud() {
@@ -716,8 +753,90 @@ void Application::draw_hud() {
   const int inc = use_hdpi ? 48 : 24;
   float y = y0 + inc - size;
 
-  glEnable(GL_LIGHTING);
-  glEnable(GL_DEPTH_TEST);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "Scene CPU: %.2f ms", scene_cpu_ms);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  // 'd' switches between the renderers to compare their GPU time
+  if (scene->get_render_mode() == DynamicScene::Scene::RENDER_MODE_DEFERRED)
+    snprintf(buf, sizeof(buf), "Scene GPU: %.2f ms (deferred, G-buffer %d B/pixel)", scene_gpu_ms,
+             scene->get_gbuffer_bytes_per_pixel());
+  else
+    snprintf(buf, sizeof(buf), "Scene GPU: %.2f ms (forward)", scene_gpu_ms);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  // 'z' switches the depth prepass between auto, on and off. Overdraw is
+  // the fragments shaded without it per fragment shaded with it.
+  if (scene->get_render_mode() == DynamicScene::Scene::RENDER_MODE_FORWARD) {
+    static const char *prepass_modes[] = { "auto", "on", "off" };
+    const DynamicScene::OverdrawStats &os = scene->get_overdraw_stats();
+    double overdraw = os.fragments_without_prepass >= 0 && os.fragments_with_prepass > 0 ?
+                      os.fragments_without_prepass / os.fragments_with_prepass : 0;
+    snprintf(buf, sizeof(buf), "Depth prepass: %s (%s)  Overdraw: %.2fx",
+             os.prepass ? "on" : "off", prepass_modes[scene->get_depth_prepass_mode()], overdraw);
+    draw_string(x0, y, buf, size, text_color);
+    y += inc;
+
+    double shaded = os.prepass ? os.fragments_with_prepass : os.fragments_without_prepass;
+    double saved = os.prepass && overdraw > 0 ? os.fragments_without_prepass - shaded : 0;
+    snprintf(buf, sizeof(buf), "Fragments shaded: %.2fM (%.2fM saved)", shaded > 0 ? shaded * 1e-6 : 0.,
+             saved * 1e-6);
+    draw_string(x0, y, buf, size, text_color);
+    y += inc;
+  }
+
+  // program and texture set changes, in object order vs. sorted queue order
+  const DynamicScene::RenderStats &rs = scene->get_render_stats();
+  snprintf(buf, sizeof(buf), "Draws: %d (%d submits, %d culled)  State changes: %d -> %d",
+           rs.draws, rs.submits, rs.culled, rs.state_changes_unsorted, rs.state_changes_sorted);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  snprintf(buf, sizeof(buf), "Shader permutations: %d (%d not ready, %d failed)",
+           scene->get_num_shader_permutations(), scene->get_num_pending_shader_permutations(),
+           scene->get_num_failed_shader_permutations());
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  const DynamicScene::LightClusters::Stats &lcs = scene->get_light_cluster_stats();
+  snprintf(buf, sizeof(buf), "Light clusters: %d lights, %d entries (max %d), %.2f ms",
+           lcs.lights, lcs.indices, lcs.max_lights, lcs.cpu_ms);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  // shadow maps are only re-rendered when something they show changed
+  if (scene->requires_shadow_pass()) {
+    snprintf(buf, sizeof(buf), "Shadow maps rendered: %d/%d (%s)", rs.shadow_maps,
+             scene->get_num_shadow_maps(),
+             scene->get_shadow_filter() == DynamicScene::Scene::SHADOW_FILTER_VSM ? "VSM" : "PCF");
+    draw_string(x0, y, buf, size, text_color);
+    y += inc;
+  }
+
+  // 'i' switches impostors of distant meshes on and off
+  snprintf(buf, sizeof(buf), "Impostors: %d drawn, %d atlases, %d baked%s", rs.impostors,
+           scene->get_num_impostor_atlases(), rs.impostors_baked,
+           scene->get_use_impostors() ? "" : " (off)");
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  const GLState::Stats &gs = GLState::stats();
+  snprintf(buf, sizeof(buf), "GL state calls: %zu  avoided: %zu", gs.issued, gs.avoided);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  // per-draw data written this frame, and how long the CPU waited for the
+  // GPU to release stream storage
+  StreamBuffer::Stats ss = scene->get_stream_stats();
+  snprintf(buf, sizeof(buf), "Streamed: %.1f KB (%s)  wait: %.2f ms", ss.bytes / 1024.,
+           scene->uses_persistent_streams() ? "persistent" : "orphaned", ss.wait_ms);
+  draw_string(x0, y, buf, size, text_color);
+  y += inc;
+
+  GLState::enable(GL_LIGHTING);
+  GLState::enable(GL_DEPTH_TEST);
 
   textManager.render();
 }
@@ -32,6 +32,9 @@
 
 using namespace std;
 
+// Frames a GPU timer query result is read after the frame it timed
+#define GPU_TIMER_QUERIES 4
+
 namespace CS248 {
 
 class Application : public Renderer {
@@ -94,13 +97,8 @@ class Application : public Renderer {
   // Rate of translation on scrolling.
   double scroll_rate;
 
-  /*
-    Called whenever the camera fov or screenW/screenH changes.
-  */
-  void set_projection_matrix();
-
   /**
-   * Reads and combines the current modelview and projection matrices.
+   * Combines the camera's view and projection matrices.
    */
   Matrix4x4 get_world_to_3DH();
 
@@ -160,6 +158,21 @@ class Application : public Renderer {
   // HUD //
   bool show_hud;
   void draw_hud();
+
+  // CPU time spent submitting the shadow and beauty passes, in ms
+  // (exponentially smoothed so the HUD is readable)
+  double scene_cpu_ms;
+
+  // GPU time of the same passes, measured with timer queries that are
+  // read back GPU_TIMER_QUERIES frames later so that the CPU never waits
+  // for them (smoothed the same way)
+  GLuint gpu_timer_queries[GPU_TIMER_QUERIES];
+  int gpu_timer_frame;
+  double scene_gpu_ms;
+
+  // programs are built on first use, so the program cache is reported
+  // after the first frame
+  bool program_cache_reported;
   inline void draw_string(float x, float y, string str, size_t size, const Color& c);
 
   bool lastEventWasModKey;
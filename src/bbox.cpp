@@ -43,6 +43,20 @@ void BBox::draw(Color c) const {
   glEnd();
 }
 
+BBox BBox::transform(const Matrix4x4 &m) const {
+  if (empty()) return BBox();
+
+  Vector3D c = centroid();
+  Vector3D h = extent / 2;
+
+  Vector3D new_c, new_h;
+  for (int i = 0; i < 3; i++) {
+    new_c[i] = m(i, 0) * c.x + m(i, 1) * c.y + m(i, 2) * c.z + m(i, 3);
+    new_h[i] = fabs(m(i, 0)) * h.x + fabs(m(i, 1)) * h.y + fabs(m(i, 2)) * h.z;
+  }
+  return BBox(new_c - new_h, new_c + new_h);
+}
+
 std::ostream &operator<<(std::ostream &os, const BBox &b) {
   return os << "BBOX(" << b.min << ", " << b.max << ")";
 }
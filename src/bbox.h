@@ -7,6 +7,7 @@
 #include "CS248/CS248.h"
 #include "CS248/vector3D.h"
 #include "CS248/vector4D.h"
+#include "CS248/matrix4x4.h"
 
 namespace CS248 {
 
@@ -95,6 +96,14 @@ struct BBox {
 
   Vector3D centroid() const { return (min + max) / 2; }
 
+  /**
+    * Returns the axis-aligned box that bounds *this* after being transformed
+    * by the affine transform m. The result bounds all eight transformed
+    * corners, but is computed from the center and half extent directly.
+    * \param m the (affine) transformation to apply
+    */
+  BBox transform(const Matrix4x4 &m) const;
+
   /**
     * Compute the surface area of the bounding box.
     * \return surface area of the bounding box.
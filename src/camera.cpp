@@ -86,6 +86,14 @@ void Camera::rotate_by(const double dPhi, const double dTheta) {
   compute_position();
 }
 
+Matrix4x4 Camera::view_matrix() const {
+  return Matrix4x4::look_at(pos, targetPos, up_dir());
+}
+
+Matrix4x4 Camera::projection_matrix() const {
+  return Matrix4x4::perspective(vFov, ar, nClip, fClip);
+}
+
 void Camera::compute_position() {
   double sinPhi = sin(phi);
   if (sinPhi == 0) {
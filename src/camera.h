@@ -5,6 +5,7 @@
 
 #include "collada/camera_info.h"
 #include "CS248/matrix3x3.h"
+#include "CS248/matrix4x4.h"
 
 #include "math.h"
 
@@ -66,6 +67,18 @@ class Camera {
   double aspect_ratio() const { return ar; }
   double near_clip() const { return nClip; }
   double far_clip() const { return fClip; }
+  size_t screen_width() const { return screenW; }
+  size_t screen_height() const { return screenH; }
+
+  /*
+    World-to-camera transform, as gluLookAt would build it.
+  */
+  Matrix4x4 view_matrix() const;
+
+  /*
+    Camera-to-clip transform, as gluPerspective would build it.
+  */
+  Matrix4x4 projection_matrix() const;
 
  private:
   // Computes pos, screenXDir, screenYDir from target, r, phi, theta.
@@ -682,6 +682,53 @@ int ColladaParser::load(const char* filename, SceneInfo* sceneInfo) {
 		}
     }
 
+    // analytic spheres, drawn as ray-cast quads instead of a tessellated
+    // mesh each (see DynamicScene::Sphere)
+    if (root.find(L"spheres") != root.end() && root[L"spheres"]->IsArray()) {
+      JSONArray sphere_json_array = root[L"spheres"]->AsArray();
+      for (int i = 0; i < sphere_json_array.size(); ++i) {
+        if (!sphere_json_array[i]->IsObject()) continue;
+        JSONObject sphere_json_object = sphere_json_array[i]->AsObject();
+        Node node = Node();
+        SphereInfo* sphere = new SphereInfo();
+        sphere->radius = 1.f;
+        sphere->diffuse_color = Vector3D(1, 1, 1);
+        sphere->phong_spec_exp = 1.f;
+
+        Vector3D sphere_translate(0,0,0);
+        if (sphere_json_object.find(L"translate") != sphere_json_object.end() && sphere_json_object[L"translate"]->IsArray()) {
+          JSONArray position_json_array = sphere_json_object[L"translate"]->AsArray();
+          if (position_json_array.size() == 3) {
+            sphere_translate.x = position_json_array[0]->AsNumber();
+            sphere_translate.y = position_json_array[1]->AsNumber();
+            sphere_translate.z = position_json_array[2]->AsNumber();
+          }
+        }
+
+        if (sphere_json_object.find(L"radius") != sphere_json_object.end() && sphere_json_object[L"radius"]->IsNumber()) {
+          sphere->radius = sphere_json_object[L"radius"]->AsNumber();
+        }
+
+        if (sphere_json_object.find(L"diffuse_color") != sphere_json_object.end() && sphere_json_object[L"diffuse_color"]->IsArray()) {
+          JSONArray color_json_array = sphere_json_object[L"diffuse_color"]->AsArray();
+          if (color_json_array.size() == 3) {
+            sphere->diffuse_color.x = color_json_array[0]->AsNumber();
+            sphere->diffuse_color.y = color_json_array[1]->AsNumber();
+            sphere->diffuse_color.z = color_json_array[2]->AsNumber();
+          }
+        }
+
+        if (sphere_json_object.find(L"spec_exp") != sphere_json_object.end() && sphere_json_object[L"spec_exp"]->IsNumber()) {
+          sphere->phong_spec_exp = sphere_json_object[L"spec_exp"]->AsNumber();
+        }
+
+        sphere->type = Instance::SPHERE;
+        node.instance = sphere;
+        node.transform = Matrix4x4::translation(sphere_translate);
+        scene->nodes.push_back(node);
+      }
+    }
+
       return 0;
   }
 
@@ -1202,6 +1249,8 @@ void ColladaParser::parse_sphere(XMLElement* xml, SphereInfo& sphere) {
   }
 
   sphere.radius = atof(e_radius->GetText());
+  sphere.diffuse_color = Vector3D(1, 1, 1);
+  sphere.phong_spec_exp = 1.f;
 
   // print summary
   stat("  |- " << sphere);
@@ -7,7 +7,9 @@ namespace Collada {
 
 std::ostream& operator<<(std::ostream& os, const SphereInfo& sphere) {
   return os << "Sphere: " << sphere.name << " (id:" << sphere.id << ") ["
-            << " radius=" << sphere.radius << " ]";
+            << " radius=" << sphere.radius
+            << " diffuse_color=" << sphere.diffuse_color
+            << " spec_exp=" << sphere.phong_spec_exp << " ]";
 }
 
 }  // namespace Collada
@@ -8,6 +8,9 @@ namespace Collada {
 
 struct SphereInfo : Instance {
   float radius;            ///< radius
+
+  Vector3D diffuse_color;  ///< material of the sphere
+  float phong_spec_exp;
 };                         // struct Sphere
 
 std::ostream& operator<<(std::ostream& os, const SphereInfo& sphere);
@@ -0,0 +1,76 @@
+#include "gbuffer.h"
+#include "CS248/glstate.h"
+
+#include <stdio.h>
+
+namespace CS248 {
+namespace DynamicScene {
+
+GBuffer::GBuffer() : width(0), height(0), framebuffer(0) {
+  for (int i = 0; i < 3; i++)
+    textures[i] = 0;
+}
+
+GBuffer::~GBuffer() {
+  if (!framebuffer) return;
+  glDeleteFramebuffers(1, &framebuffer);
+  GLState::delete_textures(3, textures);
+}
+
+bool GBuffer::resize(int w, int h) {
+  if (w == width && h == height)
+    return true;
+  width = w;
+  height = h;
+
+  if (!framebuffer) {
+    glGenFramebuffers(1, &framebuffer);
+    glGenTextures(3, textures);
+  }
+
+  // the lighting pass reads every texel where it is drawn, so nothing is
+  // filtered
+  GLenum internal_formats[3] = { GL_RGBA8, GL_RGB10_A2, GL_DEPTH_COMPONENT24 };
+  GLenum formats[3] = { GL_RGBA, GL_RGBA, GL_DEPTH_COMPONENT };
+  GLenum types[3] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_INT_2_10_10_10_REV, GL_UNSIGNED_INT };
+  // the textures exist already after the first call and may still be
+  // bound to unit 0, which then isn't necessarily the active unit
+  GLState::active_texture(0);
+  for (int i = 0; i < 3; i++) {
+    GLState::bind_texture(0, GL_TEXTURE_2D, textures[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[i], width, height, 0, formats[i], types[i], NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[0], 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, textures[1], 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[2], 0);
+  bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  if (!complete)
+    printf("Error: G-buffer frame buffer is not complete\n");
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  return complete;
+}
+
+void GBuffer::begin_geometry_pass() {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  GLenum draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers(2, draw_buffers);
+
+  // depth is cleared to 1 where no surface is drawn, colors and depth are
+  // written without blending
+  glClearColor(0., 0., 0., 0.);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void GBuffer::bind(GLuint first_unit) const {
+  for (int i = 0; i < 3; i++)
+    GLState::bind_texture(first_unit + i, GL_TEXTURE_2D, textures[i]);
+}
+
+}  // namespace DynamicScene
+}  // namespace CS248
@@ -0,0 +1,63 @@
+#ifndef CS248_DYNAMICSCENE_GBUFFER_H
+#define CS248_DYNAMICSCENE_GBUFFER_H
+
+#include "GL/glew.h"
+
+// Bits of the material flags the G-buffer stores per pixel, must match
+// GBUFFER_* in gbuffer.frag and deferred_lighting.frag
+#define GBUFFER_SHADOW_RECEIVER 1  // lit by spot lights and shadowed
+
+// Largest specular exponent the G-buffer holds, must match
+// GBUFFER_MAX_SPEC_EXP in the same shaders
+#define GBUFFER_MAX_SPEC_EXP 1023
+
+namespace CS248 {
+namespace DynamicScene {
+
+/**
+ * Render targets of deferred shading. The geometry pass writes the surface
+ * attributes the lighting pass needs into two color targets and a depth
+ * texture, eight bytes per pixel besides depth:
+ *
+ *   albedo     RGBA8     diffuse color, material flags (GBUFFER_* bits)
+ *   normal     RGB10_A2  world space normal, octahedral encoded into rg,
+ *                        specular exponent / GBUFFER_MAX_SPEC_EXP in b
+ *   depth      24 bit    the lighting pass rebuilds positions from it
+ *
+ * Pixels no surface was drawn to keep depth 1.
+ */
+class GBuffer {
+ public:
+  GBuffer();
+  ~GBuffer();
+
+  /**
+   * Makes the targets width x height pixels, reallocating them if their
+   * size differs. False if the framebuffer can't be rendered to.
+   */
+  bool resize(int width, int height);
+
+  /**
+   * Binds the framebuffer with both color targets as draw buffers and
+   * clears it, for the geometry pass.
+   */
+  void begin_geometry_pass();
+
+  /**
+   * Binds the albedo, normal and depth textures to texture units
+   * first_unit, first_unit + 1 and first_unit + 2.
+   */
+  void bind(GLuint first_unit) const;
+
+  int bytes_per_pixel() const { return 4 + 4 + 4; }
+
+ private:
+  int width, height;
+  GLuint framebuffer;
+  GLuint textures[3];  // albedo, normal, depth
+};
+
+}  // namespace DynamicScene
+}  // namespace CS248
+
+#endif  // CS248_DYNAMICSCENE_GBUFFER_H
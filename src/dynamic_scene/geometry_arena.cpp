@@ -0,0 +1,184 @@
+#include "geometry_arena.h"
+#include "../shader.h"
+#include "CS248/glstate.h"
+
+#include <cstring>
+#include <unordered_map>
+
+namespace CS248 {
+namespace DynamicScene {
+
+// N floats of a vertex, all its attributes or just its position, for
+// finding identical vertices.
+template <int N>
+struct ArenaKey {
+  float v[N];
+
+  bool operator==(const ArenaKey &o) const {
+    return memcmp(v, o.v, sizeof(v)) == 0;
+  }
+};
+
+typedef ArenaKey<14> ArenaVertex;
+typedef ArenaKey<3> ArenaPosition;
+
+struct ArenaKeyHash {
+  template <int N>
+  size_t operator()(const ArenaKey<N> &a) const {
+    // FNV-1a over the bytes
+    const unsigned char *p = (const unsigned char *) a.v;
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(a.v); i++)
+      h = (h ^ p[i]) * 16777619u;
+    return h;
+  }
+};
+
+GeometryArena::GeometryArena()
+  : vao(0), position_vao(0), index_buffer(0), position_index_buffer(0) {
+  memset(vertex_buffers, 0, sizeof(vertex_buffers));
+}
+
+GeometryArena::~GeometryArena() {
+  if (!vao) return;
+  GLState::bind_vertex_array(0);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteVertexArrays(1, &position_vao);
+  GLState::delete_buffers(5, vertex_buffers);
+  GLState::delete_buffers(1, &index_buffer);
+  GLState::delete_buffers(1, &position_index_buffer);
+}
+
+bool GeometryArena::supported() {
+  return GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object &&
+         GLEW_ARB_program_interface_query && GLEW_ARB_shader_draw_parameters;
+}
+
+const char *GeometryArena::shader_prefix() {
+  return "#extension GL_ARB_shader_storage_buffer_object : require\n"
+         "#extension GL_ARB_shader_draw_parameters : require\n"
+         "#define MULTI_DRAW 1\n";
+}
+
+void GeometryArena::clear() {
+  positions.clear();
+  normals.clear();
+  texcoords.clear();
+  tangents.clear();
+  colors.clear();
+  indices.clear();
+  position_indices.clear();
+}
+
+ArenaRange GeometryArena::add(size_t n, const float *p, const float *nrm,
+                              const float *uv, const float *tan,
+                              const float *col) {
+  ArenaRange range;
+  range.first_index = indices.size();
+  range.index_count = n;
+  range.base_vertex = vertex_count();
+
+  // indices are relative to base_vertex
+  std::unordered_map<ArenaVertex, GLuint, ArenaKeyHash> unique;
+  unique.reserve(n);
+
+  // first vertex stored for each position
+  std::unordered_map<ArenaPosition, GLuint, ArenaKeyHash> unique_positions;
+  unique_positions.reserve(n);
+
+  for (size_t i = 0; i < n; i++) {
+    ArenaVertex a;
+    memcpy(a.v + 0, p + 3 * i, 3 * sizeof(float));
+    memcpy(a.v + 3, nrm + 3 * i, 3 * sizeof(float));
+    if (uv)
+      memcpy(a.v + 6, uv + 2 * i, 2 * sizeof(float));
+    else
+      memset(a.v + 6, 0, 2 * sizeof(float));
+    memcpy(a.v + 8, tan + 3 * i, 3 * sizeof(float));
+    if (col)
+      memcpy(a.v + 11, col + 3 * i, 3 * sizeof(float));
+    else
+      memset(a.v + 11, 0, 3 * sizeof(float));
+
+    ArenaPosition pos;
+    memcpy(pos.v, a.v, sizeof(pos.v));
+
+    GLuint index;
+    auto it = unique.find(a);
+    if (it != unique.end()) {
+      index = it->second;
+    } else {
+      index = unique.size();
+      unique[a] = index;
+
+      positions.insert(positions.end(), a.v + 0, a.v + 3);
+      normals.insert(normals.end(), a.v + 3, a.v + 6);
+      texcoords.insert(texcoords.end(), a.v + 6, a.v + 8);
+      tangents.insert(tangents.end(), a.v + 8, a.v + 11);
+      colors.insert(colors.end(), a.v + 11, a.v + 14);
+    }
+    indices.push_back(index);
+
+    // keeps the existing entry if the position was stored before
+    position_indices.push_back(unique_positions.emplace(pos, index).first->second);
+  }
+
+  return range;
+}
+
+void GeometryArena::upload() {
+  if (!vao) {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(5, vertex_buffers);
+    glGenBuffers(1, &index_buffer);
+    glGenVertexArrays(1, &position_vao);
+    glGenBuffers(1, &position_index_buffer);
+  }
+
+  const std::vector<float> *streams[5] = {
+    &positions, &normals, &texcoords, &tangents, &colors
+  };
+  const GLuint locations[5] = {
+    VTX_POSITION_LOCATION, VTX_NORMAL_LOCATION, VTX_TEXCOORD_LOCATION,
+    VTX_TANGENT_LOCATION, VTX_DIFFUSE_COLOR_LOCATION
+  };
+  const GLint sizes[5] = { 3, 3, 2, 3, 3 };
+
+  GLState::bind_vertex_array(vao);
+
+  for (int i = 0; i < 5; i++) {
+    GLState::bind_buffer(GL_ARRAY_BUFFER, vertex_buffers[i]);
+    glBufferData(GL_ARRAY_BUFFER, streams[i]->size() * sizeof(float),
+                 streams[i]->data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(locations[i], sizes[i], GL_FLOAT, GL_FALSE, 0, 0);
+    GLState::enable_vertex_attrib_array(locations[i]);
+  }
+
+  GLState::bind_buffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint),
+               indices.data(), GL_STATIC_DRAW);
+
+  // positions only, for depth-only passes
+  GLState::bind_vertex_array(position_vao);
+
+  GLState::bind_buffer(GL_ARRAY_BUFFER, vertex_buffers[0]);
+  glVertexAttribPointer(VTX_POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  GLState::enable_vertex_attrib_array(VTX_POSITION_LOCATION);
+
+  GLState::bind_buffer(GL_ELEMENT_ARRAY_BUFFER, position_index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, position_indices.size() * sizeof(GLuint),
+               position_indices.data(), GL_STATIC_DRAW);
+
+  GLState::bind_vertex_array(0);
+}
+
+void GeometryArena::bind() const {
+  GLState::bind_vertex_array(vao);
+}
+
+void GeometryArena::bind_positions() const {
+  GLState::bind_vertex_array(position_vao);
+}
+
+}  // namespace DynamicScene
+}  // namespace CS248
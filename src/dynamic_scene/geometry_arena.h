@@ -0,0 +1,120 @@
+#ifndef CS248_DYNAMICSCENE_GEOMETRY_ARENA_H
+#define CS248_DYNAMICSCENE_GEOMETRY_ARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "GL/glew.h"
+
+namespace CS248 {
+namespace DynamicScene {
+
+/**
+ * Where an object's triangles live in a GeometryArena, in the form
+ * glDrawElementsBaseVertex and friends take it.
+ */
+struct ArenaRange {
+  GLuint first_index;
+  GLuint index_count;
+  GLint base_vertex;
+};
+
+/**
+ * One command of a glMultiDrawElementsIndirect call.
+ */
+struct DrawElementsIndirectCommand {
+  GLuint count;
+  GLuint instance_count;
+  GLuint first_index;
+  GLint base_vertex;
+  GLuint base_instance;
+};
+
+/**
+ * Shared vertex and index buffers that the static geometry of all meshes is
+ * sub-allocated from, so that draws of different meshes can be submitted
+ * together with glMultiDrawElementsIndirect. Vertex attributes are stored
+ * in one buffer per attribute at the fixed locations bound by Shader (see
+ * VTX_POSITION_LOCATION etc.), and identical vertices of a mesh are merged.
+ *
+ * For depth-only passes there is a second index buffer in which vertices
+ * that only differ in attributes other than position (along texture seams
+ * for instance) are merged as well, so that the GPU's vertex cache catches
+ * them. It has the same layout as the main one, every ArenaRange is valid
+ * for both.
+ */
+class GeometryArena {
+ public:
+  GeometryArena();
+  ~GeometryArena();
+
+  /**
+   * True if the GL implementation has everything batched drawing needs:
+   * multi-draw indirect, shader storage buffers (and a way to bind them)
+   * and gl_DrawIDARB.
+   */
+  static bool supported();
+
+  /**
+   * Shader source prefix (inserted after #version) that builds the mesh
+   * shaders for batched drawing: per-draw data is read from the entry of
+   * the ObjectBuffer storage block selected by gl_DrawIDARB.
+   */
+  static const char *shader_prefix();
+
+  /**
+   * Drops all geometry. GL storage is kept until the next upload().
+   */
+  void clear();
+
+  /**
+   * Appends the triangles of a mesh, given as n non-indexed vertices
+   * (three per triangle). positions, normals and tangents have 3 floats per
+   * vertex, texcoords 2. texcoords and colors (3 floats per vertex) may be
+   * NULL, the arena stores zeros for them then.
+   */
+  ArenaRange add(size_t n, const float *positions, const float *normals,
+                 const float *texcoords, const float *tangents,
+                 const float *colors);
+
+  /**
+   * Copies the geometry added since clear() to GL buffers and sets up the
+   * vertex array object that reads from them.
+   */
+  void upload();
+
+  /**
+   * Binds the arena's vertex array object. Callers go back to vertex
+   * array 0 when they are done with it.
+   */
+  void bind() const;
+
+  /**
+   * Binds a vertex array object that only reads positions, through the
+   * position-only index buffer.
+   */
+  void bind_positions() const;
+
+  size_t vertex_count() const { return positions.size() / 3; }
+  size_t index_count() const { return indices.size(); }
+
+ private:
+  std::vector<float> positions;
+  std::vector<float> normals;
+  std::vector<float> texcoords;
+  std::vector<float> tangents;
+  std::vector<float> colors;
+  std::vector<GLuint> indices;
+  std::vector<GLuint> position_indices;
+
+  GLuint vao;
+  GLuint position_vao;
+  GLuint vertex_buffers[5];  // positions, normals, texcoords, tangents, colors
+  GLuint index_buffer;
+  GLuint position_index_buffer;
+};
+
+}  // namespace DynamicScene
+}  // namespace CS248
+
+#endif  // CS248_DYNAMICSCENE_GEOMETRY_ARENA_H
@@ -0,0 +1,132 @@
+#include "impostor_atlas.h"
+#include "CS248/glstate.h"
+
+#include <cmath>
+#include <stdio.h>
+
+namespace CS248 {
+namespace DynamicScene {
+
+#define IMPOSTOR_ATLAS_SIZE (IMPOSTOR_FRAMES * IMPOSTOR_FRAME_SIZE)
+
+// the smallest mipmap still has 8 texels per view, so that filtering
+// stays inside the margin
+static const int impostor_max_level = 3;
+
+ImpostorAtlas::ImpostorAtlas() : source(NULL), material_id(0), baked(false), framebuffer(0) {
+  for (int i = 0; i < 3; i++)
+    textures[i] = 0;
+}
+
+ImpostorAtlas::~ImpostorAtlas() {
+  if (framebuffer)
+    glDeleteFramebuffers(1, &framebuffer);
+  if (textures[0])
+    GLState::delete_textures(3, textures);
+}
+
+bool ImpostorAtlas::begin_bake() {
+  if (!framebuffer) {
+    glGenFramebuffers(1, &framebuffer);
+    glGenTextures(3, textures);
+
+    // albedo and normal are minified with mipmaps, depth is read as is
+    GLenum internal_formats[3] = { GL_RGBA8, GL_RGB10_A2, GL_DEPTH_COMPONENT24 };
+    GLenum formats[3] = { GL_RGBA, GL_RGBA, GL_DEPTH_COMPONENT };
+    GLenum types[3] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_INT_2_10_10_10_REV, GL_UNSIGNED_INT };
+    for (int i = 0; i < 3; i++) {
+      int levels = i < 2 ? impostor_max_level + 1 : 1;
+      GLState::bind_texture(0, GL_TEXTURE_2D, textures[i]);
+      for (int level = 0; level < levels; level++)
+        glTexImage2D(GL_TEXTURE_2D, level, internal_formats[i], IMPOSTOR_ATLAS_SIZE >> level,
+                     IMPOSTOR_ATLAS_SIZE >> level, 0, formats[i], types[i], NULL);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, i < 2 ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, i < 2 ? GL_LINEAR : GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[0], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, textures[1], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[2], 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Error: impostor atlas frame buffer is not complete\n");
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      return false;
+    }
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  GLenum draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers(2, draw_buffers);
+
+  // albedo alpha stays 1 where no surface is drawn (the G-buffer program
+  // writes its material flags there, 0 or 1/255), and color 0 keeps the
+  // mipmaps of the other channels premultiplied by coverage
+  glClearColor(0., 0., 0., 1.);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  return true;
+}
+
+Matrix4x4 ImpostorAtlas::begin_view(int i, int j, const Vector3D &center, double radius) {
+  glViewport(i * IMPOSTOR_FRAME_SIZE, j * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+
+  // the view's axes, as ImpostorBasis() in deferred_lighting.frag picks
+  // them; depth 0 is the sphere's side towards the eye, 1 the far side
+  Vector3D d = view_direction(i, j);
+  Vector3D ref = fabs(d.y) < 0.999 ? Vector3D(0, 1, 0) : Vector3D(0, 0, 1);
+  Vector3D right = cross(ref, d).unit();
+  Vector3D up = cross(d, right);
+  double extent = radius * IMPOSTOR_MARGIN;
+
+  Matrix4x4 m = Matrix4x4::identity();
+  Vector3D rows[3] = { right / extent, up / extent, -d / radius };
+  for (int r = 0; r < 3; r++) {
+    m(r, 0) = rows[r].x;
+    m(r, 1) = rows[r].y;
+    m(r, 2) = rows[r].z;
+    m(r, 3) = -dot(rows[r], center);
+  }
+  return m;
+}
+
+void ImpostorAtlas::end_bake() {
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  source = NULL;
+  for (int i = 0; i < 2; i++) {
+    GLState::bind_texture(0, GL_TEXTURE_2D, textures[i]);
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  baked = true;
+}
+
+void ImpostorAtlas::bind(GLuint first_unit) const {
+  for (int i = 0; i < 3; i++)
+    GLState::bind_texture(first_unit + i, GL_TEXTURE_2D, textures[i]);
+}
+
+Vector3D ImpostorAtlas::view_direction(int i, int j) {
+  // OctahedralDecode() of deferred_lighting.frag
+  double ex = (i + 0.5) / IMPOSTOR_FRAMES * 2 - 1;
+  double ey = (j + 0.5) / IMPOSTOR_FRAMES * 2 - 1;
+  Vector3D n(ex, ey, 1 - fabs(ex) - fabs(ey));
+  if (n.z < 0) {
+    double x = (1 - fabs(n.y)) * (n.x >= 0 ? 1 : -1);
+    double y = (1 - fabs(n.x)) * (n.y >= 0 ? 1 : -1);
+    n.x = x;
+    n.y = y;
+  }
+  return n.unit();
+}
+
+size_t ImpostorAtlas::bytes() {
+  size_t texels = 0;
+  for (int level = 0; level <= impostor_max_level; level++)
+    texels += (IMPOSTOR_ATLAS_SIZE >> level) * (IMPOSTOR_ATLAS_SIZE >> level);
+  return 8 * texels + 4 * IMPOSTOR_ATLAS_SIZE * IMPOSTOR_ATLAS_SIZE;
+}
+
+}  // namespace DynamicScene
+}  // namespace CS248
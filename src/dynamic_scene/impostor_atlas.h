@@ -0,0 +1,98 @@
+#ifndef CS248_DYNAMICSCENE_IMPOSTOR_ATLAS_H
+#define CS248_DYNAMICSCENE_IMPOSTOR_ATLAS_H
+
+#include "GL/glew.h"
+#include "CS248/matrix4x4.h"
+#include "CS248/vector3D.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Views per side of an impostor atlas and texels per side of a view, the
+// first must match IMPOSTOR_FRAMES in deferred_lighting.frag
+#define IMPOSTOR_FRAMES     8
+#define IMPOSTOR_FRAME_SIZE 64
+
+// Views cover this much more than the object's bounding sphere across, so
+// that filtering doesn't reach into the next view. Must match
+// IMPOSTOR_MARGIN in deferred_lighting.frag
+#define IMPOSTOR_MARGIN 1.1
+
+namespace CS248 {
+namespace DynamicScene {
+
+class SceneObject;
+
+/**
+ * Octahedral impostor of an object: IMPOSTOR_FRAMES x IMPOSTOR_FRAMES
+ * orthographic views of its bounding sphere, view (i, j) looking from the
+ * direction whose octahedral encoding (see gbuffer.frag) is
+ * ((i + 0.5) / IMPOSTOR_FRAMES, (j + 0.5) / IMPOSTOR_FRAMES), so that the
+ * views are spread evenly over all directions. They are drawn with the
+ * object's G-buffer program into targets laid out like GBuffer's, which
+ * deferred_lighting.frag relights (built with IMPOSTOR):
+ *
+ *   albedo     RGBA8     diffuse color, alpha 1 where the object isn't
+ *   normal     RGB10_A2  world space normal and specular exponent
+ *   depth      24 bit    along the view, over the sphere's diameter
+ *
+ * The views keep the world's orientation and are centered on the sphere,
+ * so one atlas serves every object with the same geometry, materials,
+ * rotation and scale, wherever it is.
+ */
+class ImpostorAtlas {
+ public:
+  ImpostorAtlas();
+  ~ImpostorAtlas();
+
+  /**
+   * Allocates the targets if needed, binds them and clears them, for
+   * drawing the views.
+   */
+  bool begin_bake();
+
+  /**
+   * Sets the viewport to view (i, j) and returns the view-projection
+   * transform that maps the sphere (center, radius) into it.
+   */
+  Matrix4x4 begin_view(int i, int j, const Vector3D &center, double radius);
+
+  /**
+   * Filters the albedo and normal mipmaps and unbinds the targets. The
+   * atlas can be drawn from after this.
+   */
+  void end_bake();
+
+  bool is_baked() const { return baked; }
+
+  /**
+   * Binds the albedo, normal and depth textures to texture units
+   * first_unit, first_unit + 1 and first_unit + 2.
+   */
+  void bind(GLuint first_unit) const;
+  GLuint texture(int i) const { return textures[i]; }
+
+  /**
+   * Direction from the sphere's center towards the eye of view (i, j).
+   */
+  static Vector3D view_direction(int i, int j);
+
+  // texture memory of an atlas, mipmaps included
+  static size_t bytes();
+
+  // the object that draws the views, NULL once it did
+  SceneObject *source;
+
+  // scene material id of the textures, for render queue keys
+  uint32_t material_id;
+
+ private:
+  bool baked;
+  GLuint framebuffer;
+  GLuint textures[3];  // albedo, normal, depth
+};
+
+}  // namespace DynamicScene
+}  // namespace CS248
+
+#endif  // CS248_DYNAMICSCENE_IMPOSTOR_ATLAS_H
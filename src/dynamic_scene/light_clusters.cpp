@@ -0,0 +1,202 @@
+#include "light_clusters.h"
+#include "CS248/glstate.h"
+#include "CS248/simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace CS248 {
+namespace DynamicScene {
+
+// tiles per row and column rounded up to whole float4s
+#define CLUSTER_GROUPS_X ((CLUSTER_GRID_X + 3) / 4)
+#define CLUSTER_GROUPS_Y ((CLUSTER_GRID_Y + 3) / 4)
+
+// fewer lights than this are binned on one thread
+static const size_t parallel_cluster_min_lights = 64;
+
+LightClusters::LightClusters() : slice_scale(0), slice_bias(0) {
+  for (int i = 0; i < 3; i++)
+    buffers[i] = textures[i] = 0;
+  cluster_lights.resize(CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z);
+  counters.lights = counters.indices = counters.max_lights = 0;
+  counters.cpu_ms = 0;
+}
+
+LightClusters::~LightClusters() {
+  if (!buffers[0]) return;
+  GLState::delete_textures(3, textures);
+  GLState::delete_buffers(3, buffers);
+}
+
+void LightClusters::clear() {
+  records.clear();
+  centers.clear();
+  radii.clear();
+}
+
+void LightClusters::add(const LightRecord &record, const Vector3D &center, double radius) {
+  records.push_back(record);
+  centers.push_back(center);
+  radii.push_back(radius);
+}
+
+void LightClusters::update(const Matrix4x4 &view, const Matrix4x4 &projection,
+                           double near, double far) {
+  auto start = std::chrono::steady_clock::now();
+
+  // slice k starts at depth near * (far / near)^(k / CLUSTER_GRID_Z)
+  double log_ratio = log(far / near);
+  slice_scale = CLUSTER_GRID_Z / log_ratio;
+  slice_bias = -log(near) * slice_scale;
+  for (int k = 0; k <= CLUSTER_GRID_Z; k++)
+    slice_depths[k] = near * exp(log_ratio * k / CLUSTER_GRID_Z);
+
+  // ndc x = projection(0, 0) * x / depth
+  x_per_ndc = 1. / projection(0, 0);
+  y_per_ndc = 1. / projection(1, 1);
+
+  Mat4f world_to_eye(view);
+  spheres.resize(records.size());
+  for (size_t l = 0; l < records.size(); l++) {
+    Vec3f c = world_to_eye.transform_point(Vec3f(centers[l]));
+    EyeSphere &s = spheres[l];
+    s.x = c.x();
+    s.y = c.y();
+    s.depth = -c.z();
+    s.radius = radii[l];
+
+    float first = s.depth - s.radius, last = s.depth + s.radius;
+    if (last < near || first > far) {
+      s.first_slice = 0;
+      s.last_slice = -1;
+      continue;
+    }
+    s.first_slice = first <= near ? 0 : (int)(log(first) * slice_scale + slice_bias);
+    s.last_slice = last >= far ? CLUSTER_GRID_Z - 1 : (int)(log(last) * slice_scale + slice_bias);
+    s.first_slice = std::max(0, s.first_slice);
+    s.last_slice = std::min(CLUSTER_GRID_Z - 1, s.last_slice);
+  }
+
+  // slices are independent, each only appends to its own clusters
+  #pragma omp parallel for schedule(dynamic) if (records.size() >= parallel_cluster_min_lights)
+  for (int k = 0; k < CLUSTER_GRID_Z; k++)
+    bin_slice(k);
+
+  // lists of all clusters back to back
+  grid.resize(2 * cluster_lights.size());
+  indices.clear();
+  counters.max_lights = 0;
+  for (size_t c = 0; c < cluster_lights.size(); c++) {
+    grid[2 * c] = indices.size();
+    grid[2 * c + 1] = cluster_lights[c].size();
+    indices.insert(indices.end(), cluster_lights[c].begin(), cluster_lights[c].end());
+    counters.max_lights = std::max(counters.max_lights, (int)cluster_lights[c].size());
+  }
+
+  if (!buffers[0]) {
+    glGenBuffers(3, buffers);
+    glGenTextures(3, textures);
+    GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+    for (int i = 0; i < 3; i++) {
+      GLState::bind_buffer(GL_TEXTURE_BUFFER, buffers[i]);
+      glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+      GLState::bind_texture(0, GL_TEXTURE_BUFFER, textures[i]);
+      glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+    }
+  }
+
+  // new storage every frame, the textures follow their buffers; empty
+  // lists still get a texel
+  const void *data[3] = { records.data(), grid.data(), indices.data() };
+  size_t sizes[3] = { records.size() * sizeof(LightRecord), grid.size() * sizeof(GLuint),
+                      indices.size() * sizeof(GLuint) };
+  for (int i = 0; i < 3; i++) {
+    GLState::bind_buffer(GL_TEXTURE_BUFFER, buffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(sizes[i], (size_t)16), NULL, GL_STREAM_DRAW);
+    if (sizes[i])
+      glBufferSubData(GL_TEXTURE_BUFFER, 0, sizes[i], data[i]);
+  }
+
+  counters.lights = records.size();
+  counters.indices = indices.size();
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  counters.cpu_ms = elapsed.count();
+}
+
+void LightClusters::bin_slice(int k) {
+  std::vector<GLuint> *slice_lights = &cluster_lights[k * CLUSTER_GRID_X * CLUSTER_GRID_Y];
+  for (int c = 0; c < CLUSTER_GRID_X * CLUSTER_GRID_Y; c++)
+    slice_lights[c].clear();
+
+  // Eye space extent of the tiles over the slice's depth range, the
+  // padding tiles are out of reach of every light
+  float near = slice_depths[k], far = slice_depths[k + 1];
+  float x_min[4 * CLUSTER_GROUPS_X], x_max[4 * CLUSTER_GROUPS_X];
+  float y_min[4 * CLUSTER_GROUPS_Y], y_max[4 * CLUSTER_GROUPS_Y];
+  for (int i = 0; i < 4 * CLUSTER_GROUPS_X; i++) {
+    float lo = (2.f * i / CLUSTER_GRID_X - 1.f) * x_per_ndc;
+    float hi = (2.f * (i + 1) / CLUSTER_GRID_X - 1.f) * x_per_ndc;
+    x_min[i] = i < CLUSTER_GRID_X ? std::min(lo * near, lo * far) : 1e30f;
+    x_max[i] = i < CLUSTER_GRID_X ? std::max(hi * near, hi * far) : 1e30f;
+  }
+  for (int j = 0; j < 4 * CLUSTER_GROUPS_Y; j++) {
+    float lo = (2.f * j / CLUSTER_GRID_Y - 1.f) * y_per_ndc;
+    float hi = (2.f * (j + 1) / CLUSTER_GRID_Y - 1.f) * y_per_ndc;
+    y_min[j] = j < CLUSTER_GRID_Y ? std::min(lo * near, lo * far) : 1e30f;
+    y_max[j] = j < CLUSTER_GRID_Y ? std::max(hi * near, hi * far) : 1e30f;
+  }
+
+  float4 zero = f4_splat(0.f);
+  for (size_t l = 0; l < spheres.size(); l++) {
+    const EyeSphere &s = spheres[l];
+    if (k < s.first_slice || k > s.last_slice)
+      continue;
+
+    // squared distance from the center to a cluster's box is the sum of
+    // the squared distances along each axis
+    float dz = std::max(0.f, std::max(near - s.depth, s.depth - far));
+    float r2 = s.radius * s.radius - dz * dz;
+    if (r2 < 0)
+      continue;
+
+    float4 dx2[CLUSTER_GROUPS_X];
+    float4 cx = f4_splat(s.x);
+    for (int g = 0; g < CLUSTER_GROUPS_X; g++) {
+      float4 d = f4_max(zero, f4_max(f4_sub(f4_load(x_min + 4 * g), cx),
+                                     f4_sub(cx, f4_load(x_max + 4 * g))));
+      dx2[g] = f4_mul(d, d);
+    }
+
+    float dy2[4 * CLUSTER_GROUPS_Y];
+    float4 cy = f4_splat(s.y);
+    for (int g = 0; g < CLUSTER_GROUPS_Y; g++) {
+      float4 d = f4_max(zero, f4_max(f4_sub(f4_load(y_min + 4 * g), cy),
+                                     f4_sub(cy, f4_load(y_max + 4 * g))));
+      f4_store(dy2 + 4 * g, f4_mul(d, d));
+    }
+
+    for (int j = 0; j < CLUSTER_GRID_Y; j++) {
+      float r2_row = r2 - dy2[j];
+      if (r2_row < 0)
+        continue;
+      float4 r2_lanes = f4_splat(r2_row);
+      for (int g = 0; g < CLUSTER_GROUPS_X; g++) {
+        // tiles whose dx^2 <= r2_row
+        int hits = ~f4_less_bits(r2_lanes, dx2[g]) & 0xF;
+        for (int b = 0; b < 4; b++)
+          if (hits & (1 << b))
+            slice_lights[j * CLUSTER_GRID_X + 4 * g + b].push_back(l);
+      }
+    }
+  }
+}
+
+void LightClusters::bind(GLuint first_unit) const {
+  for (int i = 0; i < 3; i++)
+    GLState::bind_texture(first_unit + i, GL_TEXTURE_BUFFER, textures[i]);
+}
+
+}  // namespace DynamicScene
+}  // namespace CS248
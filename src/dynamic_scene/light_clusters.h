@@ -0,0 +1,125 @@
+#ifndef CS248_DYNAMICSCENE_LIGHT_CLUSTERS_H
+#define CS248_DYNAMICSCENE_LIGHT_CLUSTERS_H
+
+#include <vector>
+
+#include "GL/glew.h"
+#include "CS248/matrix4x4.h"
+#include "CS248/vector3D.h"
+
+// Clusters across, up and along the view frustum
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+
+// RGBA32F texels per light in the lights texture, must match LIGHT_TEXELS
+// in the mesh fragment shaders
+#define CLUSTER_LIGHT_TEXELS 3
+
+namespace CS248 {
+namespace DynamicScene {
+
+/**
+ * Clustered forward lighting. The view frustum is divided into a grid of
+ * CLUSTER_GRID_X x CLUSTER_GRID_Y screen tiles by CLUSTER_GRID_Z depth
+ * slices, exponentially spaced between the near and far plane, and every
+ * light is assigned to the clusters its bounding sphere touches. Fragment
+ * shaders then only loop over the lights of their own cluster.
+ *
+ * The shaders read three buffer textures: the lights, the range of the
+ * light index list each cluster uses, and the list itself. Lights are
+ * binned on the CPU every frame, a depth slice per thread, with four tiles
+ * tested against a light at a time.
+ */
+class LightClusters {
+ public:
+
+  /**
+   * A light as the shaders see it, CLUSTER_LIGHT_TEXELS texels of four
+   * floats. The layout is up to the shaders.
+   */
+  struct LightRecord {
+    float texels[CLUSTER_LIGHT_TEXELS][4];
+  };
+
+  /**
+   * Results of the last update().
+   */
+  struct Stats {
+    int lights;
+    int indices;     // entries of the light index list
+    int max_lights;  // in a single cluster
+    double cpu_ms;   // binning and upload
+  };
+
+  LightClusters();
+  ~LightClusters();
+
+  /**
+   * Drops all lights.
+   */
+  void clear();
+
+  /**
+   * Adds a light that can only light points inside the world space
+   * sphere (center, radius).
+   */
+  void add(const LightRecord &record, const Vector3D &center, double radius);
+
+  /**
+   * Bins the lights added since clear() into the clusters of a view, given
+   * by its world to eye transform (looking down -z) and its symmetric
+   * perspective projection with near and far plane, and uploads the
+   * lights, grid and index list.
+   */
+  void update(const Matrix4x4 &view, const Matrix4x4 &projection,
+              double near, double far);
+
+  /**
+   * Binds the lights, the grid and the index list to texture units
+   * first_unit, first_unit + 1 and first_unit + 2.
+   */
+  void bind(GLuint first_unit) const;
+
+  /**
+   * The depth slice of a point at view depth d is
+   * floor(log(d) * depth_scale() + depth_bias()).
+   */
+  float depth_scale() const { return slice_scale; }
+  float depth_bias() const { return slice_bias; }
+
+  const Stats &stats() const { return counters; }
+
+ private:
+  // Appends the lights touching the clusters of slice k to their lists.
+  void bin_slice(int k);
+
+  // a light's bounding sphere in eye space, and the slices it reaches
+  struct EyeSphere {
+    float x, y, depth, radius;
+    int first_slice, last_slice;
+  };
+
+  std::vector<LightRecord> records;
+  std::vector<Vector3D> centers;
+  std::vector<double> radii;
+
+  std::vector<EyeSphere> spheres;
+  std::vector<std::vector<GLuint> > cluster_lights;  // per cluster, by index
+  std::vector<GLuint> grid;     // first index and count per cluster
+  std::vector<GLuint> indices;
+
+  float slice_scale, slice_bias;
+  float slice_depths[CLUSTER_GRID_Z + 1];  // where the slices start and end
+  float x_per_ndc, y_per_ndc;              // eye space extent at depth 1
+
+  GLuint buffers[3];   // lights, grid, indices
+  GLuint textures[3];  // buffer textures of them
+
+  Stats counters;
+};
+
+}  // namespace DynamicScene
+}  // namespace CS248
+
+#endif  // CS248_DYNAMICSCENE_LIGHT_CLUSTERS_H
@@ -1,8 +1,11 @@
 #include "mesh.h"
 #include "CS248/lodepng.h"
+#include "CS248/glstate.h"
 
 #include <cassert>
 #include <sstream>
+#include <cstring>
+#include <cstdio>
 
 #include "../static_scene/object.h"
 #include "../static_scene/light.h"
@@ -18,6 +21,53 @@ static const double low_threshold = .1;
 static const double mid_threshold = .2;
 static const double high_threshold = 1.0 - low_threshold;
 
+// Meshes with at least this many vertices compute their bounds in parallel.
+static const long parallel_bbox_min_vertices = 1 << 16;
+
+// FNV-1a hash of n bytes, continuing from h (hash_basis to start)
+static const uint64_t hash_basis = 14695981039346656037ull;
+static uint64_t hash_bytes(const void *data, size_t n, uint64_t h) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ bytes[i]) * 1099511628211ull;
+  return h;
+}
+
+template <typename T>
+static uint64_t hash_vector(const vector<T> &v, uint64_t h) {
+  return v.empty() ? h : hash_bytes(&v[0], v.size() * sizeof(T), h);
+}
+
+// object space bounding box of a set of vertices
+static BBox vertex_bbox(const vector<Vector3D> &vertices) {
+  long n = (long)vertices.size();
+  Vector3D bmin(INF_D, INF_D, INF_D);
+  Vector3D bmax(-INF_D, -INF_D, -INF_D);
+
+  #pragma omp parallel if (n >= parallel_bbox_min_vertices)
+  {
+    Vector3D lmin(INF_D, INF_D, INF_D);
+    Vector3D lmax(-INF_D, -INF_D, -INF_D);
+
+    #pragma omp for nowait
+    for (long i = 0; i < n; i++) {
+      const Vector3D &v = vertices[i];
+      lmin.x = std::min(lmin.x, v.x); lmax.x = std::max(lmax.x, v.x);
+      lmin.y = std::min(lmin.y, v.y); lmax.y = std::max(lmax.y, v.y);
+      lmin.z = std::min(lmin.z, v.z); lmax.z = std::max(lmax.z, v.z);
+    }
+
+    #pragma omp critical
+    {
+      bmin.x = std::min(bmin.x, lmin.x); bmax.x = std::max(bmax.x, lmax.x);
+      bmin.y = std::min(bmin.y, lmin.y); bmax.y = std::max(bmax.y, lmax.y);
+      bmin.z = std::min(bmin.z, lmin.z); bmax.z = std::max(bmax.z, lmax.z);
+    }
+  }
+
+  return BBox(bmin, bmax);
+}
+
 Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const std::string shader_prefix) {
 
     for (const Collada::Polygon &p : polyMesh.polygons) {
@@ -26,6 +76,14 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
 
     vector<Vector3D> vertices = polyMesh.vertices;  // DELIBERATE COPY
     
+    in_arena = false;
+    permutation = NULL;
+    shader = NULL;
+    gbuffer_permutation = NULL;
+    in_first_pass = false;
+    impostor = NULL;
+    impostor_hash = 0;
+    pattern_program = 0;
     simple_renderable = polyMesh.is_obj_file;
     simple_colors = polyMesh.is_mtl_file;
     if (!simple_renderable)
@@ -38,6 +96,10 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
 	do_texture_mapping = false;
 	do_normal_mapping = false;
 	do_environment_mapping = false;
+	diffuseId = 0;
+	normalId = 0;
+	environmentId = 0;
+	material_id = -1;
 	do_blending = false;
 	do_disney_brdf = false;
 	use_mirror_brdf = polyMesh.is_mirror_brdf;
@@ -54,6 +116,10 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
     position = Vector3D(transform[3][0], transform[3][1], transform[3][2]);
     scale = Vector3D(transform[0][0], transform[1][1], transform[2][2]);
 
+    // the vertices never change, so their bounds are computed once here and
+    // compute_bbox() only has to move the box into world space
+    object_bbox = vertex_bbox(polyMesh.vertices);
+
 	this->vertices.reserve(polyMesh.vertices.size());
 	this->normals.reserve(polyMesh.normals.size());
 	this->texture_coordinates.reserve(polyMesh.texcoords.size());
@@ -153,46 +219,76 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
 	}
 
 	glGenBuffers(1, &vertexBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	GLState::bind_buffer(GL_ARRAY_BUFFER, vertexBuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3Df) * vertexData.size(), (void*)&vertexData[0], GL_STATIC_DRAW);
 
 	glGenBuffers(1, &normalBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+	GLState::bind_buffer(GL_ARRAY_BUFFER, normalBuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3Df) * normalData.size(), (void*)&normalData[0], GL_STATIC_DRAW);
 	  
 	glGenBuffers(1, &texcoordBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, texcoordBuffer);
+	GLState::bind_buffer(GL_ARRAY_BUFFER, texcoordBuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vector2Df) * texcoordData.size(), (void*)&texcoordData[0], GL_STATIC_DRAW);
 
 	glGenBuffers(1, &tangentBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, tangentBuffer);
+	GLState::bind_buffer(GL_ARRAY_BUFFER, tangentBuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3Df) * tangentData.size(), (void*)&tangentData[0], GL_STATIC_DRAW);
 
 	if (diffuse_colorData.size() > 0) {
 		glGenBuffers(1, &diffuse_colorBuffer);
-		glBindBuffer(GL_ARRAY_BUFFER, diffuse_colorBuffer);
+		GLState::bind_buffer(GL_ARRAY_BUFFER, diffuse_colorBuffer);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3Df) * diffuse_colorData.size(), (void*)&diffuse_colorData[0], GL_STATIC_DRAW);
 	}
 
-	glBindVertexArray(0);
+	GLState::bind_vertex_array(0);
 
-	if (polyMesh.vert_filename != "" && polyMesh.frag_filename != "")
-		shaders.push_back(Shader(polyMesh.vert_filename, polyMesh.frag_filename, shader_prefix, shader_prefix));
+	// the program is submitted once the mesh is added to a scene and the
+	// lights are known
+	if (polyMesh.vert_filename != "" && polyMesh.frag_filename != "") {
+		vert_filename = polyMesh.vert_filename;
+		frag_filename = polyMesh.frag_filename;
+		this->shader_prefix = shader_prefix;
+	}
 
 	uniform_strings = polyMesh.uniform_strings;
 	uniform_values = polyMesh.uniform_values;
 
-	if (simple_colors)
-        return;
-	
+	if (!simple_colors)
+		load_textures(polyMesh);
+
+	if (!vert_filename.empty())
+		init_uniforms();
+
+	// identical props share impostor atlases, so everything the views of
+	// one show goes into the hash
+	uint64_t h = hash_vector(vertexData, hash_basis);
+	h = hash_vector(normalData, h);
+	h = hash_vector(texcoordData, h);
+	h = hash_vector(diffuse_colorData, h);
+	h = hash_vector(uniform_values, h);
+	string names = polyMesh.diffuse_filename + "\n" + polyMesh.normal_filename + "\n" +
+	               vert_filename + "\n" + frag_filename + "\n" + shader_prefix;
+	for (const string &name : uniform_strings)
+		names += "\n" + name;
+	h = hash_bytes(names.data(), names.size(), h);
+	impostor_hash = hash_bytes(&phong_spec_exp, sizeof(phong_spec_exp), h);
+}
+
+void Mesh::load_textures(Collada::PolymeshInfo &polyMesh) {
+
     do_disney_brdf = polyMesh.is_disney;
 
     // create the diffuse albedo texture map
 	if (polyMesh.diffuse_filename != "") {
 		unsigned int error = lodepng::decode(diffuse_texture, diffuse_texture_width, diffuse_texture_height, polyMesh.diffuse_filename);
-		if(error) cerr << "Texture (diffuse) loading error = " << polyMesh.diffuse_filename << endl;
+		if(error) {
+			cerr << "Texture (diffuse) loading error = " << polyMesh.diffuse_filename << endl;
+			// lodepng leaves the size unset, don't hand it to GL
+			diffuse_texture_width = diffuse_texture_height = 0;
+			diffuse_texture.assign(4, 0);
+		}
 		glGenTextures(1, &diffuseId);
-		glBindTexture(GL_TEXTURE_2D, diffuseId);
+		GLState::bind_texture(0, GL_TEXTURE_2D, diffuseId);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, diffuse_texture_width, diffuse_texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void *)&diffuse_texture[0]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -206,9 +302,13 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
     // create the normal map texture map
     if(polyMesh.normal_filename != "") {
 		unsigned int error = lodepng::decode(normal_texture, normal_texture_width, normal_texture_height, polyMesh.normal_filename);
-		if(error) cerr << "Texture (normal) loading error = " << polyMesh.normal_filename << endl;
+		if(error) {
+			cerr << "Texture (normal) loading error = " << polyMesh.normal_filename << endl;
+			normal_texture_width = normal_texture_height = 0;
+			normal_texture.assign(4, 0);
+		}
 		glGenTextures(1, &normalId);
-		glBindTexture(GL_TEXTURE_2D, normalId);
+		GLState::bind_texture(0, GL_TEXTURE_2D, normalId);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, normal_texture_width, normal_texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void *)&normal_texture[0]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -222,9 +322,13 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
     // create the environment lighting texture map
     if(polyMesh.environment_filename != "") {
 		unsigned int error = lodepng::decode(environment_texture, environment_texture_width, environment_texture_height, polyMesh.environment_filename);
-		if(error) cerr << "Texture (environment) loading error = " << polyMesh.environment_filename << endl;
+		if(error) {
+			cerr << "Texture (environment) loading error = " << polyMesh.environment_filename << endl;
+			environment_texture_width = environment_texture_height = 0;
+			environment_texture.assign(4, 0);
+		}
 		glGenTextures(1, &environmentId);
-		glBindTexture(GL_TEXTURE_2D, environmentId);
+		GLState::bind_texture(0, GL_TEXTURE_2D, environmentId);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, environment_texture_width, environment_texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void *)&environment_texture[0]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -233,339 +337,327 @@ Mesh::Mesh(Collada::PolymeshInfo &polyMesh, const Matrix4x4 &transform, const st
 	    do_environment_mapping = true;
     } else
         do_environment_mapping = false;
+}
+
+void Mesh::init_uniforms() {
 
-	glBindTexture(GL_TEXTURE_2D, 0);
+	// material parameters are passed in the ObjectUniforms block, the
+	// transforms in it are filled in by draw_pass()
+	memset(&object_uniforms, 0, sizeof(object_uniforms));
+	object_uniforms.useTextureMapping = do_texture_mapping ? 1 : 0;
+	object_uniforms.useNormalMapping = do_normal_mapping ? 1 : 0;
+	object_uniforms.useEnvironmentMapping = do_environment_mapping ? 1 : 0;
+	object_uniforms.useMirrorBRDF = use_mirror_brdf ? 1 : 0;
+	object_uniforms.spec_exp = phong_spec_exp;
+}
+
+void Mesh::prepare_shaders() {
+	if (permutation || vert_filename.empty())
+		return;
+
+	uint32_t features = 0;
+	if (do_texture_mapping)
+		features |= SHADER_FEATURE_TEXTURE_MAPPING;
+	if (do_normal_mapping)
+		features |= SHADER_FEATURE_NORMAL_MAPPING;
+	if (do_environment_mapping)
+		features |= SHADER_FEATURE_ENVIRONMENT_MAPPING;
+	if (use_mirror_brdf)
+		features |= SHADER_FEATURE_MIRROR_BRDF;
+
+	permutation = scene->get_shader_permutation(vert_filename, frag_filename, shader_prefix, features,
+	                                            uniform_strings, uniform_values);
+}
+
+Shader *Mesh::get_shader() {
+	prepare_shaders();
+	shader = permutation ? scene->get_ready_shader(permutation) : NULL;
+	return shader;
+}
+
+Shader *Mesh::get_gbuffer_shader() {
+	// mirrors reflect the environment map, which the G-buffer doesn't hold
+	if (use_mirror_brdf || !permutation || !permutation->configured)
+		return NULL;
+
+	if (!gbuffer_permutation) {
+		// the mesh's own program decides how the lighting pass shades it:
+		// programs that read the shadow maps are lit like shader_shadow.frag
+		uint32_t features = 0;
+		if (do_texture_mapping)
+			features |= SHADER_FEATURE_TEXTURE_MAPPING;
+		if (do_normal_mapping)
+			features |= SHADER_FEATURE_NORMAL_MAPPING;
+		if (permutation->shader->_locations.shadowTextureArray >= 0)
+			features |= SHADER_FEATURE_SHADOW_RECEIVER;
+		gbuffer_permutation = scene->get_gbuffer_shader_permutation(vert_filename, shader_prefix, features);
+	}
+
+	// no fallback here, the mesh is drawn forward until the program is built
+	if (!gbuffer_permutation->configured && !gbuffer_permutation->shader->isReady())
+		return NULL;
+	return scene->get_ready_shader(gbuffer_permutation);
 }
 
 Mesh::~Mesh() {
-    glDeleteBuffers(1, &vertexBuffer);
-    glDeleteBuffers(1, &normalBuffer);
-    glDeleteBuffers(1, &texcoordBuffer);
-	glDeleteBuffers(1, &tangentBuffer);
+    GLState::delete_buffers(1, &vertexBuffer);
+    GLState::delete_buffers(1, &normalBuffer);
+    GLState::delete_buffers(1, &texcoordBuffer);
+	GLState::delete_buffers(1, &tangentBuffer);
 
     if (diffuse_colorData.size() > 0)
-        glDeleteBuffers(1, &diffuse_colorBuffer);
+        GLState::delete_buffers(1, &diffuse_colorBuffer);
 }
 
 void Mesh::draw_pretty() {
-  glPushMatrix();
-  glTranslatef(position.x, position.y, position.z);
-  glRotatef(rotation.x, 1.0f, 0.0f, 0.0f);
-  glRotatef(rotation.y, 0.0f, 1.0f, 0.0f);
-  glRotatef(rotation.z, 0.0f, 0.0f, 1.0f);
-  glScalef(scale.x, scale.y, scale.z);
-
-  glBindTexture(GL_TEXTURE_2D, 0);
+  GLState::bind_texture(0, GL_TEXTURE_2D, 0);
   Spectrum white = Spectrum(1., 1., 1.);
   glMaterialfv(GL_FRONT, GL_DIFFUSE, &white.r);
 
   // Enable lighting for faces
-  glEnable(GL_LIGHTING);
-  glDisable(GL_BLEND);
-  draw_faces(true, false);
+  GLState::enable(GL_LIGHTING);
+  GLState::disable(GL_BLEND);
 
-  glPopMatrix();
+  // the shaders apply the object transform
+  update_object_transform();
+  draw_faces(true, RENDER_PASS_COLOR);
 }
 
 void Mesh::draw() {
-	draw_pass(false);
+	if (impostor)
+		scene->draw_impostor(impostor, get_bbox());
+	else
+		draw_pass(RENDER_PASS_COLOR);
 }
 
 void Mesh::draw_shadow() {
-	draw_pass(true);
+	draw_pass(RENDER_PASS_SHADOW);
+}
+
+void Mesh::draw_gbuffer() {
+	draw_pass(RENDER_PASS_GBUFFER);
 }
 
-void Mesh::draw_pass(bool is_shadow_pass) {
-  glPushMatrix();
-
-  glTranslatef(position.x, position.y, position.z);
-  glRotatef(rotation.x, 1.0f, 0.0f, 0.0f);
-  glRotatef(rotation.y, 0.0f, 1.0f, 0.0f);
-  glRotatef(rotation.z, 0.0f, 0.0f, 1.0f);
-  glScalef(scale.x, scale.y, scale.z);
-
-  float deg2Rad = M_PI / 180.0;
-  
-  Matrix4x4 T = Matrix4x4::translation(position);
-  Matrix4x4 RX = Matrix4x4::rotation(rotation.x * deg2Rad, Matrix4x4::Axis::X);
-  Matrix4x4 RY = Matrix4x4::rotation(rotation.y * deg2Rad, Matrix4x4::Axis::Y);
-  Matrix4x4 RZ = Matrix4x4::rotation(rotation.z * deg2Rad, Matrix4x4::Axis::Z);
-  Matrix4x4 scaleXform = Matrix4x4::scaling(scale);
-  
-  Matrix4x4 xform = T * RX * RY * RZ * scaleXform;
-
-  // inv transpose for transforming normals
-  Matrix4x4 xformNorm = (RX * RY * RZ * scaleXform).inv().T();    
-
-  // copy to column-major buffers for hand off to OpenGL  
-  int idx = 0;
-  for (int i=0; i<4; i++) {
-      const Vector4D& c = xform.column(i); 
-      glObj2World[idx++] = c[0]; glObj2World[idx++] = c[1]; glObj2World[idx++] = c[2]; glObj2World[idx++] = c[3];
+ImpostorAtlas *Mesh::get_impostor() {
+	// mirrors reflect the environment map, which the atlas doesn't hold
+	if (use_mirror_brdf)
+		return NULL;
+
+	if (impostor_key.empty() || !(impostor_key_rotation == rotation) || !(impostor_key_scale == scale)) {
+		char key[192];
+		snprintf(key, sizeof(key), "%016llx %.9g %.9g %.9g %.9g %.9g %.9g",
+		         (unsigned long long)impostor_hash, rotation.x, rotation.y, rotation.z,
+		         scale.x, scale.y, scale.z);
+		impostor_key = key;
+		impostor_key_rotation = rotation;
+		impostor_key_scale = scale;
+	}
+	return scene->get_impostor(this, impostor_key);
+}
+
+void Mesh::enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth) {
+
+  if (!simple_renderable || !get_shader())
+    return;
+
+  // distant meshes are drawn as impostors in the color passes; the depth
+  // prepass and the G-buffer pass leave them to RENDER_PASS_FORWARD
+  impostor = pass == RENDER_PASS_SHADOW ? NULL : get_impostor();
+  if (impostor) {
+    in_first_pass = false;
+    if (pass == RENDER_PASS_COLOR || pass == RENDER_PASS_FORWARD) {
+      GLuint program = scene->get_impostor_shader()->_programID;
+      queue.push(RenderQueue::make_key(pass, program, impostor->material_id, depth), this);
+    }
+    return;
   }
 
-  idx = 0;
-  for (int i=0; i<3; i++) {
-      const Vector4D& c = xformNorm.column(i); 
-      glObj2WorldNorm[idx++] = c[0]; glObj2WorldNorm[idx++] = c[1]; glObj2WorldNorm[idx++] = c[2];
-  }  
-  
-  // make an object to shadow light space matrix here
-  if (!is_shadow_pass) {
-
-  	for (int light_id=0; light_id < scene->get_num_shadowed_lights(); light_id++) {
-	  	Matrix4x4 w2sl = scene->get_world_to_shadowlight(light_id);
-	  	Matrix4x4 o2sl = w2sl * xform;
-		idx = 0;
-	  	for (int i=0; i<4; i++) {
-	    	const Vector4D& c = o2sl.column(i); 
-	      	glObj2ShadowLight[light_id][idx++] = c[0];
-	      	glObj2ShadowLight[light_id][idx++] = c[1];
-	      	glObj2ShadowLight[light_id][idx++] = c[2];
-	      	glObj2ShadowLight[light_id][idx++] = c[3];
-	  	}
-	 }
+  if (pass == RENDER_PASS_SHADOW || pass == RENDER_PASS_DEPTH) {
+    // depth only, textures don't matter
+    if (pass == RENDER_PASS_DEPTH)
+      in_first_pass = true;
+    GLuint program = scene->get_shadow_shader()->_programID;
+    queue.push(RenderQueue::make_key(pass, program, 0, depth), this);
+    return;
   }
 
-  draw_faces(false, is_shadow_pass);
-  glPopMatrix();
+  if (pass == RENDER_PASS_GBUFFER) {
+    // meshes without a G-buffer program are drawn in the forward pass
+    Shader *gbuffer_shader = get_gbuffer_shader();
+    in_first_pass = gbuffer_shader != NULL;
+    if (!in_first_pass)
+      return;
+    shader = gbuffer_shader;
+  } else if (pass == RENDER_PASS_FORWARD && in_first_pass) {
+    return;
+  }
 
+  if (material_id < 0) {
+    std::vector<GLuint> textures = { diffuseId, normalId, environmentId };
+    material_id = scene->get_material_id(textures);
+  }
+  queue.push(RenderQueue::make_key(pass, shader->_programID, material_id, depth), this);
 }
 
-void Mesh::draw_faces(bool smooth, bool is_shadow_pass) const {
+void Mesh::add_to_arena(GeometryArena &arena) {
+  if (!simple_renderable)
+    return;
 
-	checkGLError("begin draw faces");
+  arena_range = arena.add(vertexData.size(), &vertexData[0].x, &normalData[0].x,
+                          texcoordData.size() == vertexData.size() ? &texcoordData[0].x : NULL,
+                          &tangentData[0].x,
+                          diffuse_colorData.empty() ? NULL : &diffuse_colorData[0].x);
+  in_arena = true;
+}
 
-    if (!simple_renderable)
-        return;
-    
-    if (is_shadow_pass) {
+bool Mesh::get_arena_draw(ArenaRange &range, ObjectUniforms &uniforms) {
+  if (!in_arena || impostor)
+    return false;
 
-    	GLuint shadow_program_id = scene->get_shadow_shader()->_programID;
-        glUseProgram(shadow_program_id);
+  update_object_transform();
+  range = arena_range;
+  uniforms = object_uniforms;
+  return true;
+}
 
-	    int vert_loc = glGetAttribLocation(shadow_program_id, "vtx_position");
-	    if (vert_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-            glVertexAttribPointer(vert_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(vert_loc);
-	    }
+void Mesh::draw_pass(RenderPass pass) {
+  // the shaders transform vertices to world space themselves, the
+  // modelview matrix only holds the camera (or light) view
+  update_object_transform();
+  draw_faces(false, pass);
+}
 
-    } else {
+void Mesh::update_object_transform() {
+  // the light space positions needed for shadowing are computed in the
+  // fragment shader from the world space position and the per-frame
+  // shadow map transforms
+  const GLTransform &t = get_gl_transform();
+  memcpy(object_uniforms.obj2world, t.obj2world, sizeof(t.obj2world));
+  memcpy(object_uniforms.obj2worldNorm, t.obj2worldNorm, sizeof(t.obj2worldNorm));
+}
+
+void Mesh::bind_batch_state(RenderPass pass) {
+
+    if (pass == RENDER_PASS_SHADOW || pass == RENDER_PASS_DEPTH) {
+        GLState::use_program(scene->get_shadow_shader()->_programID);
+        return;
+    }
 
-    	checkGLError("before use program");
+    checkGLError("before use program");
 
-        GLuint programID = shaders[0]._programID;
+    GLuint programID = shader->_programID;
+    const ShaderLocations& loc = shader->_locations;
 
-        glUseProgram(programID);
+    GLState::use_program(programID);
 
-		checkGLError("before bind uniforms");
+    checkGLError("before bind uniforms");
 
-	    // bind uniforms
+    // bind uniforms
 
-        for (int j = 0; j < scene->patterns.size(); ++j) {
-            DynamicScene::PatternObject &po = scene->patterns[j];
-            int uniformLocation  = glGetUniformLocation(programID, po.name.c_str());
-            if (uniformLocation >= 0) {
-                if(po.type == 0) {
-                    glUniform3f(uniformLocation, po.v.x, po.v.y, po.v.z);
-                } else if(po.type == 1) {
-                    glUniform1f(uniformLocation, po.s);
-                }
+    // patterns are only known once the scene is set up, so their
+    // locations are looked up on the first draw (and again once the
+    // program changes from the fallback). gbuffer.frag has none.
+    bool set_patterns = pass != RENDER_PASS_GBUFFER;
+    if (set_patterns && (pattern_locations.size() != scene->patterns.size() || pattern_program != programID)) {
+        pattern_program = programID;
+        pattern_locations.resize(scene->patterns.size());
+        for (int j = 0; j < scene->patterns.size(); ++j)
+            pattern_locations[j] = glGetUniformLocation(programID, scene->patterns[j].name.c_str());
+    }
+
+    for (int j = 0; set_patterns && j < scene->patterns.size(); ++j) {
+        DynamicScene::PatternObject &po = scene->patterns[j];
+        int uniformLocation = pattern_locations[j];
+        if (uniformLocation >= 0) {
+            if(po.type == 0) {
+                glUniform3f(uniformLocation, po.v.x, po.v.y, po.v.z);
+            } else if(po.type == 1) {
+                glUniform1f(uniformLocation, po.s);
             }
         }
+    }
 
-		for (int j = 0; j < uniform_strings.size(); ++j) {
-			int uniformLocation = glGetUniformLocation(programID, uniform_strings[j].c_str());
-			if(uniformLocation >= 0) {
-				glUniform1f(uniformLocation, uniform_values[j]);
-			}
-		}
+    // bind textures (the sampler units are set once per program in
+    // Scene::get_ready_shader) ///
 
-        int uniformLocation = glGetUniformLocation(programID, "useTextureMapping");
-        if(uniformLocation >= 0)
-            glUniform1i(uniformLocation, do_texture_mapping ? 1 : 0);
-
-        uniformLocation = glGetUniformLocation(programID, "useNormalMapping");
-        if(uniformLocation >= 0)
-            glUniform1i(uniformLocation, do_normal_mapping ? 1 : 0);
-        
-        uniformLocation = glGetUniformLocation(programID, "useEnvironmentMapping");
-        if(uniformLocation >= 0)
-            glUniform1i(uniformLocation, do_environment_mapping ? 1 : 0);
- 
-        uniformLocation = glGetUniformLocation(programID, "useMirrorBRDF");
-        if(uniformLocation >= 0)
-            glUniform1i(uniformLocation, use_mirror_brdf ? 1 : 0);
-       	
-		uniformLocation = glGetUniformLocation(programID, "spec_exp");
-		if(uniformLocation >= 0)
-			glUniform1f(uniformLocation, phong_spec_exp);
-			
-        uniformLocation = glGetUniformLocation(programID, "obj2world");
-        if(uniformLocation >= 0)
-            glUniformMatrix4fv(uniformLocation, 1, GL_FALSE, glObj2World);
-        
-        uniformLocation = glGetUniformLocation(programID, "obj2worldNorm");
-        if(uniformLocation >= 0)
-            glUniformMatrix3fv(uniformLocation, 1, GL_FALSE, glObj2WorldNorm);
-
-        int num_shadowed_lights = scene->get_num_shadowed_lights();
- 		for (int i=0; i<num_shadowed_lights; i++) {	
-        	string varname = "obj2shadowlight" + std::to_string(i);
-        	uniformLocation = glGetUniformLocation(programID, varname.c_str());
-        	if(uniformLocation >= 0)
-            	glUniformMatrix4fv(uniformLocation, 1, GL_FALSE, glObj2ShadowLight[i]);
-        }
+    if (loc.diffuseTextureSampler >= 0) {
+        GLState::bind_texture(0, GL_TEXTURE_2D, diffuseId);
+    }
 
-        Vector3D camPosition = scene->camera->position();
-        float v1 = camPosition.x;
-        float v2 = camPosition.y;
-        float v3 = camPosition.z;
-        uniformLocation = glGetUniformLocation( programID, "camera_position" );
-        if (uniformLocation >=0)
-        	glUniform3f( uniformLocation, v1, v2, v3 );
-
-        // bind texture samplers ///////////////////////////////////
-
-        int diffuseTextureID = glGetUniformLocation(programID, "diffuseTextureSampler");
-        if (diffuseTextureID >= 0) {
-	        glActiveTexture(GL_TEXTURE0);
-	        glBindTexture(GL_TEXTURE_2D, diffuseId);
-            glUniform1i(diffuseTextureID, 0);
-        }
+    if (loc.normalTextureSampler >= 0) {
+        GLState::bind_texture(1, GL_TEXTURE_2D, normalId);
+    }
 
-        int normalTextureID = glGetUniformLocation(programID, "normalTextureSampler");
-        if (normalTextureID >= 0) {
-	        glActiveTexture(GL_TEXTURE1);
-	        glBindTexture(GL_TEXTURE_2D, normalId);
-            glUniform1i(normalTextureID, 1);
-        }
+    if (loc.environmentTextureSampler >= 0) {
+        GLState::bind_texture(2, GL_TEXTURE_2D, environmentId);
+    }
 
-        int environmentTextureID = glGetUniformLocation(programID, "environmentTextureSampler");
-        if (environmentTextureID >= 0) {
-	        glActiveTexture(GL_TEXTURE2);
-	        glBindTexture(GL_TEXTURE_2D, environmentId);
-            glUniform1i(environmentTextureID, 2);
-        }
+    if (loc.shadowTextureArray >= 0 && scene->requires_shadow_pass()) {
+        GLState::bind_texture(3, GL_TEXTURE_2D_ARRAY, scene->get_shadow_texture());
+    }
 
-        for (int i=0; i<num_shadowed_lights; i++) {
-        	string varname = "shadowTextureSampler" + std::to_string(i);
-            int shadowTextureID  = glGetUniformLocation(programID, varname.c_str());
-	        if (shadowTextureID >= 0) {
-		        glActiveTexture(GL_TEXTURE3 + i);
-		        glBindTexture(GL_TEXTURE_2D, scene->get_shadow_texture(i));
-	            glUniform1i(shadowTextureID, 3 + i);
-	        }
-    	}
-
-        // bind light parameters //////////////////////////////////
-
-        uniformLocation = glGetUniformLocation( programID, "num_directional_lights" );
-        if (uniformLocation >= 0)
-        	glUniform1i( uniformLocation, scene->directional_lights.size() );
-
-        for (int j = 0; j < scene->directional_lights.size(); ++j) {
-            StaticScene::DirectionalLight *light = scene->directional_lights[j];
-            float v1 = light->lightDir.x;
-            float v2 = light->lightDir.y;
-            float v3 = light->lightDir.z;		
-            string str = "directional_light_vectors[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if (uniformLocation >= 0)
-            	glUniform3f( uniformLocation, v1, v2, v3 );
-        }
+    if (loc.shadowMomentsArray >= 0 && scene->get_shadow_moments_texture()) {
+        GLState::bind_texture(4, GL_TEXTURE_2D_ARRAY, scene->get_shadow_moments_texture());
+    }
+}
 
-        uniformLocation = glGetUniformLocation( programID, "num_point_lights" );
-        if (uniformLocation >= 0)
-        	glUniform1i( uniformLocation, scene->point_lights.size() );
-
-        for (int j = 0; j < scene->point_lights.size(); ++j) {
-            StaticScene::PointLight *light = scene->point_lights[j];
-            float v1 = light->position.x;
-            float v2 = light->position.y;
-            float v3 = light->position.z;
-            string str = "point_light_positions[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if(uniformLocation >= 0)
-            	glUniform3f( uniformLocation, v1, v2, v3 );
-        }
+void Mesh::draw_faces(bool smooth, RenderPass pass) {
 
-        uniformLocation = glGetUniformLocation( programID, "num_spot_lights" );
-        if (uniformLocation >= 0)
-        	glUniform1i( uniformLocation, scene->spot_lights.size() );
-
-        for (int j = 0; j < scene->spot_lights.size(); ++j) {
-            StaticScene::SpotLight *light = scene->spot_lights[j];
-            float v1 = light->position.x;
-            float v2 = light->position.y;
-            float v3 = light->position.z;
-            string str = "spot_light_positions[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if(uniformLocation >= 0)
-            	glUniform3f( uniformLocation, v1, v2, v3 );
-
-            v1 = light->direction.x;
-            v2 = light->direction.y;
-            v3 = light->direction.z;
-            str = "spot_light_directions[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if(uniformLocation >= 0)
-            	glUniform3f( uniformLocation, v1, v2, v3 );
-
-            v1 = light->angle;
-            str = "spot_light_angles[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if(uniformLocation >= 0)
-            	glUniform1f( uniformLocation, v1);
-
-            v1 = light->radiance.r;
-            v2 = light->radiance.g;
-            v3 = light->radiance.b;
-            str = "spot_light_intensities[" + std::to_string(j) + "]";
-            uniformLocation = glGetUniformLocation( programID, str.c_str() );
-            if(uniformLocation >= 0)
-            	glUniform3f( uniformLocation, v1, v2, v3 );
+	checkGLError("begin draw faces");
 
-        }
+    if (!simple_renderable || !get_shader())
+        return;
+    if (pass == RENDER_PASS_GBUFFER && !(shader = get_gbuffer_shader()))
+        return;
+    
+    bind_batch_state(pass);
+    scene->bind_object_uniforms(object_uniforms);
+
+    if (pass == RENDER_PASS_SHADOW) {
+
+	    int vert_loc = scene->get_shadow_shader()->_locations.vtx_position;
+	    if (vert_loc >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glVertexAttribPointer(vert_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(vert_loc);
+	    }
+
+    } else {
+
+        const ShaderLocations& loc = shader->_locations;
 
         // bind per-vertex attribute buffers  //////////////////////
 
 	    checkGLError("before bind vertex attributes");
 
-	    int vert_loc = glGetAttribLocation(programID, "vtx_position");
-	    if (vert_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-            glVertexAttribPointer(vert_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(vert_loc);
+	    if (loc.vtx_position >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glVertexAttribPointer(loc.vtx_position, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(loc.vtx_position);
 	    }
 
-	    int dclr_loc = glGetAttribLocation(programID, "vtx_diffuse_color");
-	    if (dclr_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, diffuse_colorBuffer);
-            glVertexAttribPointer(dclr_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(dclr_loc);
+	    if (loc.vtx_diffuse_color >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, diffuse_colorBuffer);
+            glVertexAttribPointer(loc.vtx_diffuse_color, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(loc.vtx_diffuse_color);
 	    }
 
-	    int normal_loc = glGetAttribLocation(programID, "vtx_normal");
-        if(normal_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
-            glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(normal_loc);
+        if (loc.vtx_normal >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, normalBuffer);
+            glVertexAttribPointer(loc.vtx_normal, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(loc.vtx_normal);
         }
 
-	    int tex_loc = glGetAttribLocation(programID, "vtx_texcoord");
-	    if (tex_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, texcoordBuffer);
-            glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(tex_loc);
+	    if (loc.vtx_texcoord >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, texcoordBuffer);
+            glVertexAttribPointer(loc.vtx_texcoord, 2, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(loc.vtx_texcoord);
 	    }
 
-        int tan_loc = glGetAttribLocation(programID, "vtx_tangent");
-        if (tan_loc >= 0) {
-            glBindBuffer(GL_ARRAY_BUFFER, tangentBuffer);
-            glVertexAttribPointer(tan_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(tan_loc);
+        if (loc.vtx_tangent >= 0) {
+            GLState::bind_buffer(GL_ARRAY_BUFFER, tangentBuffer);
+            glVertexAttribPointer(loc.vtx_tangent, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            GLState::enable_vertex_attrib_array(loc.vtx_tangent);
         }
 	}
 
@@ -573,24 +665,14 @@ void Mesh::draw_faces(bool smooth, bool is_shadow_pass) const {
 
 	glDrawArrays(GL_TRIANGLES, 0, 3 * polygons.size());
 
-	glUseProgram(0);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
 	checkGLError("end draw faces");
 }
 
 
-BBox Mesh::get_bbox() {
-  BBox bbox;
-  if (simple_renderable) {
-	  for(int i = 0; i < vertices.size(); ++i) {
-		Vector3Df &u = vertices[i];
-		Vector3D v(u.x, u.y, u.z);
-		bbox.expand(v);
-	  }
-	  return bbox;
-  }
-  return bbox;
+BBox Mesh::compute_bbox() {
+  if (!simple_renderable)
+    return BBox();
+  return object_bbox.transform(getTransformation());
 }
 
 StaticScene::SceneObject *Mesh::get_static_object() {
@@ -36,19 +36,36 @@ class Mesh : public SceneObject {
 
   virtual void draw() override;
   virtual void draw_shadow() override;
+  virtual void draw_gbuffer() override;
 
   void draw_pretty() override;
 
-  StaticScene::SceneObject *get_transformed_static_object(double t) override;
+  void enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth) override;
+
+  void add_to_arena(GeometryArena &arena) override;
+  bool get_arena_draw(ArenaRange &range, ObjectUniforms &uniforms) override;
+  void bind_batch_state(RenderPass pass) override;
+  void prepare_shaders() override;
 
-  BBox get_bbox() override;
+  StaticScene::SceneObject *get_transformed_static_object(double t) override;
 
   StaticScene::SceneObject *get_static_object() override;
 
+ protected:
+  BBox compute_bbox() override;
+
  private:
   // Helpers for draw().
-  void draw_faces(bool smooth, bool is_shadow_pass) const;
-  void draw_pass(bool is_shadow_pass);
+  void draw_faces(bool smooth, RenderPass pass);
+  void draw_pass(RenderPass pass);
+  void update_object_transform();
+
+  // Helpers for the constructor.
+  void load_textures(Collada::PolymeshInfo &polyMesh);
+  void init_uniforms();
+  Shader *get_shader();
+  Shader *get_gbuffer_shader();
+  ImpostorAtlas *get_impostor();
 
   // Texture map
   vector<unsigned char> diffuse_texture;
@@ -79,6 +96,9 @@ class Mesh : public SceneObject {
   vector<Vector3Df> tangentData;
   vector<Vector3Df> bitangents;
   
+  // Object space bounds of vertices
+  BBox object_bbox;
+
   // Per face
   vector<Vector3Df> diffuse_colors;
   
@@ -88,14 +108,50 @@ class Mesh : public SceneObject {
   vector<Vector3Df> normalData;
   vector<Vector2Df> texcoordData;
 
-  vector<Shader> shaders;
+  // files and prefix the mesh's program is built from, the scene's
+  // permutation of them for the mesh's features (see prepare_shaders()),
+  // and the program the current draws use: the permutation's, or the
+  // fallback while it is compiling, picked by get_shader()
+  string vert_filename;
+  string frag_filename;
+  string shader_prefix;
+  Scene::ShaderPermutation *permutation;
+  Shader *shader;
+
+  // the program writing the mesh's G-buffer, requested once the mesh's
+  // own program is linked (see get_gbuffer_shader())
+  Scene::ShaderPermutation *gbuffer_permutation;
+
+  // the mesh was drawn in this frame's G-buffer pass or depth prepass, so
+  // RENDER_PASS_FORWARD leaves it out
+  bool in_first_pass;
+
+  // the atlas the current color pass draws the mesh with, NULL if it
+  // draws the triangles. Meshes share atlases by impostor_key: a hash of
+  // everything the mesh looks like (impostor_hash, computed once) and its
+  // rotation and scale when the key was built.
+  ImpostorAtlas *impostor;
+  uint64_t impostor_hash;
+  string impostor_key;
+  Vector3D impostor_key_rotation;
+  Vector3D impostor_key_scale;
 
   std::vector<std::string> uniform_strings;
   std::vector<float> uniform_values;
 
-  float glObj2World[16];
-  float glObj2WorldNorm[9];
-  float glObj2ShadowLight[SCENE_MAX_SHADOWED_LIGHTS][16];
+  // locations of scene->patterns in pattern_program
+  std::vector<GLint> pattern_locations;
+  GLuint pattern_program;
+
+  // scene material id of the texture set, -1 until first enqueued
+  int material_id;
+
+  // contents of the ObjectUniforms block for this mesh's draws
+  ObjectUniforms object_uniforms;
+
+  // where the mesh's triangles are in the scene's arena, if in_arena
+  ArenaRange arena_range;
+  bool in_arena;
   
   GLuint vertexBuffer;
   GLuint diffuse_colorBuffer;
@@ -0,0 +1,84 @@
+#include "render_queue.h"
+
+namespace CS248 {
+namespace DynamicScene {
+
+static const int MATERIAL_SHIFT = RenderQueue::DEPTH_BITS;
+static const int PROGRAM_SHIFT = MATERIAL_SHIFT + RenderQueue::MATERIAL_BITS;
+static const int PASS_SHIFT = PROGRAM_SHIFT + RenderQueue::PROGRAM_BITS;
+
+static inline uint64_t field_mask(int bits) {
+  return (((uint64_t) 1) << bits) - 1;
+}
+
+uint64_t RenderQueue::make_key(RenderPass pass, uint32_t program,
+                               uint32_t material, uint32_t depth) {
+  return (((uint64_t) pass     & field_mask(PASS_BITS))     << PASS_SHIFT)
+       | (((uint64_t) program  & field_mask(PROGRAM_BITS))  << PROGRAM_SHIFT)
+       | (((uint64_t) material & field_mask(MATERIAL_BITS)) << MATERIAL_SHIFT)
+       |  ((uint64_t) depth    & field_mask(DEPTH_BITS));
+}
+
+uint32_t RenderQueue::depth_bucket(double d, double range) {
+  const uint32_t max_bucket = (uint32_t) field_mask(DEPTH_BITS);
+  if (!(range > 0) || !(d > 0)) return 0;
+  if (d >= range) return max_bucket;
+  return (uint32_t) (d / range * max_bucket);
+}
+
+void RenderQueue::push(uint64_t key, SceneObject *object) {
+  RenderItem item;
+  item.key = key;
+  item.object = object;
+  items.push_back(item);
+}
+
+void RenderQueue::sort() {
+  const size_t n = items.size();
+  if (n < 2) return;
+
+  scratch.resize(n);
+  RenderItem *src = &items[0];
+  RenderItem *dst = &scratch[0];
+
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t count[256] = { 0 };
+    for (size_t i = 0; i < n; i++)
+      count[(src[i].key >> shift) & 0xff]++;
+
+    // all keys share this byte, so the pass wouldn't change the order
+    if (count[(src[0].key >> shift) & 0xff] == n)
+      continue;
+
+    size_t offset = 0;
+    for (int b = 0; b < 256; b++) {
+      size_t c = count[b];
+      count[b] = offset;
+      offset += c;
+    }
+    for (size_t i = 0; i < n; i++)
+      dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+
+    RenderItem *tmp = src; src = dst; dst = tmp;
+  }
+
+  if (src != &items[0])
+    items.swap(scratch);
+}
+
+int RenderQueue::count_state_changes() const {
+  const uint64_t program_mask = field_mask(PASS_BITS + PROGRAM_BITS) << PROGRAM_SHIFT;
+  const uint64_t material_mask = field_mask(MATERIAL_BITS) << MATERIAL_SHIFT;
+
+  int changes = 0;
+  for (size_t i = 0; i < items.size(); i++) {
+    uint64_t key = items[i].key;
+    uint64_t prev = i > 0 ? items[i - 1].key : ~key;
+    if ((key ^ prev) & program_mask) changes++;
+    if ((key ^ prev) & material_mask) changes++;
+  }
+  return changes;
+}
+
+}  // namespace DynamicScene
+}  // namespace CS248
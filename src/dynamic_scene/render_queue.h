@@ -0,0 +1,87 @@
+#ifndef CS248_DYNAMICSCENE_RENDER_QUEUE_H
+#define CS248_DYNAMICSCENE_RENDER_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace CS248 {
+namespace DynamicScene {
+
+class SceneObject;
+
+// Deferred frames draw RENDER_PASS_GBUFFER and, after lighting it,
+// RENDER_PASS_FORWARD: only the draws the G-buffer pass left out. Forward
+// frames with a depth prepass draw RENDER_PASS_DEPTH (positions only, as
+// in shadow passes), RENDER_PASS_SHADE (the color of the same draws, depth
+// tested for equality) and RENDER_PASS_FORWARD for the rest.
+enum RenderPass {
+  RENDER_PASS_SHADOW  = 0,
+  RENDER_PASS_COLOR   = 1,
+  RENDER_PASS_GBUFFER = 2,
+  RENDER_PASS_FORWARD = 3,
+  RENDER_PASS_DEPTH   = 4,
+  RENDER_PASS_SHADE   = 5
+};
+
+/**
+ * A single draw in a RenderQueue. The key encodes the state the draw needs,
+ * most significant first, so that sorting by key groups draws that share a
+ * program and textures and orders each group front to back:
+ *
+ *   bits 63-60  pass
+ *   bits 59-44  program
+ *   bits 43-24  material (texture set)
+ *   bits 23-0   depth bucket
+ */
+struct RenderItem {
+  uint64_t key;
+  SceneObject *object;
+};
+
+/**
+ * Per-frame list of draws. Objects append their draws with push(), the
+ * scene sorts the queue and then executes it in order.
+ */
+class RenderQueue {
+ public:
+  static const int DEPTH_BITS = 24;
+  static const int MATERIAL_BITS = 20;
+  static const int PROGRAM_BITS = 16;
+  static const int PASS_BITS = 4;
+
+  static uint64_t make_key(RenderPass pass, uint32_t program,
+                           uint32_t material, uint32_t depth);
+
+  /**
+   * Maps distance d in [0, range] to a depth bucket. Nearer is smaller.
+   */
+  static uint32_t depth_bucket(double d, double range);
+
+  void clear() { items.clear(); }
+  void push(uint64_t key, SceneObject *object);
+
+  /**
+   * Sorts the items by key. This is a stable LSD radix sort on bytes that
+   * skips the bytes in which all keys agree, which are most of them.
+   */
+  void sort();
+
+  /**
+   * Number of program and material changes needed to execute the queue
+   * in its current order (the first draw counts as a change of both).
+   */
+  int count_state_changes() const;
+
+  size_t size() const { return items.size(); }
+  const RenderItem &operator[](size_t i) const { return items[i]; }
+
+ private:
+  std::vector<RenderItem> items;
+  std::vector<RenderItem> scratch;  // second buffer for sort()
+};
+
+}  // namespace DynamicScene
+}  // namespace CS248
+
+#endif  // CS248_DYNAMICSCENE_RENDER_QUEUE_H
@@ -1,6 +1,8 @@
 #include "scene.h"
 #include "mesh.h"
+#include "CS248/glstate.h"
 #include <fstream>
+#include <cstring>
 
 using namespace std;
 using std::cout;
@@ -9,6 +11,11 @@ using std::endl;
 namespace CS248 {
 namespace DynamicScene {
 
+// n rounded up to a multiple of alignment
+static size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
 Scene::Scene(std::vector<SceneObject *> _objects,
              std::vector<SceneLight *> _lights,
              const std::string& base_shader_dir) {
@@ -43,6 +50,91 @@ Scene::Scene(std::vector<SceneObject *> _objects,
         sphere_lights.push_back((StaticScene::SphereLight *)light);
     }
   }
+  bbox_dirty = true;
+
+  // one shadow map per spot light, as many as the memory budget allows
+  shadow_texture_size = 1024;
+  size_t shadow_map_bytes = (size_t)shadow_texture_size * shadow_texture_size * 2;
+  num_shadowed_lights = std::min((int)spot_lights.size(), (int)(SCENE_SHADOW_MEMORY_BUDGET / shadow_map_bytes));
+  if (num_shadowed_lights < (int)spot_lights.size()) {
+    printf("Note: only the first %d of %d spot lights cast shadows\n",
+           num_shadowed_lights, (int)spot_lights.size());
+  }
+
+  // cascaded shadow map for the first directional light, after them
+  num_cascades = 0;
+  if (!directional_lights.empty()) {
+    if ((num_shadowed_lights + UNIFORM_NUM_CASCADES) * shadow_map_bytes <= SCENE_SHADOW_MEMORY_BUDGET)
+      num_cascades = UNIFORM_NUM_CASCADES;
+    else
+      printf("Note: no shadow map memory left for the directional light\n");
+  }
+
+  int num_shadow_maps = num_shadowed_lights + num_cascades;
+  world_to_shadowlight.resize(num_shadow_maps);
+  shadow_light_views.resize(num_shadow_maps);
+  for (int i = 0; i < num_shadow_maps; i++) {
+    shadow_light_views[i].valid = false;
+    shadow_light_views[i].map_valid = false;
+  }
+
+  // uniform buffers shared by all programs, with room for every object
+  // to be drawn in every pass of a frame -- the shadow maps, the depth
+  // prepass and the color pass (they grow if needed). Instanced objects
+  // (spheres) take no per-draw data, only an instance each.
+  size_t instanced = 0;
+  for (SceneObject *o : objects) {
+    InstanceData instance;
+    if (o->get_instance(instance))
+      instanced++;
+  }
+  size_t draws = std::max(objects.size() - instanced, (size_t)64) * (num_shadow_maps + 2);
+
+  glGenBuffers(1, &frame_uniform_buffer);
+  GLState::bind_buffer(GL_UNIFORM_BUFFER, frame_uniform_buffer);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+
+  GLint alignment = 1;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  object_uniform_stream = new StreamBuffer(GL_UNIFORM_BUFFER,
+      draws * align_up(sizeof(ObjectUniforms), alignment), alignment);
+
+  // buffers for batched drawing
+  use_multi_draw = GeometryArena::supported();
+  arena_dirty = true;
+  unbatched_objects = 0;
+  if (use_multi_draw) {
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    object_buffer_stream = new StreamBuffer(GL_SHADER_STORAGE_BUFFER,
+        draws * sizeof(ObjectUniforms), alignment);
+    draw_command_stream = new StreamBuffer(GL_DRAW_INDIRECT_BUFFER,
+        draws * sizeof(DrawElementsIndirectCommand), 4);
+  } else {
+    object_buffer_stream = NULL;
+    draw_command_stream = NULL;
+  }
+
+  // instanced drawing: the quad's corners per vertex, InstanceData per
+  // instance from wherever the stream put a draw's instances. The stream
+  // starts out with room for one pass, it grows to what a frame takes.
+  instance_stream = new StreamBuffer(GL_ARRAY_BUFFER,
+      std::max(instanced, (size_t)64) * sizeof(InstanceData), 16);
+  static const float quad_corners[] = { -1, -1, 0,  1, -1, 0,  -1, 1, 0,  1, 1, 0 };
+  glGenBuffers(1, &quad_corner_buffer);
+  GLState::bind_buffer(GL_ARRAY_BUFFER, quad_corner_buffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad_corners), quad_corners, GL_STATIC_DRAW);
+  glGenVertexArrays(1, &instance_vertex_array);
+  GLState::bind_vertex_array(instance_vertex_array);
+  glVertexAttribPointer(VTX_POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  GLState::enable_vertex_attrib_array(VTX_POSITION_LOCATION);
+  GLState::enable_vertex_attrib_array(VTX_INSTANCE_SPHERE_LOCATION);
+  GLState::enable_vertex_attrib_array(VTX_INSTANCE_MATERIAL_LOCATION);
+  glVertexAttribDivisor(VTX_INSTANCE_SPHERE_LOCATION, 1);
+  glVertexAttribDivisor(VTX_INSTANCE_MATERIAL_LOCATION, 1);
+  GLState::bind_vertex_array(0);
+
+  reset_render_stats();
+
   current_pattern_id = 0;
   current_pattern_subid = 0;
   scaling_factor = .05f;
@@ -52,86 +144,256 @@ Scene::Scene(std::vector<SceneObject *> _objects,
   checkGLError("pre shadow fb setup");
   
   do_shadow_pass = false;
-
-  if (get_num_shadowed_lights() > 0) {
+  shadow_shader = shadow_shader2 = shadow_viz_shader = NULL;
+  layered_shadow_shader = NULL;
+  layered_shadow_pass = false;
+  shadow_filter = SHADOW_FILTER_PCF;
+  shadow_moments_texture = 0;
+  shadow_blur_texture = 0;
+  shadow_blur_framebuffer = 0;
+  shadow_blur_shader[0] = shadow_blur_shader[1] = NULL;
+
+  // the shadow pass program also draws the camera's depth prepass, every
+  // scene gets it
+  string sepchar("/");
+  string shadow_prefix = use_multi_draw ? GeometryArena::shader_prefix() : "";
+  shadow_shader = new Shader(base_shader_dir + sepchar + "shadow_pass.vert",
+                             base_shader_dir + sepchar + "shadow_pass.frag", shadow_prefix, "");
+  checkGLError("post shadow shader compile");
+
+  if (num_shadow_maps > 0) {
 
     do_shadow_pass = true;
-    shadow_texture_size = 1024;
     
-    for (int i=0; i<get_num_shadowed_lights(); i++) {
-
-      glGenFramebuffers(1, &shadow_framebuffer[i]);
-      glBindFramebuffer(GL_FRAMEBUFFER, shadow_framebuffer[i]);
-
-      glGenTextures(1, &shadow_texture[i]);
-      glBindTexture(GL_TEXTURE_2D, shadow_texture[i]);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, shadow_texture_size, shadow_texture_size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-      glGenTextures(1, &shadow_color_texture[i]);
-      glBindTexture(GL_TEXTURE_2D, shadow_color_texture[i]);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, shadow_texture_size, shadow_texture_size, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, shadow_color_texture[i], 0);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture[i], 0);
-      //glDrawBuffer(GL_NONE); // No color buffer is drawn to
-      glReadBuffer(GL_NONE); // No color is read from   
+    // all shadow maps are layers of one depth texture, rendered through a
+    // single frame buffer object by attaching one layer at a time
+    glGenTextures(1, &shadow_texture);
+    GLState::bind_texture(0, GL_TEXTURE_2D_ARRAY, shadow_texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT16, shadow_texture_size, shadow_texture_size,
+                 num_shadow_maps, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // lookups compare against the stored depth, and linear filtering
+    // blends the results of the four nearest texels
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    // passes that need the depths themselves bind this sampler instead
+    glGenSamplers(1, &shadow_depth_sampler);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+    glGenFramebuffers(1, &shadow_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow_framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0, 0);
+    glDrawBuffer(GL_NONE); // No color buffer is drawn to
+    glReadBuffer(GL_NONE); // No color is read from   
       
-      if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-          printf("Error: Frame buffer %d is not complete\n", i);
-          GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-          switch (status) {
-          case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:
-              fprintf(stderr, "Incomplete draw buffer\n");
-              break;
-          case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:
-              fprintf(stderr, "Incomplete read buffer\n");
-              break;
-          default:
-              fprintf(stderr, "Unknown reason why fb is complete.\n");
-          }
-      }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Error: Shadow frame buffer is not complete\n");
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        switch (status) {
+        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:
+            fprintf(stderr, "Incomplete draw buffer\n");
+            break;
+        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:
+            fprintf(stderr, "Incomplete read buffer\n");
+            break;
+        default:
+            fprintf(stderr, "Unknown reason why fb is complete.\n");
+        }
     }
 
     checkGLError("post shadow framebuffer setup");
+
+    // the transform and scale of every layer, filled in each frame by
+    // update_frame_uniforms()
+    glGenBuffers(1, &shadow_map_transform_buffer);
+    GLState::bind_buffer(GL_TEXTURE_BUFFER, shadow_map_transform_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, num_shadow_maps * SHADOW_MAP_TEXELS * 4 * sizeof(float),
+                 NULL, GL_DYNAMIC_DRAW);
+    glGenTextures(1, &shadow_map_transform_texture);
+    GLState::bind_texture(0, GL_TEXTURE_BUFFER, shadow_map_transform_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, shadow_map_transform_buffer);
     
     // restore the screen as the render target
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    // create shader object for shadow passes
-    string sepchar("/");
-    shadow_shader = new Shader(base_shader_dir + sepchar + "shadow_pass.vert",
-                               base_shader_dir + sepchar + "shadow_pass.frag", "", "");
-    checkGLError("post shadow shader compile");
+    // create shader objects for shadow passes
     shadow_shader2 = new Shader(base_shader_dir + sepchar + "shadow_pass_debug.vert",
                                 base_shader_dir + sepchar + "shadow_pass.frag", "", "");
     checkGLError("post shadow shader2 compile");
+
+    // the layered pass gets its draws from the arena. Vertex shaders that
+    // can set gl_Layer skip the geometry shader.
+    if (use_multi_draw && num_shadow_maps > 1) {
+      string layered_prefix = shadow_prefix + "#define LAYERED 1\n";
+      string geometry_shader;
+      if (GLEW_ARB_shader_viewport_layer_array) {
+        layered_prefix += "#extension GL_ARB_shader_viewport_layer_array : require\n"
+                          "#define VERTEX_LAYER 1\n";
+      } else if (GLEW_AMD_vertex_shader_layer) {
+        layered_prefix += "#extension GL_AMD_vertex_shader_layer : require\n"
+                          "#define VERTEX_LAYER 1\n";
+      } else {
+        geometry_shader = base_shader_dir + sepchar + "shadow_pass.geom";
+      }
+      layered_shadow_shader = new Shader(base_shader_dir + sepchar + "shadow_pass.vert",
+                                         base_shader_dir + sepchar + "shadow_pass.frag",
+                                         layered_prefix, "", geometry_shader);
+      checkGLError("post layered shadow shader compile");
+    }
     shadow_viz_shader = new Shader(base_shader_dir + sepchar + "shadow_viz.vert",
                                    base_shader_dir + sepchar + "shadow_viz.frag", "", "");
     checkGLError("post shadow viz shader compile");
+    shadow_blur_shader[0] = new Shader(base_shader_dir + sepchar + "shadow_viz.vert",
+                                       base_shader_dir + sepchar + "shadow_blur.frag",
+                                       "", "#define FROM_DEPTH 1\n");
+    shadow_blur_shader[1] = new Shader(base_shader_dir + sepchar + "shadow_viz.vert",
+                                       base_shader_dir + sepchar + "shadow_blur.frag", "", "");
+    checkGLError("post shadow blur shader compile");
+  }
+
+  // the G-buffer programs of the meshes are built once deferred shading
+  // is first used, the lighting pass is small enough to build now
+  render_mode = RENDER_MODE_FORWARD;
+  gbuffer = NULL;
+  gbuffer_fragment_shader = base_shader_dir + "/gbuffer.frag";
+  deferred_lighting_shader = new Shader(base_shader_dir + "/shadow_viz.vert",
+                                        base_shader_dir + "/deferred_lighting.frag", "", "");
+
+  // impostor quads are lit by the same code, reading an atlas instead
+  use_impostors = true;
+  baking_impostors = false;
+  impostor_shader = new Shader(base_shader_dir + "/impostor.vert",
+                               base_shader_dir + "/deferred_lighting.frag", "", "#define IMPOSTOR 1\n");
+
+  // and so are ray-cast spheres, whose shadow pass program only writes
+  // depth
+  sphere_shader = new Shader(base_shader_dir + "/sphere.vert",
+                             base_shader_dir + "/deferred_lighting.frag", "", "#define SPHERE 1\n");
+  sphere_depth_shader = new Shader(base_shader_dir + "/sphere.vert",
+                                   base_shader_dir + "/deferred_lighting.frag", "",
+                                   "#define SPHERE 1\n#define SPHERE_DEPTH 1\n");
+
+  depth_prepass_mode = DEPTH_PREPASS_AUTO;
+  overdraw_stats.fragments_without_prepass = -1;
+  overdraw_stats.fragments_with_prepass = -1;
+  overdraw_stats.prepass = false;
+  glGenQueries(FRAGMENT_QUERIES, fragment_queries);
+  fragment_query_frame = 0;
+
+  // the programs of all meshes are submitted too before the first status
+  // query, so that the driver can build them all in parallel
+  fallback_fragment_shader = base_shader_dir + "/fallback.frag";
+  for (SceneObject *o : objects)
+    o->prepare_shaders();
+
+  Shader *pass_shaders[] = { shadow_shader, shadow_shader2, layered_shadow_shader,
+                             shadow_viz_shader, shadow_blur_shader[0], shadow_blur_shader[1],
+                             deferred_lighting_shader, impostor_shader,
+                             sphere_shader, sphere_depth_shader };
+  for (Shader *shader : pass_shaders)
+    if (shader)
+      shader->finish();
+
+  // G-buffer (or impostor atlas) on units 0-2, then the units the mesh
+  // programs use
+  Shader *lighting_shaders[] = { deferred_lighting_shader, impostor_shader, sphere_shader };
+  for (Shader *shader : lighting_shaders) {
+    if (!shader->finish())
+      continue;
+    const ShaderLocations &loc = shader->_locations;
+    GLState::use_program(shader->_programID);
+    GLint units[] = { loc.gbufferAlbedo, 0, loc.gbufferNormal, 1, loc.gbufferDepth, 2,
+                      loc.shadowTextureArray, 3, loc.shadowMomentsArray, 4,
+                      loc.clusterLights, 5, loc.clusterGrid, 6, loc.clusterLightIndices, 7,
+                      loc.shadowMapTransforms, 8 };
+    for (int i = 0; i < 18; i += 2)
+      if (units[i] >= 0)
+        glUniform1i(units[i], units[i + 1]);
   }
 
   checkGLError("returning from Application::init");  
 }
 
 
-Scene::~Scene() { }
+Scene::~Scene() {
+  GLState::delete_buffers(1, &frame_uniform_buffer);
+  delete object_uniform_stream;
+  delete object_buffer_stream;
+  delete draw_command_stream;
+  delete instance_stream;
+  GLState::delete_buffers(1, &quad_corner_buffer);
+  GLState::bind_vertex_array(0);
+  glDeleteVertexArrays(1, &instance_vertex_array);
+
+  if (do_shadow_pass) {
+    glDeleteFramebuffers(1, &shadow_framebuffer);
+    GLState::delete_textures(1, &shadow_texture);
+    glDeleteSamplers(1, &shadow_depth_sampler);
+    GLState::delete_textures(1, &shadow_map_transform_texture);
+    GLState::delete_buffers(1, &shadow_map_transform_buffer);
+  }
+
+  for (auto &permutation : shader_permutations)
+    delete permutation.second.shader;
+  for (auto &fallback : fallback_shaders)
+    delete fallback.second;
+  delete deferred_lighting_shader;
+  delete gbuffer;
+  delete impostor_shader;
+  delete sphere_shader;
+  delete sphere_depth_shader;
+  for (auto &atlas : impostor_atlases)
+    delete atlas.second;
+  glDeleteQueries(FRAGMENT_QUERIES, fragment_queries);
+
+  if (shadow_moments_texture) {
+    glDeleteFramebuffers(1, &shadow_blur_framebuffer);
+    GLState::delete_textures(1, &shadow_moments_texture);
+    GLState::delete_textures(1, &shadow_blur_texture);
+  }
+}
 
 BBox Scene::get_bbox() {
-  BBox bbox;
-  for (SceneObject *obj : objects) {
-    bbox.expand(obj->get_bbox());
+  if (bbox_dirty) {
+    bbox = BBox();
+    for (SceneObject *obj : objects) {
+      bbox.expand(obj->get_bbox());
+    }
+    bbox_dirty = false;
   }
   return bbox;
 }
 
+// true if b reaches the boundary of (or sticks out of) the enclosing box,
+// in which case removing b could shrink the enclosing box
+static bool touches_boundary(const BBox &b, const BBox &enclosing) {
+  if (b.empty()) return false;
+  return b.min.x <= enclosing.min.x || b.min.y <= enclosing.min.y ||
+         b.min.z <= enclosing.min.z || b.max.x >= enclosing.max.x ||
+         b.max.y >= enclosing.max.y || b.max.z >= enclosing.max.z;
+}
+
+void Scene::object_bbox_changed(SceneObject *o, const BBox &old_bbox) {
+  invalidate_shadows(old_bbox);
+  invalidate_shadows(o->get_bbox());
+
+  if (bbox_dirty) return;
+
+  if (touches_boundary(old_bbox, bbox))
+    bbox_dirty = true;
+  else
+    bbox.expand(o->get_bbox());
+}
+
 bool Scene::addObject(SceneObject *o) {
   auto i = objects.find(o);
   if (i != objects.end()) {
@@ -140,6 +402,12 @@ bool Scene::addObject(SceneObject *o) {
 
   o->scene = this;
   objects.insert(o);
+  o->prepare_shaders();
+  arena_dirty = true;
+  invalidate_shadows(o->get_bbox());
+
+  if (!bbox_dirty)
+    bbox.expand(o->get_bbox());
   return true;
 }
 
@@ -150,30 +418,729 @@ bool Scene::removeObject(SceneObject *o) {
   }
 
   objects.erase(o);
+  arena_dirty = true;
+
+  // atlases o was going to draw are requested again by the next object
+  // that needs them
+  for (auto it = impostor_atlases.begin(); it != impostor_atlases.end();) {
+    if (it->second->source == o) {
+      delete it->second;
+      it = impostor_atlases.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  invalidate_shadows(o->get_bbox());
+
+  if (!bbox_dirty && touches_boundary(o->get_bbox(), bbox))
+    bbox_dirty = true;
   return true;
 }
 
-void Scene::render_in_opengl() {
-    for (SceneObject *obj : objects)
-      if (obj->isVisible)
+static void copy_to_gl(const Vector3D &v, float *out) {
+  out[0] = v.x;
+  out[1] = v.y;
+  out[2] = v.z;
+}
+
+void Scene::update_frame_uniforms() {
+  FrameUniforms u;
+  memset(&u, 0, sizeof(u));
+
+  // every layer's transform and scale goes to shadowMapTransforms on unit
+  // 8, there are as many as the memory budget allows
+  if (do_shadow_pass) {
+    int num_shadow_maps = world_to_shadowlight.size();
+    std::vector<float> texels(num_shadow_maps * SHADOW_MAP_TEXELS * 4, 0.f);
+    for (int i = 0; i < num_shadow_maps; i++) {
+      float *t = &texels[i * SHADOW_MAP_TEXELS * 4];
+      Mat4f(world_to_shadowlight[i]).store(t);
+      t[16] = shadow_light_views[i].size / (float)shadow_texture_size;
+    }
+    GLState::bind_buffer(GL_TEXTURE_BUFFER, shadow_map_transform_buffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, texels.size() * sizeof(float), texels.data());
+    GLState::bind_texture(8, GL_TEXTURE_BUFFER, shadow_map_transform_texture);
+  }
+  u.num_shadowed_lights = num_shadowed_lights;
+
+  for (int c = 0; c < num_cascades; c++) {
+    Mat4f(world_to_shadowlight[num_shadowed_lights + c]).store(u.world2cascade[c]);
+    u.cascade_ends[c] = cascade_ends[c];
+  }
+  u.num_cascades = num_cascades;
+  u.first_cascade_layer = num_shadowed_lights;
+  u.shadow_filter = shadow_filter;
+  u.spot_shadow_near = SPOT_SHADOW_NEAR;
+  u.spot_shadow_far = SPOT_SHADOW_FAR;
+
+  copy_to_gl(camera->position(), u.camera_position);
+  copy_to_gl((camera->view_point() - camera->position()).unit(), u.camera_direction);
+
+  u.num_directional_lights = directional_lights.size();
+  u.num_point_lights = point_lights.size();
+  u.num_spot_lights = spot_lights.size();
+
+  for (int j = 0; j < std::min((int)directional_lights.size(), UNIFORM_MAX_LIGHTS); j++)
+    copy_to_gl(directional_lights[j]->lightDir, u.directional_light_vectors[j]);
+
+  // point and spot lights are in the clusters, gl_FragCoord and view
+  // depth pick the cluster
+  u.cluster_count[0] = CLUSTER_GRID_X;
+  u.cluster_count[1] = CLUSTER_GRID_Y;
+  u.cluster_count[2] = CLUSTER_GRID_Z;
+  u.cluster_scale[0] = CLUSTER_GRID_X / (float)camera->screen_width();
+  u.cluster_scale[1] = CLUSTER_GRID_Y / (float)camera->screen_height();
+  u.cluster_scale[2] = light_clusters.depth_scale();
+  u.cluster_scale[3] = light_clusters.depth_bias();
+
+  GLState::bind_buffer(GL_UNIFORM_BUFFER, frame_uniform_buffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(u), &u);
+  GLState::bind_buffer_base(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, frame_uniform_buffer);
+}
+
+void Scene::update_light_clusters() {
+  light_clusters.clear();
+
+  // point lights first, then spot lights: the order they're shaded in
+  LightClusters::LightRecord record;
+  for (StaticScene::PointLight *light : point_lights) {
+    memset(&record, 0, sizeof(record));
+    copy_to_gl(light->position, record.texels[0]);
+    record.texels[0][3] = 0;  // LIGHT_POINT
+
+    // unit magnitude, falls off with 1 / (0.01 + d^2)
+    light_clusters.add(record, light->position, sqrt(2. / LIGHT_CUTOFF));
+  }
+
+  for (int j = 0; j < (int)spot_lights.size(); j++) {
+    StaticScene::SpotLight *light = spot_lights[j];
+    memset(&record, 0, sizeof(record));
+    copy_to_gl(light->position, record.texels[0]);
+    record.texels[0][3] = 1;  // LIGHT_SPOT
+    copy_to_gl(light->direction, record.texels[1]);
+    record.texels[1][3] = light->angle;
+    record.texels[2][0] = light->radiance.r;
+    record.texels[2][1] = light->radiance.g;
+    record.texels[2][2] = light->radiance.b;
+    record.texels[2][3] = j < num_shadowed_lights ? j : -1;
+
+    // falls off with 1 / (1 + d^2), and is dark beyond 1.1 times the cone
+    // angle (see shader_shadow.frag). The sphere bounds that cone up to
+    // the cutoff distance.
+    double max_radiance = std::max(light->radiance.r, std::max(light->radiance.g, light->radiance.b));
+    double range = sqrt(2. * max_radiance / LIGHT_CUTOFF);
+    double theta = radians(1.1 * light->angle);
+    Vector3D axis = light->direction.unit();
+    if (theta >= PI / 2) {
+      light_clusters.add(record, light->position, range);
+    } else if (theta >= PI / 4) {
+      light_clusters.add(record, light->position + cos(theta) * range * axis, sin(theta) * range);
+    } else {
+      double radius = range / (2. * cos(theta));
+      light_clusters.add(record, light->position + radius * axis, radius);
+    }
+  }
+
+  light_clusters.update(camera->view_matrix(), camera->projection_matrix(),
+                        camera->near_clip(), camera->far_clip());
+
+  // the units the mesh programs' cluster samplers are set to
+  light_clusters.bind(5);
+}
+
+void Scene::begin_frame() {
+  reset_render_stats();
+
+  object_uniform_stream->begin_frame();
+  instance_stream->begin_frame();
+  if (use_multi_draw) {
+    object_buffer_stream->begin_frame();
+    draw_command_stream->begin_frame();
+  }
+}
+
+StreamBuffer::Stats Scene::get_stream_stats() const {
+  StreamBuffer::Stats total = object_uniform_stream->stats();
+  total.bytes += instance_stream->stats().bytes;
+  total.wait_ms += instance_stream->stats().wait_ms;
+  if (use_multi_draw) {
+    const StreamBuffer *streams[2] = { object_buffer_stream, draw_command_stream };
+    for (int i = 0; i < 2; i++) {
+      total.bytes += streams[i]->stats().bytes;
+      total.wait_ms += streams[i]->stats().wait_ms;
+    }
+  }
+  return total;
+}
+
+void Scene::bind_object_uniforms(const ObjectUniforms &u) {
+  size_t offset = object_uniform_stream->write(&u, sizeof(u));
+  GLState::bind_buffer_range(GL_UNIFORM_BUFFER, OBJECT_UNIFORMS_BINDING,
+                             object_uniform_stream->buffer(), offset, sizeof(u));
+}
+
+void Scene::bind_pass_uniforms(const Mat4f &view_projection, const Vector4D &eye) {
+  PassUniforms u;
+  view_projection.store(u.view_projection);
+  u.eye[0] = eye.x;
+  u.eye[1] = eye.y;
+  u.eye[2] = eye.z;
+  u.eye[3] = eye.w;
+
+  size_t offset = object_uniform_stream->write(&u, sizeof(u));
+  GLState::bind_buffer_range(GL_UNIFORM_BUFFER, PASS_UNIFORMS_BINDING,
+                             object_uniform_stream->buffer(), offset, sizeof(u));
+}
+
+Scene::ShaderPermutation *Scene::get_shader_permutation(const std::string &vertex_shader_filename,
+                                                        const std::string &fragment_shader_filename,
+                                                        const std::string &prefix, uint32_t features,
+                                                        const std::vector<std::string> &uniform_names,
+                                                        const std::vector<float> &uniform_values) {
+
+  // the directional lights can't change after the scene is built, so their
+  // count is the same for every permutation
+  char defines[512];
+  snprintf(defines, sizeof(defines),
+           "#define PERMUTATION 1\n"
+           "#define TEXTURE_MAPPING %s\n"
+           "#define NORMAL_MAPPING %s\n"
+           "#define ENVIRONMENT_MAPPING %s\n"
+           "#define MIRROR_BRDF %s\n"
+           "#define SHADOW_RECEIVER %s\n"
+           "#define NUM_DIRECTIONAL_LIGHTS %d\n",
+           features & SHADER_FEATURE_TEXTURE_MAPPING ? "true" : "false",
+           features & SHADER_FEATURE_NORMAL_MAPPING ? "true" : "false",
+           features & SHADER_FEATURE_ENVIRONMENT_MAPPING ? "true" : "false",
+           features & SHADER_FEATURE_MIRROR_BRDF ? "true" : "false",
+           features & SHADER_FEATURE_SHADOW_RECEIVER ? "true" : "false",
+           std::min((int)directional_lights.size(), UNIFORM_MAX_LIGHTS));
+  std::string full_prefix = prefix + defines;
+
+  // named uniforms are set on the program, so only meshes that agree on
+  // them can share it
+  std::string key = vertex_shader_filename + "\n" + fragment_shader_filename + "\n" + full_prefix;
+  for (size_t j = 0; j < uniform_names.size(); j++) {
+    char value[32];
+    snprintf(value, sizeof(value), "=%.9g\n", uniform_values[j]);
+    key += uniform_names[j] + value;
+  }
+
+  auto it = shader_permutations.find(key);
+  if (it != shader_permutations.end())
+    return &it->second;
+
+  // the fallback is shared by all permutations of the vertex shader
+  std::string fallback_key = vertex_shader_filename + "\n" + prefix;
+  Shader *&fallback = fallback_shaders[fallback_key];
+  if (!fallback)
+    fallback = new Shader(vertex_shader_filename, fallback_fragment_shader, prefix, prefix);
+
+  ShaderPermutation &permutation = shader_permutations[key];
+  permutation.shader = new Shader(vertex_shader_filename, fragment_shader_filename,
+                                  full_prefix, full_prefix);
+  permutation.fallback = fallback;
+  permutation.uniform_names = uniform_names;
+  permutation.uniform_values = uniform_values;
+  permutation.configured = false;
+  return &permutation;
+}
+
+Shader *Scene::get_ready_shader(ShaderPermutation *permutation) {
+  Shader *shader = permutation->shader;
+  if (permutation->configured)
+    return shader;
+
+  if (!shader->isReady()) {
+    // the fallback is small, it's fine to wait for it. It stays in use if
+    // the program failed to build (see isFailed()).
+    return permutation->fallback->finish() ? permutation->fallback : NULL;
+  }
+
+  // the named uniforms and the texture unit assignments never change, so
+  // they're set once here rather than on every draw
+  const ShaderLocations &loc = shader->_locations;
+  GLState::use_program(shader->_programID);
+
+  for (size_t j = 0; j < permutation->uniform_names.size(); j++) {
+    GLint location = glGetUniformLocation(shader->_programID, permutation->uniform_names[j].c_str());
+    if (location >= 0)
+      glUniform1f(location, permutation->uniform_values[j]);
+  }
+
+  if (loc.diffuseTextureSampler >= 0)
+    glUniform1i(loc.diffuseTextureSampler, 0);
+  if (loc.normalTextureSampler >= 0)
+    glUniform1i(loc.normalTextureSampler, 1);
+  if (loc.environmentTextureSampler >= 0)
+    glUniform1i(loc.environmentTextureSampler, 2);
+  if (loc.shadowTextureArray >= 0)
+    glUniform1i(loc.shadowTextureArray, 3);
+  if (loc.shadowMomentsArray >= 0)
+    glUniform1i(loc.shadowMomentsArray, 4);
+  if (loc.clusterLights >= 0)
+    glUniform1i(loc.clusterLights, 5);
+  if (loc.clusterGrid >= 0)
+    glUniform1i(loc.clusterGrid, 6);
+  if (loc.clusterLightIndices >= 0)
+    glUniform1i(loc.clusterLightIndices, 7);
+  if (loc.shadowMapTransforms >= 0)
+    glUniform1i(loc.shadowMapTransforms, 8);
+
+  permutation->configured = true;
+  return shader;
+}
+
+Scene::ShaderPermutation *Scene::get_gbuffer_shader_permutation(const std::string &vertex_shader_filename,
+                                                                const std::string &prefix,
+                                                                uint32_t features) {
+  // gbuffer.frag has no named uniforms, so every mesh with the same
+  // vertex shader and features shares the program
+  return get_shader_permutation(vertex_shader_filename, gbuffer_fragment_shader, prefix, features,
+                                std::vector<std::string>(), std::vector<float>());
+}
+
+int Scene::get_num_pending_shader_permutations() const {
+  int pending = 0;
+  for (auto &permutation : shader_permutations)
+    if (!permutation.second.configured && !permutation.second.shader->isFailed())
+      pending++;
+  return pending;
+}
+
+int Scene::get_num_failed_shader_permutations() const {
+  int failed = 0;
+  for (auto &permutation : shader_permutations)
+    if (permutation.second.shader->isFailed())
+      failed++;
+  return failed;
+}
+
+uint32_t Scene::get_material_id(const std::vector<GLuint> &textures) {
+  auto it = material_ids.find(textures);
+  if (it != material_ids.end())
+    return it->second;
+
+  uint32_t id = material_ids.size();
+  material_ids[textures] = id;
+  return id;
+}
+
+void Scene::reset_render_stats() {
+  render_stats.draws = 0;
+  render_stats.submits = 0;
+  render_stats.culled = 0;
+  render_stats.shadow_maps = 0;
+  render_stats.impostors = 0;
+  render_stats.impostors_baked = 0;
+  render_stats.state_changes_unsorted = 0;
+  render_stats.state_changes_sorted = 0;
+}
+
+void Scene::update_arena() {
+  if (!use_multi_draw || !arena_dirty)
+    return;
+
+  arena.clear();
+  unbatched_objects = 0;
+  for (SceneObject *obj : objects) {
+    size_t n = arena.vertex_count();
+    obj->add_to_arena(arena);
+    if (arena.vertex_count() == n)
+      unbatched_objects++;
+  }
+  arena.upload();
+  arena_dirty = false;
+}
+
+void Scene::draw_queue(RenderPass pass, const Vector3D &eye, const Frustum &frustum) {
+  draw_queue(pass, eye, &frustum, 1);
+}
+
+void Scene::draw_queue(RenderPass pass, const Vector3D &eye, const Frustum *frusta,
+                       int num_frusta) {
+
+  update_arena();
+
+  // depth buckets span the distance from eye to the far side of the scene
+  BBox scene_bbox = get_bbox();
+  double range = (scene_bbox.centroid() - eye).norm() + scene_bbox.extent.norm() / 2;
+
+  render_queue.clear();
+  for (SceneObject *obj : objects) {
+    if (!obj->isVisible)
+      continue;
+    BBox b = obj->get_bbox();
+    int k = 0;
+    while (k < num_frusta && !frusta[k].intersects(b))
+      k++;
+    if (k == num_frusta) {
+      render_stats.culled++;
+      continue;
+    }
+    double d = (b.centroid() - eye).norm();
+    obj->enqueue(render_queue, pass, RenderQueue::depth_bucket(d, range));
+  }
+
+  execute_queue(pass, num_frusta);
+}
+
+void Scene::execute_queue(RenderPass pass, int num_frusta) {
+  render_stats.draws += render_queue.size();
+  render_stats.state_changes_unsorted += render_queue.count_state_changes();
+  render_queue.sort();
+  render_stats.state_changes_sorted += render_queue.count_state_changes();
+
+  size_t i = 0;
+  while (i < render_queue.size()) {
+    SceneObject *obj = render_queue[i].object;
+    ArenaRange range;
+    ObjectUniforms u;
+    InstanceData instance;
+
+    if (obj->get_instance(instance)) {
+      // one instanced draw for it and the following instances that need
+      // the same state
+      uint64_t state = render_queue[i].key >> RenderQueue::DEPTH_BITS;
+      size_t max_count = render_queue.size() - i;
+      size_t offset;
+      InstanceData *instances = (InstanceData *)
+          instance_stream->map(max_count * sizeof(InstanceData), offset);
+
+      size_t count = 0;
+      instances[0] = instance;
+      do {
+        count++;
+        i++;
+      } while (i < render_queue.size() &&
+               (render_queue[i].key >> RenderQueue::DEPTH_BITS) == state &&
+               render_queue[i].object->get_instance(instances[count]));
+
+      instance_stream->unmap(count * sizeof(InstanceData));
+      draw_instances(pass, obj, count, offset);
+      continue;
+    }
+
+    if (!use_multi_draw || !obj->get_arena_draw(range, u)) {
+      // the object draws itself, from its own buffers
+      GLState::bind_vertex_array(0);
+      if (pass == RENDER_PASS_SHADOW || pass == RENDER_PASS_DEPTH)
+        obj->draw_shadow();
+      else if (pass == RENDER_PASS_GBUFFER)
+        obj->draw_gbuffer();
+      else
         obj->draw();
+      render_stats.submits++;
+      i++;
+      continue;
+    }
+
+    // batch it with the following draws that need the same state, their
+    // data goes straight into the streams (the rest of the queue is the
+    // most the batch can take)
+    uint64_t state = render_queue[i].key >> RenderQueue::DEPTH_BITS;
+    size_t max_count = render_queue.size() - i;
+    size_t uniforms_offset, commands_offset;
+    ObjectUniforms *uniforms = (ObjectUniforms *)
+        object_buffer_stream->map(max_count * sizeof(ObjectUniforms), uniforms_offset);
+    DrawElementsIndirectCommand *commands = (DrawElementsIndirectCommand *)
+        draw_command_stream->map(max_count * sizeof(DrawElementsIndirectCommand), commands_offset);
+
+    size_t count = 0;
+    uniforms[0] = u;
+    do {
+      DrawElementsIndirectCommand cmd = { range.index_count, (GLuint)num_frusta, range.first_index,
+                                          range.base_vertex, 0 };
+      commands[count++] = cmd;
+      i++;
+    } while (i < render_queue.size() &&
+             (render_queue[i].key >> RenderQueue::DEPTH_BITS) == state &&
+             render_queue[i].object->get_arena_draw(range, uniforms[count]));
+
+    object_buffer_stream->unmap(count * sizeof(ObjectUniforms));
+    draw_command_stream->unmap(count * sizeof(DrawElementsIndirectCommand));
+
+    draw_batch(pass, obj, count, uniforms_offset, commands_offset);
+  }
+
+  // code drawing after the scene expects the default vertex array
+  GLState::bind_vertex_array(0);
 }
 
-void Scene::visualize_shadow_map() {
+void Scene::draw_batch(RenderPass pass, SceneObject *first, size_t count,
+                       size_t uniforms_offset, size_t commands_offset) {
+  first->bind_batch_state(pass);
+  if (pass == RENDER_PASS_SHADOW || pass == RENDER_PASS_DEPTH)
+    arena.bind_positions();
+  else
+    arena.bind();
+  GLState::bind_buffer_range(GL_SHADER_STORAGE_BUFFER, OBJECT_BUFFER_BINDING,
+                             object_buffer_stream->buffer(), uniforms_offset,
+                             count * sizeof(ObjectUniforms));
+  GLState::bind_buffer(GL_DRAW_INDIRECT_BUFFER, draw_command_stream->buffer());
+
+  glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void *)commands_offset,
+                              count, 0);
+  render_stats.submits++;
+}
 
-    checkGLError("pre viz shadow map");
+void Scene::draw_instances(RenderPass pass, SceneObject *first, size_t count, size_t offset) {
+  first->bind_batch_state(pass);
+
+  // the stream's buffer name can change between frames
+  GLState::bind_vertex_array(instance_vertex_array);
+  GLState::bind_buffer(GL_ARRAY_BUFFER, instance_stream->buffer());
+  glVertexAttribPointer(VTX_INSTANCE_SPHERE_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                        (const void *)(offset + offsetof(InstanceData, sphere)));
+  glVertexAttribPointer(VTX_INSTANCE_MATERIAL_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                        (const void *)(offset + offsetof(InstanceData, material)));
+
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+  render_stats.submits++;
+}
+
+void Scene::render_in_opengl() {
+    update_light_clusters();
+    update_frame_uniforms();
+    bake_impostors();
+
+    Mat4f view_projection = Mat4f(camera->projection_matrix()) * Mat4f(camera->view_matrix());
+    bind_pass_uniforms(view_projection, Vector4D(camera->position(), 1));
+
+    Frustum frustum(view_projection);
+    if (render_mode == RENDER_MODE_DEFERRED && render_deferred(frustum))
+      return;
+    render_forward(frustum);
+}
+
+void Scene::render_forward(const Frustum &frustum) {
+    bool prepass = use_depth_prepass();
+    if (prepass) {
+      // depth only, positions through the shadow pass program
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      draw_queue(RENDER_PASS_DEPTH, camera->position(), frustum);
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    // the query slot's last frame was read by use_depth_prepass()
+    int slot = fragment_query_frame++ % FRAGMENT_QUERIES;
+    fragment_query_prepass[slot] = prepass;
+    glBeginQuery(GL_SAMPLES_PASSED, fragment_queries[slot]);
+
+    if (prepass) {
+      // only the fragments the prepass left in the depth buffer pass
+      GLState::depth_func(GL_EQUAL);
+      GLState::depth_mask(GL_FALSE);
+      draw_queue(RENDER_PASS_SHADE, camera->position(), frustum);
+      GLState::depth_func(GL_LESS);
+      GLState::depth_mask(GL_TRUE);
+      draw_queue(RENDER_PASS_FORWARD, camera->position(), frustum);
+    } else {
+      draw_queue(RENDER_PASS_COLOR, camera->position(), frustum);
+    }
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    glEndQuery(GL_SAMPLES_PASSED);
+    overdraw_stats.prepass = prepass;
+}
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+bool Scene::use_depth_prepass() {
+    // results of earlier frames, if the GPU has them (the slot this frame
+    // reuses is the oldest)
+    int slot = fragment_query_frame % FRAGMENT_QUERIES;
+    if (fragment_query_frame >= FRAGMENT_QUERIES) {
+      GLint available = 0;
+      glGetQueryObjectiv(fragment_queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available) {
+        GLuint64 samples = 0;
+        glGetQueryObjectui64v(fragment_queries[slot], GL_QUERY_RESULT, &samples);
+        if (fragment_query_prepass[slot])
+          overdraw_stats.fragments_with_prepass = samples;
+        else
+          overdraw_stats.fragments_without_prepass = samples;
+      }
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, shadow_color_texture[0]);
-    //glBindTexture(GL_TEXTURE_2D, shadow_texture[0]);
+    if (depth_prepass_mode != DEPTH_PREPASS_AUTO)
+      return depth_prepass_mode == DEPTH_PREPASS_ON;
+
+    // measure both ways first, then keep the one that shades fewer
+    // fragments for what it costs, now and then measuring the other again
+    double without = overdraw_stats.fragments_without_prepass;
+    double with = overdraw_stats.fragments_with_prepass;
+    if (without < 0)
+      return false;
+    if (with < 0)
+      return true;
+    bool prepass = without >= DEPTH_PREPASS_MIN_OVERDRAW * with;
+    if (fragment_query_frame % DEPTH_PREPASS_PROBE_FRAMES == 0)
+      prepass = !prepass;
+    return prepass;
+}
 
-    glUseProgram(shadow_viz_shader->_programID);
+bool Scene::render_deferred(const Frustum &frustum) {
+    if (!deferred_lighting_shader->finish())
+      return false;
+    if (!gbuffer)
+      gbuffer = new GBuffer();
+    if (!gbuffer->resize(camera->screen_width(), camera->screen_height()))
+      return false;
+
+    checkGLError("pre gbuffer pass");
+
+    // geometry pass, the material flags in the albedo target's alpha must
+    // not be blended
+    GLState::disable(GL_BLEND);
+    gbuffer->begin_geometry_pass();
+    draw_queue(RENDER_PASS_GBUFFER, camera->position(), frustum);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::enable(GL_BLEND);
+
+    // lighting pass: a triangle covering the screen, depth tested against
+    // what was drawn before the scene
+    const ShaderLocations &loc = deferred_lighting_shader->_locations;
+    GLState::use_program(deferred_lighting_shader->_programID);
+    Mat4f clip_to_world((camera->projection_matrix() * camera->view_matrix()).inv());
+    float m[16];
+    clip_to_world.store(m);
+    glUniformMatrix4fv(loc.clip2world, 1, GL_FALSE, m);
+
+    gbuffer->bind(0);
+    if (do_shadow_pass)
+      GLState::bind_texture(3, GL_TEXTURE_2D_ARRAY, shadow_texture);
+    if (shadow_moments_texture)
+      GLState::bind_texture(4, GL_TEXTURE_2D_ARRAY, shadow_moments_texture);
+
+    glBegin(GL_TRIANGLES);
+    glVertex3f(-1.0, -1.0, 0.0);
+    glVertex3f( 3.0, -1.0, 0.0);
+    glVertex3f(-1.0,  3.0, 0.0);
+    glEnd();
+
+    checkGLError("post deferred lighting pass");
+
+    // mirrors, and whatever else has no G-buffer program
+    draw_queue(RENDER_PASS_FORWARD, camera->position(), frustum);
+    return true;
+}
+
+ImpostorAtlas *Scene::get_impostor(SceneObject *o, const std::string &key) {
+    if (!use_impostors || baking_impostors || !impostor_shader->finish())
+      return NULL;
+
+    // the diameter of o's bounding sphere on screen, in pixels
+    BBox b = o->get_bbox();
+    double radius = b.extent.norm() / 2;
+    double dist = (b.centroid() - camera->position()).norm();
+    double tan_y = tan(camera->v_fov() * M_PI / 360.);
+    if (dist <= radius || radius * camera->screen_height() / (dist * tan_y) > IMPOSTOR_MAX_SCREEN_SIZE)
+      return NULL;
+
+    auto it = impostor_atlases.find(key);
+    if (it != impostor_atlases.end())
+      return it->second->is_baked() ? it->second : NULL;
+
+    // o draws the views of a new atlas, if there is memory left for one
+    if ((impostor_atlases.size() + 1) * ImpostorAtlas::bytes() > SCENE_IMPOSTOR_MEMORY_BUDGET)
+      return NULL;
+    ImpostorAtlas *atlas = new ImpostorAtlas();
+    atlas->source = o;
+    impostor_atlases[key] = atlas;
+    return NULL;
+}
+
+void Scene::bake_impostors() {
+    int baked = 0;
+    for (auto &entry : impostor_atlases) {
+      ImpostorAtlas *atlas = entry.second;
+      if (!atlas->source || baked == IMPOSTOR_BAKES_PER_FRAME)
+        continue;
+
+      if (baked == 0) {
+        // the views are drawn like a G-buffer pass, without blending
+        // the material flags in the albedo target's alpha
+        update_arena();
+        GLState::disable(GL_BLEND);
+        GLState::enable(GL_DEPTH_TEST);
+        baking_impostors = true;
+      }
+
+      // the source's draws are the same in every view, only the pass's
+      // view-projection changes. They're missing while its G-buffer
+      // program is being built.
+      render_queue.clear();
+      atlas->source->enqueue(render_queue, RENDER_PASS_GBUFFER, 0);
+      if (render_queue.size() == 0)
+        continue;
+
+      if (!atlas->begin_bake()) {
+        atlas->source = NULL;  // never drawn
+        continue;
+      }
+
+      BBox b = atlas->source->get_bbox();
+      double radius = b.extent.norm() / 2;
+      for (int j = 0; j < IMPOSTOR_FRAMES; j++) {
+        for (int i = 0; i < IMPOSTOR_FRAMES; i++) {
+          bind_pass_uniforms(Mat4f(atlas->begin_view(i, j, b.centroid(), radius)),
+                             Vector4D(ImpostorAtlas::view_direction(i, j), 0));
+          execute_queue(RENDER_PASS_GBUFFER, 1);
+        }
+      }
+      atlas->end_bake();
+
+      std::vector<GLuint> textures = { atlas->texture(0), atlas->texture(1), atlas->texture(2) };
+      atlas->material_id = get_material_id(textures);
+      baked++;
+    }
+
+    if (!baking_impostors)
+      return;
+
+    baking_impostors = false;
+    GLState::enable(GL_BLEND);
+    glViewport(0, 0, camera->screen_width(), camera->screen_height());
+    render_stats.impostors_baked += baked;
+    checkGLError("post impostor bake");
+}
+
+Shader *Scene::get_sphere_shader(RenderPass pass) {
+    Shader *shader = pass == RENDER_PASS_SHADOW ? sphere_depth_shader : sphere_shader;
+    return shader->finish() ? shader : NULL;
+}
+
+void Scene::draw_impostor(const ImpostorAtlas *atlas, const BBox &b) {
+    const ShaderLocations &loc = impostor_shader->_locations;
+    GLState::use_program(impostor_shader->_programID);
+
+    // the atlas in place of the G-buffer, and the shadow maps
+    atlas->bind(0);
+    if (do_shadow_pass)
+      GLState::bind_texture(3, GL_TEXTURE_2D_ARRAY, shadow_texture);
+    if (shadow_moments_texture)
+      GLState::bind_texture(4, GL_TEXTURE_2D_ARRAY, shadow_moments_texture);
+
+    Vector3D center = b.centroid();
+    glUniform4f(loc.impostorSphere, center.x, center.y, center.z, b.extent.norm() / 2);
+
+    glBegin(GL_TRIANGLE_STRIP);
+    glVertex2f(-1.0, -1.0);
+    glVertex2f( 1.0, -1.0);
+    glVertex2f(-1.0,  1.0);
+    glVertex2f( 1.0,  1.0);
+    glEnd();
+
+    render_stats.impostors++;
+}
+
+void Scene::visualize_shadow_map() {
+
+    checkGLError("pre viz shadow map");
+
+    // shows the first light's shadow map
+    GLState::bind_texture(0, GL_TEXTURE_2D_ARRAY, shadow_texture);
+    glBindSampler(0, shadow_depth_sampler);
+
+    GLState::use_program(shadow_viz_shader->_programID);
 
     glBegin(GL_TRIANGLES);
     float z = 0.0;
@@ -196,112 +1163,473 @@ void Scene::visualize_shadow_map() {
 
     glEnd();
 
-    glUseProgram(0);
-
+    glBindSampler(0, 0);
     checkGLError("post viz shadow map");
 }
 
-// helper
-static Matrix4x4 glToMatrix4x4(float* glMatrix) {
+void Scene::update_shadow_light_view(int i, const Vector3D &light_pos,
+                                     const Vector3D &light_dir, float cone_angle, int size) {
+
+    ShadowLightView &lv = shadow_light_views[i];
+
+    // I'm making the fovy (field of view in y direction) of the shadow map
+    // rendering a bit larger than the cone angle just to be safe. Clamp at 60 degrees.
+    float fovy = std::max(1.4f * cone_angle, 60.0f);
+    Matrix4x4 proj = Matrix4x4::perspective(fovy, 1.0, SPOT_SHADOW_NEAR, SPOT_SHADOW_FAR);
+
+    // The spot light is positioned at light_pos and looking in the given direction.
+    // Therefore it is looking at a point given by light_pos + light_dir
+    Vector3D lookat_pos = light_pos + light_dir;
+    Matrix4x4 cam = Matrix4x4::look_at(light_pos, lookat_pos,
+                                       Vector3D(0.0, 1.0, 0.0));  // Y up direction
+
+    lv.view_projection = Mat4f(proj) * Mat4f(cam);
+
+    // The bias matrix converts coordinates in the [-w,w]^3 normalized device coordinate box (the
+    // result of the perspective projection transform) to coordinates in a [0,w]^3 volume.
+    // After homogeneous divide. this means that x,y correspond to valid texture
+    // coordinates in the [0,1]^2 domain that can be used for a shadow map lookup in the shader.
+    // Notice that the matrix is just a scale and translation as to be expected.
+    // Maps smaller than the layer only use [0,s]^2 of it.
+    double s = size / (double)shadow_texture_size;
+    Matrix4x4 bias = Matrix4x4::translation(Vector3D(0.5 * s, 0.5 * s, 0.5)) *
+                     Matrix4x4::scaling(Vector3D(0.5 * s, 0.5 * s, 0.5));
+    world_to_shadowlight[i] = bias * proj * cam;
+
+    lv.valid = true;
+    lv.position = light_pos;
+    lv.direction = light_dir;
+    lv.angle = cone_angle;
+    lv.size = size;
+}
 
-  Matrix4x4 m;
-  int idx = 0;
-  for (int j=0; j<4; j++)
-    for (int i=0; i<4; i++)
-      m[j][i] = glMatrix[idx++];
-  
-  return m;
+void Scene::choose_shadow_map_sizes(int *sizes) {
+
+    BBox scene_bbox = get_bbox();
+    Vector3D eye = camera->position();
+    double tan_y = tan(camera->v_fov() * M_PI / 360.);
+    double screen_h = camera->screen_height();
+
+    int total = 0;
+    for (int i = 0; i < num_shadowed_lights; i++) {
+      StaticScene::SpotLight *light = spot_lights[i];
+      Vector3D d = light->direction.unit();
+      double a = std::min((double)light->angle, 80.) * M_PI / 180.;
+
+      // the cone only matters up to where it leaves the scene
+      double h = 0.;
+      for (int k = 0; k < 8; k++) {
+        Vector3D corner(k & 1 ? scene_bbox.max.x : scene_bbox.min.x,
+                        k & 2 ? scene_bbox.max.y : scene_bbox.min.y,
+                        k & 4 ? scene_bbox.max.z : scene_bbox.min.z);
+        h = std::max(h, dot(corner - light->position, d));
+      }
+      h = std::min(h, SPOT_SHADOW_FAR);  // far plane of the light's shadow frustum
+
+      // bounding sphere of the cone cut off at h
+      Vector3D center;
+      double radius;
+      if (a < M_PI / 4) {
+        radius = h / (2 * cos(a) * cos(a));
+        center = light->position + d * radius;
+      } else {
+        radius = h * tan(a);
+        center = light->position + d * h;
+      }
+
+      // its diameter on screen, in pixels
+      double dist = (center - eye).norm();
+      double pixels = dist > radius ? radius * screen_h / (dist * tan_y) : screen_h;
+
+      int size = shadow_texture_size;
+      while (size > SHADOW_MAP_MIN_SIZE && size / 2 >= pixels)
+        size /= 2;
+      sizes[i] = size;
+      total += size * size;
+    }
+
+    // halve the largest maps until the maps fit the texel budget
+    while (total > SCENE_SHADOW_TEXEL_BUDGET) {
+      int largest = 0;
+      for (int i = 1; i < num_shadowed_lights; i++)
+        if (sizes[i] > sizes[largest]) largest = i;
+      if (sizes[largest] <= SHADOW_MAP_MIN_SIZE)
+        break;
+      total -= sizes[largest] * sizes[largest] * 3 / 4;
+      sizes[largest] /= 2;
+    }
+}
+
+static bool same_matrix(const Mat4f &a, const Mat4f &b) {
+  float fa[16], fb[16];
+  a.store(fa);
+  b.store(fb);
+  return memcmp(fa, fb, sizeof(fa)) == 0;
 }
 
-int Scene::get_num_shadowed_lights() const {
-  return std::min( (int)spot_lights.size(), SCENE_MAX_SHADOWED_LIGHTS);
+void Scene::update_cascades() {
+
+    BBox scene_bbox = get_bbox();
+    if (scene_bbox.empty())
+      return;
+
+    Vector3D light_dir = directional_lights[0]->lightDir.unit();
+    Vector3D eye = camera->position();
+    Vector3D forward = (camera->view_point() - eye).unit();
+
+    // The cascades cover the part of the view frustum the scene is in. That
+    // depth is rounded up to a power of two, so that the splits (and with
+    // them the cascades' sizes) stay put while the camera moves, and only
+    // change when it crosses to another power of two.
+    double z_near = camera->near_clip();
+    double scene_radius = scene_bbox.extent.norm() / 2;
+    double z_far = (scene_bbox.centroid() - eye).norm() + scene_radius;
+    z_far = pow(2., ceil(log2(std::max(z_far, 2 * z_near))));
+    z_far = std::min(camera->far_clip(), z_far);
+    z_far = std::max(z_far, 2 * z_near);
+
+    // squared slope of the frustum's corner rays
+    double tan_y = tan(camera->v_fov() * M_PI / 360.);
+    double tan_x = tan_y * camera->aspect_ratio();
+    double k2 = tan_x * tan_x + tan_y * tan_y;
+
+    // light space rotation; the up vector just has to be off the light direction
+    Vector3D up = fabs(light_dir.y) > 0.99 ? Vector3D(1, 0, 0) : Vector3D(0, 1, 0);
+    Matrix4x4 light_view = Matrix4x4::look_at(Vector3D(0, 0, 0), light_dir, up);
+
+    // depth range of the whole scene, so that casters between the light
+    // and a slice are kept
+    double depth_min = INF_D, depth_max = -INF_D;
+    for (int k = 0; k < 8; k++) {
+      Vector3D corner(k & 1 ? scene_bbox.max.x : scene_bbox.min.x,
+                      k & 2 ? scene_bbox.max.y : scene_bbox.min.y,
+                      k & 4 ? scene_bbox.max.z : scene_bbox.min.z);
+      double depth = -(light_view * Vector4D(corner, 1.)).z;
+      depth_min = std::min(depth_min, depth);
+      depth_max = std::max(depth_max, depth);
+    }
+
+    Matrix4x4 bias = Matrix4x4::translation(Vector3D(0.5,0.5,0.5)) * Matrix4x4::scaling(0.5);
+
+    double slice_near = z_near;
+    for (int c = 0; c < num_cascades; c++) {
+
+      // practical split scheme, between logarithmic and uniform splits
+      double t = (c + 1) / (double)num_cascades;
+      double log_split = z_near * pow(z_far / z_near, t);
+      double uniform_split = z_near + (z_far - z_near) * t;
+      double slice_far = SHADOW_CASCADE_SPLIT_LAMBDA * log_split +
+                         (1. - SHADOW_CASCADE_SPLIT_LAMBDA) * uniform_split;
+      cascade_ends[c] = slice_far;
+
+      // Bounding sphere of the slice, centered on the view axis where it is
+      // as far from the near corners as from the far ones. Its size only
+      // depends on the split depths and the field of view, not on where
+      // the camera is or which way it looks, so neither does the texel
+      // size: moving the camera only moves the center.
+      double center_depth = std::min((slice_near + slice_far) * (1. + k2) / 2, slice_far);
+      double radius = sqrt((slice_far - center_depth) * (slice_far - center_depth) +
+                           slice_far * slice_far * k2);
+      Vector3D center = eye + forward * center_depth;
+      slice_near = slice_far;
+
+      // Snap the center to whole texels in light space, so that the map
+      // only moves in texel steps and shadow edges don't shimmer.
+      double texel = 2 * radius / shadow_texture_size;
+      Vector3D center_light = (light_view * Vector4D(center, 1.)).to3D();
+      center_light.x = floor(center_light.x / texel) * texel;
+      center_light.y = floor(center_light.y / texel) * texel;
+
+      Matrix4x4 proj = Matrix4x4::orthographic(center_light.x - radius, center_light.x + radius,
+                                               center_light.y - radius, center_light.y + radius,
+                                               depth_min, depth_max);
+
+      int i = num_shadowed_lights + c;
+      ShadowLightView &lv = shadow_light_views[i];
+      Mat4f view_projection = Mat4f(proj) * Mat4f(light_view);
+      if (!lv.valid || !same_matrix(view_projection, lv.view_projection))
+        lv.map_valid = false;
+
+      lv.valid = true;
+      lv.view_projection = view_projection;
+      lv.position = center - light_dir * (scene_radius + radius);
+      lv.direction = light_dir;
+      lv.angle = 0.f;
+      lv.size = shadow_texture_size;
+      world_to_shadowlight[i] = bias * proj * light_view;
+    }
+}
+
+void Scene::invalidate_shadows(const BBox &b) {
+  // a caster outside of a light's frustum can't show up in its map
+  for (ShadowLightView &lv : shadow_light_views) {
+    if (lv.valid && lv.map_valid && Frustum(lv.view_projection).intersects(b))
+      lv.map_valid = false;
+  }
+}
+
+void Scene::invalidate_shadows() {
+  for (ShadowLightView &lv : shadow_light_views)
+    lv.map_valid = false;
 }
 
 void Scene::render_shadow_pass() {
 
     checkGLError("begin shadow pass");
 
-    for (int i=0; i<get_num_shadowed_lights(); i++) {
+    std::vector<int> sizes(num_shadowed_lights);
+    choose_shadow_map_sizes(sizes.data());
 
-      Vector3D light_dir = spot_lights[i]->direction;
-      Vector3D light_pos = spot_lights[i]->position;
-      float    cone_angle = spot_lights[i]->angle;
+    if (num_cascades > 0)
+      update_cascades();
 
-      //printf("Spot light dir %f %f %f\n", light_dir.x, light_dir.y, light_dir.z);
-      //printf("Spot light pos %f %f %f\n", light_pos.x, light_pos.y, light_pos.z);
-      //printf("Spot light angle %f\n", cone_angle);
+    std::vector<int> layers;  // the maps to re-render
 
-      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadow_framebuffer[i]);
-      glViewport(0, 0, shadow_texture_size, shadow_texture_size);
+    for (int i=0; i<(int)shadow_light_views.size(); i++) {
 
-      //glClear(GL_DEPTH_BUFFER_BIT);
-      glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+      ShadowLightView &lv = shadow_light_views[i];
 
-      glMatrixMode(GL_PROJECTION);
-      glLoadIdentity();
+      if (i < num_shadowed_lights) {
+
+        Vector3D light_dir = spot_lights[i]->direction;
+        Vector3D light_pos = spot_lights[i]->position;
+        float    cone_angle = spot_lights[i]->angle;
+
+        //printf("Spot light dir %f %f %f\n", light_dir.x, light_dir.y, light_dir.z);
+        //printf("Spot light pos %f %f %f\n", light_pos.x, light_pos.y, light_pos.z);
+        //printf("Spot light angle %f\n", cone_angle);
+
+        // the light's matrices only have to be rebuilt after it or the
+        // size of its map changed
+        if (!lv.valid || !(lv.position == light_pos) || !(lv.direction == light_dir) ||
+            lv.angle != cone_angle || lv.size != sizes[i]) {
+          update_shadow_light_view(i, light_pos, light_dir, cone_angle, sizes[i]);
+          lv.map_valid = false;
+        }
+      }
+
+      // cascades that couldn't be fitted (empty scene) stay unused, and a
+      // map is only redrawn when it or a caster in its frustum changed
+      if (lv.valid && !lv.map_valid)
+        layers.push_back(i);
+    }
+
+    if (layers.empty())
+      return;
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadow_framebuffer);
+    GLState::enable(GL_DEPTH_TEST);  // the map is kept, it has to be right
+    GLState::enable(GL_SCISSOR_TEST);
+
+    // depth only, pushed back by the surface's slope so that lit
+    // surfaces don't shadow themselves at grazing angles
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    GLState::enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
+
+    update_arena();
+
+    if (layered_shadow_shader && layers.size() > 1 && unbatched_objects == 0) {
+      // LayeredPassUniforms has room for UNIFORM_MAX_SHADOW_MAPS maps, more
+      // take several passes
+      for (size_t first = 0; first < layers.size(); first += UNIFORM_MAX_SHADOW_MAPS) {
+        size_t last = std::min(first + UNIFORM_MAX_SHADOW_MAPS, layers.size());
+        render_layered_shadow_maps(std::vector<int>(layers.begin() + first, layers.begin() + last));
+      }
+    } else {
+      for (int i : layers) {
+        ShadowLightView &lv = shadow_light_views[i];
+
+        // render into the lv.size x lv.size corner of layer i of the shadow
+        // map array, only clearing that part
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0, i);
+        glViewport(0, 0, lv.size, lv.size);
+        glScissor(0, 0, lv.size, lv.size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        // spot lights look from their position, cascades along the
+        // light's direction
+        if (i < num_shadowed_lights)
+          bind_pass_uniforms(lv.view_projection, Vector4D(lv.position, 1));
+        else
+          bind_pass_uniforms(lv.view_projection, Vector4D(-lv.direction, 0));
+
+        // Now draw all the objects in the light's (or cascade's) frustum
+        draw_queue(RENDER_PASS_SHADOW, lv.position, Frustum(lv.view_projection));
+
+        /*
+        glUseProgram(shadow_shader2->_programID);
+        glBegin(GL_TRIANGLES);
+        glVertex3f(-1, -1, 0);
+        glVertex3f(1, -1, 0);
+        glVertex3f(-1, 1, 0);
+        glEnd();
+        glUseProgram(0);
+        */
+
+        lv.map_valid = true;
+        render_stats.shadow_maps++;
+        checkGLError("end shadow pass");
+      }
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    GLState::disable(GL_POLYGON_OFFSET_FILL);
+    GLState::disable(GL_SCISSOR_TEST);
+
+    // VSM filters each map once here instead of on every lookup
+    if (shadow_filter == SHADOW_FILTER_VSM) {
+      GLState::disable(GL_DEPTH_TEST);
+      for (int i : layers)
+        blur_shadow_map(i);
+      GLState::enable(GL_DEPTH_TEST);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+}
+
+void Scene::set_shadow_filter(ShadowFilter filter) {
+    if (filter == shadow_filter || !do_shadow_pass)
+      return;
+
+    if (filter == SHADOW_FILTER_VSM && !shadow_moments_texture)
+      create_shadow_moments();
+
+    // the moments of the cached maps are missing or stale
+    shadow_filter = filter;
+    invalidate_shadows();
+}
+
+void Scene::create_shadow_moments() {
+
+    checkGLError("pre shadow moments setup");
+
+    int num_shadow_maps = shadow_light_views.size();
+
+    // mean and mean square of depth, with linear filtering for lookups
+    glGenTextures(1, &shadow_moments_texture);
+    GLState::bind_texture(0, GL_TEXTURE_2D_ARRAY, shadow_moments_texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG32F, shadow_texture_size, shadow_texture_size,
+                 num_shadow_maps, 0, GL_RG, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // the first blur pass writes here, the second reads it back
+    glGenTextures(1, &shadow_blur_texture);
+    GLState::bind_texture(0, GL_TEXTURE_2D, shadow_blur_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, shadow_texture_size, shadow_texture_size,
+                 0, GL_RG, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &shadow_blur_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow_blur_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, shadow_blur_texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Error: Shadow blur frame buffer is not complete\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    checkGLError("post shadow moments setup");
+}
+
+void Scene::blur_shadow_map(int i) {
+
+    const ShadowLightView &lv = shadow_light_views[i];
+    float texel = 1.f / shadow_texture_size;
+    float scale = lv.size * texel;
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadow_blur_framebuffer);
+    glViewport(0, 0, lv.size, lv.size);
+
+    for (int pass = 0; pass < 2; pass++) {
+      const Shader *shader = shadow_blur_shader[pass];
+      const ShaderLocations &loc = shader->_locations;
+      GLState::use_program(shader->_programID);
+
+      if (pass == 0) {
+        // depths of layer i, blurred across into shadow_blur_texture
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               shadow_blur_texture, 0);
+        GLState::bind_texture(0, GL_TEXTURE_2D_ARRAY, shadow_texture);
+        glBindSampler(0, shadow_depth_sampler);
+        glUniform1i(loc.blurLayer, i);
+        glUniform2f(loc.blurStep, texel, 0.f);
+        // spot light maps are perspective, cascades orthographic
+        if (i < num_shadowed_lights)
+          glUniform2f(loc.blurDepthRange, SPOT_SHADOW_NEAR, SPOT_SHADOW_FAR);
+        else
+          glUniform2f(loc.blurDepthRange, 0.f, 0.f);
+      } else {
+        // and down into layer i of the moments
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  shadow_moments_texture, 0, i);
+        GLState::bind_texture(0, GL_TEXTURE_2D, shadow_blur_texture);
+        glBindSampler(0, 0);
+        glUniform2f(loc.blurStep, 0.f, texel);
+      }
+      glUniform1f(loc.blurScale, scale);
 
-      // I'm making the fovy (field of view in y direction) of the shadow map
-      // rendering a bit larger than the cone angle just to be safe. Clamp at 60 degrees.
-      float fovy = std::max(1.4f * cone_angle, 60.0f);
-      gluPerspective(fovy, 1.0f, 10.0f, 400.f);
-      
-      glMatrixMode(GL_MODELVIEW);
-      glLoadIdentity();
-
-      // The spot light is positioned at light_pos and looking in the given direction.
-      // Therefore it is looking at a point given by light_pos + light_dir
-      Vector3D lookat_pos = light_pos + light_dir;
-      gluLookAt(light_pos.x, light_pos.y, light_pos.z,
-                lookat_pos.x, lookat_pos.y, lookat_pos.z,   // look at center of scene
-                0.0, 1.0, 0.0);  // Y up direction
-
-      // Since the assignment code relies on the gluPerspective/gluLookAt for constructing
-      // matrices, I retrieve the matrices here to form a world-to-light-space matrix.
-      // A more modern approach approach is to maintain the matrices in the application
-      // and then provide them to the pipeline as uniforms
-      GLfloat cameraMatrix[16]; 
-      GLfloat projMatrix[16]; 
-      glGetFloatv(GL_MODELVIEW_MATRIX, cameraMatrix); 
-      glGetFloatv(GL_PROJECTION_MATRIX, projMatrix); 
-
-      // The bias matrix converts coordinates in the [-w,w]^3 normalized device coordinate box (the
-      // result of the perspective projection transform) to coordinates in a [0,w]^3 volume.
-      // After homogeneous divide. this means that x,y correspond to valid texture
-      // coordinates in the [0,1]^2 domain that can be used for a shadow map lookup in the shader.
-      // Notice that the matrix is just a scale and translation as to be expected.
-      Matrix4x4 bias = Matrix4x4::translation(Vector3D(0.5,0.5,0.5)) * Matrix4x4::scaling(0.5);
-      Matrix4x4 cam = glToMatrix4x4(cameraMatrix);
-      Matrix4x4 proj = glToMatrix4x4(projMatrix);
-
-      // printf("Shadow %d info:\n", i); 
-      //cout << bias << endl << endl;
-      // cout << cam  << endl << endl;
-      //cout << proj << endl << endl;
-
-      world_to_shadowlight[i] = bias * proj * cam;
-      //
-      // end world-to-shadow space transform construction hack
-      //
-
-      // Now draw all the objects in the scene
-      for (SceneObject *obj : objects)
-        if (obj->isVisible)
-          obj->draw_shadow();
-
-      /*
-      glUseProgram(shadow_shader2->_programID);
       glBegin(GL_TRIANGLES);
-      glVertex3f(-1, -1, 0);
-      glVertex3f(1, -1, 0);
-      glVertex3f(-1, 1, 0);
+      glVertex3f(-1.0, -1.0, 0.0);
+      glVertex3f( 3.0, -1.0, 0.0);
+      glVertex3f(-1.0,  3.0, 0.0);
       glEnd();
-      glUseProgram(0);
-      */
+    }
 
-      glBindFramebuffer(GL_FRAMEBUFFER, 0);
-      checkGLError("end shadow pass");
+    checkGLError("post shadow blur");
+}
+
+void Scene::render_layered_shadow_maps(const std::vector<int> &layers) {
+
+    // clear the part of each layer its map uses, cached maps in the other
+    // layers are kept
+    GLState::enable(GL_SCISSOR_TEST);
+    for (int i : layers) {
+      const ShadowLightView &lv = shadow_light_views[i];
+      glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0, i);
+      glScissor(0, 0, lv.size, lv.size);
+      glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    // then attach the whole array, the shaders pick the layer
+    glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow_texture, 0);
+    glViewport(0, 0, shadow_texture_size, shadow_texture_size);
+    GLState::disable(GL_SCISSOR_TEST);
+    GLState::enable(GL_CLIP_DISTANCE0);
+    GLState::enable(GL_CLIP_DISTANCE1);
+
+    LayeredPassUniforms u;
+    std::vector<Frustum> frusta;
+    for (size_t k = 0; k < layers.size(); k++) {
+      const ShadowLightView &lv = shadow_light_views[layers[k]];
+      lv.view_projection.store(u.layer_view_projection[k]);
+      u.layer_index[k][0] = layers[k];
+      u.layer_scale[k][0] = (float) lv.size / shadow_texture_size;
+      frusta.push_back(Frustum(lv.view_projection));
     }
 
+    size_t offset = object_uniform_stream->write(&u, sizeof(u));
+    GLState::bind_buffer_range(GL_UNIFORM_BUFFER, LAYERED_PASS_UNIFORMS_BINDING,
+                               object_uniform_stream->buffer(), offset, sizeof(u));
+
+    // casters are sorted by their distance from the first map's light
+    layered_shadow_pass = true;
+    draw_queue(RENDER_PASS_SHADOW, shadow_light_views[layers[0]].position,
+               &frusta[0], frusta.size());
+    layered_shadow_pass = false;
+
+    GLState::disable(GL_CLIP_DISTANCE0);
+    GLState::disable(GL_CLIP_DISTANCE1);
+
+    for (int i : layers)
+      shadow_light_views[i].map_valid = true;
+    render_stats.shadow_maps += layers.size();
+    checkGLError("end layered shadow pass");
 }
     
 void Scene::prevPattern() {
@@ -367,12 +1695,67 @@ StaticScene::Scene *Scene::get_transformed_static_scene(double t) {
 }
 
 Matrix4x4 SceneObject::getTransformation() {
-  Vector3D rot = rotation * M_PI / 180;
-  return Matrix4x4::translation(position) *
-         Matrix4x4::rotation(rot.x, Matrix4x4::Axis::X) *
-         Matrix4x4::rotation(rot.y, Matrix4x4::Axis::Y) *
-         Matrix4x4::rotation(rot.z, Matrix4x4::Axis::Z) *
-         Matrix4x4::scaling(scale);
+  if (!transform_valid)
+    update_transform();
+  return world_matrix;
+}
+
+const GLTransform &SceneObject::get_gl_transform() {
+  if (!transform_valid)
+    update_transform();
+  return gl_transform;
+}
+
+void SceneObject::update_transform() {
+  Matrix4x4 R = getRotation();
+  world_matrix = Matrix4x4::translation(position) * R * Matrix4x4::scaling(scale);
+
+  // the inverse transpose of R * S, R being orthonormal
+  Vector3D inv_scale(1. / scale.x, 1. / scale.y, 1. / scale.z);
+  Matrix4x4 normal_matrix = R * Matrix4x4::scaling(inv_scale);
+
+  Mat4f(world_matrix).store(gl_transform.obj2world);
+  Mat4f(normal_matrix).store_3x3(gl_transform.obj2worldNorm);
+
+  transform_valid = true;
+}
+
+BBox SceneObject::get_bbox() {
+  if (!bbox_valid) {
+    bbox = compute_bbox();
+    bbox_valid = true;
+  }
+  return bbox;
+}
+
+void SceneObject::set_position(const Vector3D& p) {
+  BBox old_bbox = get_bbox();
+  position = p;
+  transform_changed(old_bbox);
+}
+
+void SceneObject::set_rotation(const Vector3D& r) {
+  BBox old_bbox = get_bbox();
+  rotation = r;
+  transform_changed(old_bbox);
+}
+
+void SceneObject::set_scale(const Vector3D& s) {
+  BBox old_bbox = get_bbox();
+  scale = s;
+  transform_changed(old_bbox);
+}
+
+void SceneObject::transform_changed(const BBox& old_bbox) {
+  bbox_valid = false;
+  transform_valid = false;
+  if (scene)
+    scene->object_bbox_changed(this, old_bbox);
+}
+
+void SceneObject::enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth) {
+  if (pass == RENDER_PASS_SHADOW || pass == RENDER_PASS_COLOR || pass == RENDER_PASS_FORWARD)
+    queue.push(RenderQueue::make_key(pass, 0, 0, depth), this);
 }
 
 Matrix4x4 SceneObject::getRotation() {
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
 #include <iostream>
 
 #include "CS248/CS248.h"
@@ -12,12 +13,76 @@
 #include "GL/glew.h"
 
 #include "../camera.h"
+#include "../frustum.h"
 #include "../shader.h"
+#include "../stream_buffer.h"
+#include "../uniform_buffers.h"
+
+#include "gbuffer.h"
+#include "geometry_arena.h"
+#include "impostor_atlas.h"
+#include "light_clusters.h"
+#include "render_queue.h"
 
 #include "../static_scene/scene.h"
 #include "../static_scene/light.h"
 
-#define SCENE_MAX_SHADOWED_LIGHTS 2
+// GPU memory the shadow maps may use. Spot lights beyond what fits are not
+// shadowed, and the directional light's cascades are only added if they
+// fit after the spot lights.
+#define SCENE_SHADOW_MEMORY_BUDGET (32 << 20)
+
+// Spot light shadow maps get a resolution between SHADOW_MAP_MIN_SIZE and
+// the array's layer size, by how large the light's cone appears on
+// screen. If the maps would have more than SCENE_SHADOW_TEXEL_BUDGET
+// texels together the largest ones are halved until they fit.
+#define SHADOW_MAP_MIN_SIZE        128
+#define SCENE_SHADOW_TEXEL_BUDGET  (4 << 20)
+
+// Blend between logarithmic (1) and uniform (0) spacing of the cascade
+// splits along the view direction.
+#define SHADOW_CASCADE_SPLIT_LAMBDA 0.75
+
+// Near and far plane of the spot light shadow frusta
+#define SPOT_SHADOW_NEAR 10.0
+#define SPOT_SHADOW_FAR  400.0
+
+// Point and spot lights are taken to reach only as far as their
+// contribution to a color channel (Phong_BRDF is at most 2) stays above
+// this, half an 8 bit step. That bounds the light clusters they're in.
+#define LIGHT_CUTOFF (0.5 / 255.0)
+
+// Material features a mesh program is specialized for, see
+// Scene::get_shader_permutation()
+#define SHADER_FEATURE_TEXTURE_MAPPING      (1 << 0)
+#define SHADER_FEATURE_NORMAL_MAPPING       (1 << 1)
+#define SHADER_FEATURE_ENVIRONMENT_MAPPING  (1 << 2)
+#define SHADER_FEATURE_MIRROR_BRDF          (1 << 3)
+#define SHADER_FEATURE_SHADOW_RECEIVER      (1 << 4)  // G-buffer programs only
+
+// Meshes whose bounding sphere is at most IMPOSTOR_MAX_SCREEN_SIZE pixels
+// across on screen are drawn as impostors (see ImpostorAtlas), about as
+// many pixels as an atlas view has texels. At most
+// SCENE_IMPOSTOR_MEMORY_BUDGET bytes of atlases are kept, and at most
+// IMPOSTOR_BAKES_PER_FRAME of them are baked in a frame.
+#define IMPOSTOR_MAX_SCREEN_SIZE      IMPOSTOR_FRAME_SIZE
+#define SCENE_IMPOSTOR_MEMORY_BUDGET  (64 << 20)
+#define IMPOSTOR_BAKES_PER_FRAME      2
+
+// Forward frames draw a depth prepass (see Scene::DepthPrepassMode) while
+// the fragments shaded without it are at least DEPTH_PREPASS_MIN_OVERDRAW
+// times those shaded with it; the prepass itself only costs vertex work
+// and depth-only fragments. Every DEPTH_PREPASS_PROBE_FRAMES forward
+// frames the other way is drawn once to keep both counts current.
+#define DEPTH_PREPASS_MIN_OVERDRAW 1.15
+#define DEPTH_PREPASS_PROBE_FRAMES 30
+
+// fragment counting queries are read back this many frames later
+#define FRAGMENT_QUERIES 4
+
+// glPolygonOffset() factor and units for rendering shadow maps
+#define SHADOW_SLOPE_BIAS    2.0f
+#define SHADOW_CONSTANT_BIAS 4.0f
 
 typedef std::vector<std::string> Info;
 
@@ -41,6 +106,16 @@ public:
     int type;
 };
 
+/**
+ * An object's transforms in the column-major form the shaders take them
+ * (see ObjectUniforms). The columns of the normal matrix are padded to
+ * four floats, like a mat3 in a std140 or std430 block.
+ */
+struct GLTransform {
+  float obj2world[16];
+  float obj2worldNorm[12];
+};
+
 /**
  * Interface that all physical objects in the scene conform to.
  * Note that this doesn't include properties like material that may be treated
@@ -50,23 +125,63 @@ public:
 class SceneObject {
  public:
   SceneObject()
-      : scene(NULL), isVisible(true), isPickable(true) {}
+      : scene(NULL), isVisible(true), isPickable(true), bbox_valid(false),
+        transform_valid(false) {}
 
   /**
    * Renders the object in OpenGL, assuming that the camera and projection
    * matrices have already been set up.
    */
   virtual void draw() = 0;
-  virtual void draw_shadow() {};  // don't require draw_shadow()
+  virtual void draw_shadow() {};  // don't require draw_shadow(), also
+                                  // draws RENDER_PASS_DEPTH
+  virtual void draw_gbuffer() {}  // only called for RENDER_PASS_GBUFFER draws
 
   virtual void draw_pretty() { draw(); }
 
   /**
-   * Given a transformation matrix from local to space to world space, returns
-   * a bounding box of the object in world space. Note that this doesn't have
-   * to be the smallest possible bbox, in case that's difficult to compute.
+   * Appends the object's draws for a pass to the scene's render queue.
+   * depth is the front-to-back bucket the scene computed for the object;
+   * objects fill in the program and material parts of the key. The
+   * default emits one draw with no particular GL state, in
+   * RENDER_PASS_SHADOW, RENDER_PASS_COLOR and RENDER_PASS_FORWARD.
    */
-  virtual BBox get_bbox() = 0;
+  virtual void enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth);
+
+  /**
+   * Objects whose geometry never changes can place it in the scene's
+   * GeometryArena, so that the scene can draw them in batches: draws that
+   * are adjacent in the render queue, have the same state key and all
+   * return true from get_arena_draw() are submitted with one call, after
+   * bind_batch_state() of the first of them. Objects that don't implement
+   * these are drawn with draw()/draw_shadow().
+   */
+  virtual void add_to_arena(GeometryArena &arena) {}
+  virtual bool get_arena_draw(ArenaRange &range, ObjectUniforms &uniforms) { return false; }
+  virtual void bind_batch_state(RenderPass pass) {}
+
+  /**
+   * Objects that are instances of one quad (ray-cast spheres, see Sphere)
+   * fill in their InstanceData. Draws that are adjacent in the render
+   * queue, have the same state key and all return true are drawn with one
+   * instanced call, after bind_batch_state() of the first of them. This is
+   * tried before the arena.
+   */
+  virtual bool get_instance(InstanceData &instance) { return false; }
+
+  /**
+   * Starts building the programs the object draws with, so that the driver
+   * can compile them in parallel with everything else loading. Called when
+   * the object is added to a scene.
+   */
+  virtual void prepare_shaders() {}
+
+  /**
+   * Returns a bounding box of the object in world space. The box is cached
+   * and only recomputed (see compute_bbox) after the object's transform
+   * changed, so this is cheap to call every frame.
+   */
+  BBox get_bbox();
   
   /**
    * Converts this object to an immutable, raytracer-friendly form. Passes in a
@@ -82,10 +197,29 @@ class SceneObject {
     return get_static_object();
   }
   
+  /**
+   * Object to world transform built from position, rotation and scale.
+   * Like the bbox, it's cached until the transform changes.
+   */
   virtual Matrix4x4 getTransformation();
 
   virtual Matrix4x4 getRotation();
 
+  /**
+   * Object to world transforms for positions and normals, ready to be
+   * handed to OpenGL. Cached until the transform changes.
+   */
+  const GLTransform &get_gl_transform();
+
+  /**
+   * Change the world-space position, rotation (degrees) or scale of the
+   * object. Objects that move after being added to a scene must be updated
+   * through these so that cached bounding boxes stay valid.
+   */
+  void set_position(const Vector3D& p);
+  void set_rotation(const Vector3D& r);
+  void set_scale(const Vector3D& s);
+
   /**
    * Pointer to the parent scene containing this object.
    */
@@ -97,7 +231,8 @@ class SceneObject {
   Vector3D scale;
 
   /**
-   * Is this object drawn in the scene?
+   * Is this object drawn in the scene? Call Scene::invalidate_shadows()
+   * after changing it, shadow maps are cached.
    */
   bool isVisible;
 
@@ -105,6 +240,31 @@ class SceneObject {
    * Is this object pickable right now?
    */
   bool isPickable;
+
+ protected:
+  /**
+   * Computes a bounding box of the object in world space, using the current
+   * transform. Note that this doesn't have to be the smallest possible bbox,
+   * in case that's difficult to compute.
+   */
+  virtual BBox compute_bbox() = 0;
+
+  /**
+   * Invalidates cached state derived from the transform (the bbox and
+   * world matrices). old_bbox is the world space bbox before the change,
+   * which the scene uses to decide whether its bounds may have shrunk.
+   */
+  void transform_changed(const BBox& old_bbox);
+
+ private:
+  BBox bbox;        // cached result of compute_bbox()
+  bool bbox_valid;
+
+  // cached transforms, rebuilt by update_transform() when not valid
+  void update_transform();
+  Matrix4x4 world_matrix;
+  GLTransform gl_transform;
+  bool transform_valid;
 };
 
 // A Selection stores information about any object or widget that is
@@ -146,6 +306,33 @@ class SceneLight {
   virtual StaticScene::SceneLight *get_static_light() const = 0;
 };
 
+/**
+ * Draw and state change counts of the render queues executed since the
+ * last Scene::reset_render_stats().
+ */
+struct RenderStats {
+  int draws;
+  int submits;                 // draw calls, batches count once
+  int culled;                  // objects outside the pass's frustum
+  int shadow_maps;             // shadow maps re-rendered
+  int impostors;               // meshes drawn as impostors
+  int impostors_baked;         // impostor atlases baked
+  int state_changes_unsorted;  // in the order the objects are stored
+  int state_changes_sorted;    // in the order the queue executed them
+};
+
+/**
+ * Fragments the forward color pass shaded, counted with occlusion queries.
+ * Without the depth prepass every fragment that passes the depth test when
+ * it is drawn gets shaded, with it only the visible ones. Each count is
+ * from the last frame drawn that way, -1 until there was one.
+ */
+struct OverdrawStats {
+  double fragments_without_prepass;
+  double fragments_with_prepass;
+  bool prepass;                      // the last forward frame drew it
+};
+
 /**
  * The scene that meshEdit generates and works with.
  */
@@ -170,26 +357,190 @@ class Scene {
   bool removeObject(SceneObject *o);
 
   /**
-   * Renders the scene in OpenGL, assuming the camera and projection
-   * transformations have been applied elsewhere.
+   * Renders the scene in OpenGL as seen by camera.
    */
   void render_in_opengl();
 
   // renders a shadow pass
   void render_shadow_pass();
 
+  /**
+   * Uploads the data in a draw's ObjectUniforms block and binds it for the
+   * next draw call. Each draw of a frame gets its own slice of one buffer.
+   */
+  void bind_object_uniforms(const ObjectUniforms &u);
+
+  /**
+   * A program built by get_shader_permutation(), the named uniform values
+   * it gets once linked and the program drawn with until then.
+   */
+  struct ShaderPermutation {
+    Shader *shader;
+    Shader *fallback;
+    std::vector<std::string> uniform_names;
+    std::vector<float> uniform_values;
+    bool configured;  // linked, and its uniforms set
+  };
+
+  /**
+   * Returns the program built from the given shader files with the
+   * material features (SHADER_FEATURE_* bits) and the scene's light counts
+   * compiled in as #defines after prefix. Programs are submitted on first
+   * request and shared by everything asking for the same files, prefix,
+   * features and named uniform values. The program may still be compiling,
+   * draw with get_ready_shader().
+   */
+  ShaderPermutation *get_shader_permutation(const std::string &vertex_shader_filename,
+                                            const std::string &fragment_shader_filename,
+                                            const std::string &prefix, uint32_t features,
+                                            const std::vector<std::string> &uniform_names,
+                                            const std::vector<float> &uniform_values);
+
+  /**
+   * The permutation's program if it is linked, else a program with a plain
+   * fallback material (fallback.frag) and the same vertex shader. NULL if
+   * neither builds.
+   */
+  Shader *get_ready_shader(ShaderPermutation *permutation);
+
+  /**
+   * The permutation of a mesh vertex shader and gbuffer.frag that writes
+   * the G-buffer for a material with the given features; with
+   * SHADER_FEATURE_SHADOW_RECEIVER the deferred lighting pass shades it
+   * like shader_shadow.frag, else like shader.frag.
+   */
+  ShaderPermutation *get_gbuffer_shader_permutation(const std::string &vertex_shader_filename,
+                                                    const std::string &prefix, uint32_t features);
+
+  /**
+   * Permutations in total, still being built, and whose program failed to
+   * build (those draw with the fallback for good).
+   */
+  int get_num_shader_permutations() const { return shader_permutations.size(); }
+  int get_num_pending_shader_permutations() const;
+  int get_num_failed_shader_permutations() const;
+
+  /**
+   * Returns a small id for a set of textures bound together, for use as
+   * the material part of a render queue key.
+   */
+  uint32_t get_material_id(const std::vector<GLuint> &textures);
+
+  const RenderStats &get_render_stats() const { return render_stats; }
+  void reset_render_stats();
+
+  /**
+   * Starts a frame: resets the render stats and moves the buffers per-draw
+   * data is streamed through on to the frame's storage, waiting for the GPU
+   * if it is still reading it. Call before the first pass of every frame.
+   */
+  void begin_frame();
+
+  /**
+   * Bytes streamed and time spent waiting for stream storage this frame,
+   * over all of the scene's streams.
+   */
+  StreamBuffer::Stats get_stream_stats() const;
+  bool uses_persistent_streams() const { return object_uniform_stream->is_persistent(); }
+
+  const LightClusters::Stats &get_light_cluster_stats() const { return light_clusters.stats(); }
+
   // visualization mode
   void visualize_shadow_map();
+
+  /**
+   * How shadow map lookups are filtered. SHADOW_FILTER_PCF compares depths
+   * through hardware filtered comparison samplers (2x2 PCF per fetch).
+   * SHADOW_FILTER_VSM (variance shadow maps) keeps the mean and mean square
+   * of depth, blurred with a separable filter whenever a map is
+   * re-rendered, and shades with one filtered fetch per light. The VSM
+   * textures are only allocated once that mode is first used.
+   */
+  enum ShadowFilter { SHADOW_FILTER_PCF = 0, SHADOW_FILTER_VSM = 1 };
+  void set_shadow_filter(ShadowFilter filter);
+  ShadowFilter get_shadow_filter() const { return shadow_filter; }
+
+  /**
+   * How the camera's view is shaded. RENDER_MODE_FORWARD lights every
+   * fragment as it is drawn. RENDER_MODE_DEFERRED draws the surfaces into a
+   * G-buffer first and then lights every pixel once, so that hidden
+   * fragments cost no lighting; meshes without a G-buffer program yet and
+   * mirror materials are still drawn forward, after the lighting pass. The
+   * G-buffer is only allocated once that mode is first used.
+   */
+  enum RenderMode { RENDER_MODE_FORWARD = 0, RENDER_MODE_DEFERRED = 1 };
+  void set_render_mode(RenderMode mode) { render_mode = mode; }
+  RenderMode get_render_mode() const { return render_mode; }
+  int get_gbuffer_bytes_per_pixel() const { return gbuffer ? gbuffer->bytes_per_pixel() : 0; }
+
+  /**
+   * Depth prepass of forward frames: the meshes are first drawn depth only
+   * with the shadow pass program, then shaded with depth test GL_EQUAL and
+   * depth writes off, so each covered pixel is shaded once. Objects that
+   * don't write depth in shadow passes are drawn after that, as usual.
+   * DEPTH_PREPASS_AUTO draws the prepass while the measured overdraw is at
+   * least DEPTH_PREPASS_MIN_OVERDRAW.
+   */
+  enum DepthPrepassMode { DEPTH_PREPASS_AUTO = 0, DEPTH_PREPASS_ON = 1, DEPTH_PREPASS_OFF = 2 };
+  void set_depth_prepass_mode(DepthPrepassMode mode) { depth_prepass_mode = mode; }
+  DepthPrepassMode get_depth_prepass_mode() const { return depth_prepass_mode; }
+  const OverdrawStats &get_overdraw_stats() const { return overdraw_stats; }
+
+  /**
+   * Octahedral impostors of distant meshes. Returns the baked atlas object
+   * o is drawn with this frame, or NULL if it is drawn as usual: when
+   * impostors are off, o is close enough to cover more than
+   * IMPOSTOR_MAX_SCREEN_SIZE pixels, or its atlas isn't baked yet. Objects
+   * with the same key share an atlas, so the key has to tell apart
+   * everything the views show: geometry, materials, rotation and scale.
+   * An atlas is baked by drawing o's RENDER_PASS_GBUFFER draws into it at
+   * the start of a later frame.
+   */
+  ImpostorAtlas *get_impostor(SceneObject *o, const std::string &key);
+
+  /**
+   * Draws the impostor of an object with bounding box b, in the color
+   * passes of the camera's view.
+   */
+  void draw_impostor(const ImpostorAtlas *atlas, const BBox &b);
+
+  Shader *get_impostor_shader() { return impostor_shader; }
+
+  /**
+   * Program of ray-cast spheres (see Sphere) in a pass: lit in the color
+   * passes, depth only in shadow passes. NULL while it is being built.
+   */
+  Shader *get_sphere_shader(RenderPass pass);
+  void set_use_impostors(bool use) { use_impostors = use; }
+  bool get_use_impostors() const { return use_impostors; }
+  int get_num_impostor_atlases() const { return impostor_atlases.size(); }
     
   // true if shadow pass is necessary
   bool requires_shadow_pass() const { return do_shadow_pass; }
 
+  /**
+   * Shadow maps are kept from frame to frame and only re-rendered when
+   * their light changed or a caster inside the light's frustum was added,
+   * removed or moved. Marks the maps that world space box b touches for
+   * re-rendering; with no argument, all of them. The scene calls this
+   * itself for objects moved through SceneObject::set_position() etc.
+   */
+  void invalidate_shadows(const BBox &b);
+  void invalidate_shadows();
+
   /**
    * Gets a bounding box for the entire scene in world space coordinates.
-   * May not be the tightest possible.
+   * May not be the tightest possible. The union is maintained incrementally
+   * as objects are added, removed or moved, so this is usually O(1).
    */
   BBox get_bbox();
 
+  /**
+   * Called by an object in the scene after its world space bbox changed.
+   * old_bbox is the object's bbox before the change.
+   */
+  void object_bbox_changed(SceneObject *o, const BBox &old_bbox);
+
   int current_pattern_id;
   int current_pattern_subid;
   double scaling_factor;
@@ -199,10 +550,12 @@ class Scene {
   void decreaseCurrentPattern(double scale = 1);
   void increaseCurrentPattern(double scale = 1);
 
-  Shader*   get_shadow_shader() { return shadow_shader; }
-  GLuint    get_shadow_texture(int lightid) { return shadow_texture[lightid]; }
+  Shader*   get_shadow_shader() { return layered_shadow_pass ? layered_shadow_shader : shadow_shader; }
+  GLuint    get_shadow_texture() { return shadow_texture; }  // GL_TEXTURE_2D_ARRAY
+  GLuint    get_shadow_moments_texture() { return shadow_moments_texture; }  // 0 unless VSM was used
   Matrix4x4 get_world_to_shadowlight(int lightid) { return world_to_shadowlight[lightid]; }
-  int       get_num_shadowed_lights() const;
+  int       get_num_shadowed_lights() const { return num_shadowed_lights; }
+  int       get_num_shadow_maps() const { return shadow_light_views.size(); }
 
   /**
    * Builds a static scene that's equivalent to the current scene and is easier
@@ -231,12 +584,188 @@ class Scene {
   int      shadow_texture_size;
   Shader*  shadow_shader;
   Shader*  shadow_shader2;
+  Shader*  layered_shadow_shader;  // NULL if maps are rendered one at a time
   Shader*  shadow_viz_shader;
-  GLuint   shadow_framebuffer[SCENE_MAX_SHADOWED_LIGHTS];
-  GLuint   shadow_texture[SCENE_MAX_SHADOWED_LIGHTS];  
-  GLuint   shadow_color_texture[SCENE_MAX_SHADOWED_LIGHTS];
-  Matrix4x4 world_to_shadowlight[SCENE_MAX_SHADOWED_LIGHTS];
-    
+  Shader*  shadow_blur_shader[2];  // VSM blur: depth layer across, then moments down
+  int      num_shadowed_lights;
+  int      num_cascades;    // of the first directional light, 0 if unshadowed
+  float    cascade_ends[UNIFORM_NUM_CASCADES];
+  GLuint   shadow_framebuffer;
+  GLuint   shadow_texture;  // depth texture array: spot light maps, then cascades
+  GLuint   shadow_depth_sampler;  // reads shadow_texture as depths, not comparisons
+  ShadowFilter shadow_filter;
+  GLuint   shadow_moments_texture;  // VSM moments array, a layer per shadow map
+  GLuint   shadow_blur_texture;     // VSM moments blurred in one direction
+  GLuint   shadow_blur_framebuffer;
+  std::vector<Matrix4x4> world_to_shadowlight;  // per shadow map layer
+  GLuint   shadow_map_transform_buffer;   // world_to_shadowlight and scale per
+  GLuint   shadow_map_transform_texture;  // layer, see SHADOW_MAP_TEXELS
+
+ private:
+  // Fills the FrameUniforms block (camera, lights, shadow transforms) and
+  // binds it for all programs. Called once per frame before drawing.
+  void update_frame_uniforms();
+
+  // Bins the point and spot lights into the clusters of the camera's view
+  // and binds the cluster textures, before update_frame_uniforms().
+  void update_light_clusters();
+
+  // Draws the view through the G-buffer: the geometry pass, the lighting
+  // pass and the forward draws left. False if there is no G-buffer to
+  // draw into, nothing is drawn then.
+  bool render_deferred(const Frustum &frustum);
+
+  // Draws the view forward, with or without the depth prepass, counting
+  // the fragments the color draws shade.
+  void render_forward(const Frustum &frustum);
+
+  // Whether this forward frame draws the depth prepass, and picking up the
+  // fragment counts of earlier frames that are ready.
+  bool use_depth_prepass();
+
+  // Rebuilds the shadow map view-projection of shadowed light i and
+  // world_to_shadowlight[i] from the light's parameters, for a map of
+  // size x size texels in the corner of its layer.
+  void update_shadow_light_view(int i, const Vector3D &light_pos,
+                                const Vector3D &light_dir, float cone_angle, int size);
+
+  // Picks the shadow map size of every shadowed spot light from its
+  // screen coverage and the texel budget.
+  void choose_shadow_map_sizes(int *sizes);
+
+  // Fits the cascades of the first directional light to slices of the
+  // camera frustum, marking the maps whose transform changed.
+  void update_cascades();
+
+  // Uploads the PassUniforms block (the view-projection transform of the
+  // pass and its eye, see PassUniforms) and binds it for the draws that
+  // follow.
+  void bind_pass_uniforms(const Mat4f &view_projection, const Vector4D &eye);
+
+  // Collects the draws of all visible objects inside frustum for pass into
+  // render_queue, sorts them and draws them. eye is the point depth is
+  // measured from.
+  void draw_queue(RenderPass pass, const Vector3D &eye, const Frustum &frustum);
+
+  // Same for num_frusta views at once: objects inside any of the frusta
+  // are drawn, every arena draw instanced num_frusta times.
+  void draw_queue(RenderPass pass, const Vector3D &eye, const Frustum *frusta,
+                  int num_frusta);
+
+  // Sorts the draws in render_queue and draws them, batching what can be.
+  void execute_queue(RenderPass pass, int num_frusta);
+
+  // Bakes up to IMPOSTOR_BAKES_PER_FRAME of the requested impostor atlases.
+  void bake_impostors();
+
+  // Rebuilds the arena if objects were added or removed since the last
+  // draw.
+  void update_arena();
+
+  // Renders the shadow maps of the given layers, at most
+  // UNIFORM_MAX_SHADOW_MAPS of them, with one layered pass.
+  void render_layered_shadow_maps(const std::vector<int> &layers);
+
+  // Creates the textures and shaders of variance shadow mapping.
+  void create_shadow_moments();
+
+  // Fills layer i of the moments texture from the just rendered depth map
+  // of layer i, blurred.
+  void blur_shadow_map(int i);
+
+  // Draws count arena draws with one glMultiDrawElementsIndirect call, in
+  // the state first sets up. Their ObjectBuffer entries and commands were
+  // written to the streams at the given offsets.
+  void draw_batch(RenderPass pass, SceneObject *first, size_t count,
+                  size_t uniforms_offset, size_t commands_offset);
+
+  // Draws count instances of the quad with one glDrawArraysInstanced call,
+  // in the state first sets up. Their InstanceData was written to the
+  // instance stream at offset.
+  void draw_instances(RenderPass pass, SceneObject *first, size_t count, size_t offset);
+
+  // Shadow map view-projection of a shadowed light and the light
+  // parameters they were built from, so that they (and
+  // world_to_shadowlight) are only rebuilt when the light changes.
+  // map_valid is false while the light's shadow map needs re-rendering.
+  // Cascades only use view_projection and position, the point their
+  // casters are sorted by distance from.
+  struct ShadowLightView {
+    bool valid;
+    bool map_valid;
+    Vector3D position;
+    Vector3D direction;
+    float angle;
+    int size;  // texels per side of the layer the map uses
+    Mat4f view_projection;
+  };
+  std::vector<ShadowLightView> shadow_light_views;
+
+  RenderQueue render_queue;
+  RenderStats render_stats;
+  std::map<std::vector<GLuint>, uint32_t> material_ids;
+  std::map<std::string, ShaderPermutation> shader_permutations;  // by file names and prefix
+  std::map<std::string, Shader *> fallback_shaders;  // by vertex shader file and prefix
+  std::string fallback_fragment_shader;
+  std::string gbuffer_fragment_shader;
+
+  GLuint frame_uniform_buffer;
+  StreamBuffer *object_uniform_stream;  // ObjectUniforms blocks of single
+                                        // draws and PassUniforms blocks
+
+  // Batched drawing, only used if GeometryArena::supported(). The arena
+  // holds the geometry of all objects that support it and is rebuilt
+  // before the next draw after objects were added or removed.
+  bool use_multi_draw;
+  GeometryArena arena;
+  bool arena_dirty;
+  StreamBuffer *object_buffer_stream;   // ObjectBuffer arrays of batches
+  StreamBuffer *draw_command_stream;    // indirect draw commands of batches
+  size_t unbatched_objects;             // objects that draw themselves
+
+  // Instanced drawing: a vertex array with the corners of a quad and the
+  // per-instance attributes, read from the instance stream.
+  StreamBuffer *instance_stream;        // InstanceData arrays of instanced draws
+  GLuint quad_corner_buffer;
+  GLuint instance_vertex_array;
+
+  // All shadow maps that need re-rendering are drawn in one layered pass
+  // (see shadow_pass.vert) if the arena holds all shadow casters.
+  bool layered_shadow_pass;             // the layered pass is drawing
+
+  // point and spot lights by cluster of the camera's view
+  LightClusters light_clusters;
+
+  // deferred shading, the G-buffer is NULL until first used
+  RenderMode render_mode;
+  GBuffer *gbuffer;
+  Shader *deferred_lighting_shader;
+
+  // impostor atlases by key, and the program of impostor quads
+  // (deferred_lighting.frag built with IMPOSTOR)
+  bool use_impostors;
+  bool baking_impostors;  // get_impostor() is off while atlases are drawn
+  std::map<std::string, ImpostorAtlas *> impostor_atlases;
+  Shader *impostor_shader;
+
+  // ray-cast spheres (deferred_lighting.frag built with SPHERE), lit and
+  // depth only
+  Shader *sphere_shader;
+  Shader *sphere_depth_shader;
+
+  // depth prepass; GL_SAMPLES_PASSED queries of the last FRAGMENT_QUERIES
+  // forward frames and whether each frame drew the prepass
+  DepthPrepassMode depth_prepass_mode;
+  OverdrawStats overdraw_stats;
+  GLuint fragment_queries[FRAGMENT_QUERIES];
+  bool fragment_query_prepass[FRAGMENT_QUERIES];
+  int fragment_query_frame;
+
+  // Union of the bboxes of all objects. When an object that may have
+  // defined part of the boundary moves or is removed, the union is only
+  // marked dirty and gets rebuilt on the next get_bbox().
+  BBox bbox;
+  bool bbox_dirty;
 };
 
 // Mapping between integer and 8-bit RGB values (used for picking)
@@ -1,5 +1,7 @@
 #include "sphere.h"
 
+#include "CS248/glstate.h"
+
 #include "../static_scene/object.h"
 
 namespace CS248 {
@@ -7,13 +9,48 @@ namespace DynamicScene {
 
 Sphere::Sphere(const Collada::SphereInfo& info, const Vector3D& position,
                const double scale)
-    : p(position), r(info.radius * scale) {
+    : p(position), r(info.radius * scale),
+      diffuse_color(info.diffuse_color), spec_exp(info.phong_spec_exp) {
 }
 
 void Sphere::draw() {
+  // spheres are only drawn instanced, see get_instance()
+}
+
+void Sphere::enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth) {
+  if (pass != RENDER_PASS_SHADOW && pass != RENDER_PASS_COLOR && pass != RENDER_PASS_FORWARD)
+    return;
+
+  Shader *shader = scene->get_sphere_shader(pass);
+  if (shader)
+    queue.push(RenderQueue::make_key(pass, shader->_programID, 0, depth), this);
+}
+
+bool Sphere::get_instance(InstanceData &instance) {
+  instance.sphere[0] = p.x;
+  instance.sphere[1] = p.y;
+  instance.sphere[2] = p.z;
+  instance.sphere[3] = r;
+  instance.material[0] = diffuse_color.x;
+  instance.material[1] = diffuse_color.y;
+  instance.material[2] = diffuse_color.z;
+  instance.material[3] = spec_exp;
+  return true;
+}
+
+void Sphere::bind_batch_state(RenderPass pass) {
+  GLState::use_program(scene->get_sphere_shader(pass)->_programID);
+  if (pass == RENDER_PASS_SHADOW)
+    return;
+
+  // the shadow maps, the light clusters are bound for the frame
+  if (scene->do_shadow_pass)
+    GLState::bind_texture(3, GL_TEXTURE_2D_ARRAY, scene->get_shadow_texture());
+  if (scene->get_shadow_moments_texture())
+    GLState::bind_texture(4, GL_TEXTURE_2D_ARRAY, scene->get_shadow_moments_texture());
 }
 
-BBox Sphere::get_bbox() {
+BBox Sphere::compute_bbox() {
   return BBox(p.x - r, p.y - r, p.z - r, p.x + r, p.y + r, p.z + r);
 }
 
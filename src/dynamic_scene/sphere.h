@@ -8,6 +8,14 @@
 namespace CS248 {
 namespace DynamicScene {
 
+/**
+ * An analytic sphere. Spheres are drawn as instances of one quad each,
+ * in which deferred_lighting.frag (built with SPHERE) ray-casts the exact
+ * sphere and writes its depth, so that a scene can hold a great many of
+ * them: the scene draws all spheres of a pass with one instanced call.
+ * They cast and receive shadows, and are drawn after the depth prepass and
+ * the G-buffer, in RENDER_PASS_FORWARD.
+ */
 class Sphere : public SceneObject {
  public:
   Sphere(const Collada::SphereInfo& sphereInfo, const Vector3D& position,
@@ -15,13 +23,21 @@ class Sphere : public SceneObject {
 
   virtual void draw();
 
-  BBox get_bbox();
-  
+  void enqueue(RenderQueue &queue, RenderPass pass, uint32_t depth) override;
+  bool get_instance(InstanceData &instance) override;
+  void bind_batch_state(RenderPass pass) override;
+
   StaticScene::SceneObject* get_static_object();
-  
+
+ protected:
+  BBox compute_bbox();
+
  private:
   double r;
   Vector3D p;
+
+  Vector3D diffuse_color;
+  float spec_exp;
 };
 
 }  // namespace DynamicScene
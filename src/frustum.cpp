@@ -0,0 +1,53 @@
+#include "frustum.h"
+
+namespace CS248 {
+
+Frustum::Frustum(const Mat4f &view_projection) {
+
+  // the columns of the transpose are the rows of view_projection
+  Mat4f rows = view_projection.T();
+  Vec4f r0(rows.c[0]), r1(rows.c[1]), r2(rows.c[2]), r3(rows.c[3]);
+
+  // left, right, bottom, top, near, far
+  Vec4f planes[8] = { r3 + r0, r3 - r0, r3 + r1, r3 - r1, r3 + r2, r3 - r2 };
+  planes[6] = planes[7] = planes[0];
+
+  for (int i = 0; i < 2; i++) {
+    x[i] = planes[4 * i + 0].v;
+    y[i] = planes[4 * i + 1].v;
+    z[i] = planes[4 * i + 2].v;
+    w[i] = planes[4 * i + 3].v;
+    f4_transpose(x[i], y[i], z[i], w[i]);
+
+    abs_x[i] = f4_abs(x[i]);
+    abs_y[i] = f4_abs(y[i]);
+    abs_z[i] = f4_abs(z[i]);
+  }
+}
+
+bool Frustum::intersects(const BBox &box) const {
+  if (box.empty())
+    return true;
+
+  Vec3f lo(box.min), hi(box.max);
+  Vec3f half(0.5f, 0.5f, 0.5f);
+  Vec3f center = (lo + hi) * half;
+  Vec3f extent = (hi - lo) * half;
+
+  float4 cx = f4_lane<0>(center.v), cy = f4_lane<1>(center.v), cz = f4_lane<2>(center.v);
+  float4 ex = f4_lane<0>(extent.v), ey = f4_lane<1>(extent.v), ez = f4_lane<2>(extent.v);
+  float4 zero = f4_splat(0.f);
+
+  for (int i = 0; i < 2; i++) {
+    // signed distance of the box corner furthest along the plane normal
+    float4 d = f4_add(f4_add(f4_mul(x[i], cx), f4_mul(y[i], cy)),
+                      f4_add(f4_mul(z[i], cz), w[i]));
+    float4 r = f4_add(f4_add(f4_mul(abs_x[i], ex), f4_mul(abs_y[i], ey)),
+                      f4_mul(abs_z[i], ez));
+    if (f4_any_less(f4_add(d, r), zero))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace CS248
@@ -0,0 +1,40 @@
+#ifndef CS248_FRUSTUM_H
+#define CS248_FRUSTUM_H
+
+#include "CS248/simd.h"
+#include "bbox.h"
+
+namespace CS248 {
+
+/**
+ * The six clipping planes of a view-projection transform, for culling
+ * objects that can't be visible in a pass. The planes are kept in
+ * structure-of-arrays form so that a box is tested against four planes at a
+ * time.
+ */
+class Frustum {
+ public:
+
+  /**
+   * Extracts the planes of the clip volume of view_projection (the usual
+   * OpenGL [-w,w]^3 volume).
+   */
+  Frustum(const Mat4f &view_projection);
+
+  /**
+   * Returns false if the box is certainly outside the frustum. The test is
+   * conservative: boxes near the corners of the frustum may pass although
+   * they are outside. Empty boxes always pass.
+   */
+  bool intersects(const BBox &box) const;
+
+ private:
+  // plane k is (x[k/4][k%4], y.., z..) . p + w.. >= 0 inside;
+  // slots 6 and 7 repeat plane 0
+  float4 x[2], y[2], z[2], w[2];
+  float4 abs_x[2], abs_y[2], abs_z[2];
+};
+
+}  // namespace CS248
+
+#endif  // CS248_FRUSTUM_H
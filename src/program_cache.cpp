@@ -0,0 +1,189 @@
+#include "program_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+
+namespace CS248 {
+
+// Start of every cache file, followed by the program binary.
+struct ProgramCacheHeader {
+  char magic[8];
+  uint64_t key;
+  uint32_t format;   // binary format the driver reported
+  uint32_t length;   // bytes of binary
+  double build_ms;   // compile and link time of the program
+};
+
+// The last character is the cache version, it is part of every key. Bump
+// it when the file layout or the setup of programs before linking changes
+// in a way the key doesn't cover.
+static const char PROGRAM_CACHE_MAGIC[8] = { 'C', 'S', '2', '4', '8', 'P', 'B', '2' };
+
+static ProgramCache::Stats cache_stats = { 0, 0, 0, 0., 0. };
+
+static double now_ms() {
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 64 bit FNV-1a
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char) data[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static uint64_t hash_string(uint64_t h, const char *s) {
+  // the terminating zero separates consecutive strings
+  return hash_bytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+// Creates the cache directory the first time it is called, returns an
+// empty string if there is none.
+static const std::string &cache_directory() {
+  static bool resolved = false;
+  static std::string dir;
+  if (resolved)
+    return dir;
+  resolved = true;
+
+  const char *env = getenv("CS248_SHADER_CACHE");
+  std::string parent;
+  if (env) {
+    dir = env;
+  } else if (getenv("XDG_CACHE_HOME")) {
+    parent = getenv("XDG_CACHE_HOME");
+    dir = parent + "/cs248-shaders";
+  } else if (getenv("HOME")) {
+    parent = std::string(getenv("HOME")) + "/.cache";
+    dir = parent + "/cs248-shaders";
+  }
+  if (dir.empty())
+    return dir;
+
+  if (!parent.empty())
+    mkdir(parent.c_str(), 0755);
+  mkdir(dir.c_str(), 0755);
+
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    printf("Program cache: can't use directory %s\n", dir.c_str());
+    dir.clear();
+  }
+  return dir;
+}
+
+static std::string cache_file(uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) key);
+  return cache_directory() + name;
+}
+
+bool ProgramCache::enabled() {
+  static int supported = -1;
+  if (supported < 0) {
+    GLint formats = 0;
+    if (GLEW_ARB_get_program_binary)
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    supported = formats > 0;
+  }
+  return supported && !cache_directory().empty();
+}
+
+uint64_t ProgramCache::key(const std::vector<const std::string *> &sources,
+                           const AttributeBinding *attributes, size_t num_attributes) {
+  uint64_t h = 14695981039346656037ull;
+  h = hash_bytes(h, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+  h = hash_string(h, (const char *) glGetString(GL_VENDOR));
+  h = hash_string(h, (const char *) glGetString(GL_RENDERER));
+  h = hash_string(h, (const char *) glGetString(GL_VERSION));
+  for (const std::string *s : sources)
+    h = hash_string(h, s->c_str());
+  for (size_t i = 0; i < num_attributes; i++) {
+    h = hash_string(h, attributes[i].name);
+    h = hash_bytes(h, (const char *) &attributes[i].location, sizeof(attributes[i].location));
+  }
+  return h;
+}
+
+bool ProgramCache::load(uint64_t key, GLuint program) {
+  double start = now_ms();
+
+  FILE *file = fopen(cache_file(key).c_str(), "rb");
+  if (!file) {
+    cache_stats.misses++;
+    return false;
+  }
+
+  ProgramCacheHeader header;
+  std::vector<char> binary;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+            header.key == key;
+  if (ok) {
+    binary.resize(header.length);
+    ok = header.length > 0 && fread(&binary[0], header.length, 1, file) == 1;
+  }
+  fclose(file);
+
+  GLint linked = 0;
+  if (ok) {
+    glProgramBinary(program, header.format, &binary[0], header.length);
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  }
+
+  if (!linked) {
+    // a truncated file, or a binary this driver build doesn't take back
+    cache_stats.rejected++;
+    cache_stats.misses++;
+    return false;
+  }
+
+  double ms = now_ms() - start;
+  cache_stats.hits++;
+  cache_stats.load_ms += ms;
+  cache_stats.saved_ms += header.build_ms - ms;
+  return true;
+}
+
+void ProgramCache::store(uint64_t key, GLuint program, double build_ms) {
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  ProgramCacheHeader header;
+  memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+  header.key = key;
+  header.build_ms = build_ms;
+
+  std::vector<char> binary(length);
+  GLenum format = 0;
+  glGetProgramBinary(program, length, &length, &format, &binary[0]);
+  header.format = format;
+  header.length = length;
+
+  // written under a temporary name and renamed, so that a program started
+  // at the same time never reads half a file
+  std::string path = cache_file(key);
+  std::string temp = path + ".tmp";
+  FILE *file = fopen(temp.c_str(), "wb");
+  if (!file)
+    return;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(&binary[0], length, 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+    remove(temp.c_str());
+}
+
+const ProgramCache::Stats &ProgramCache::stats() {
+  return cache_stats;
+}
+
+}  // namespace CS248
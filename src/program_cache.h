@@ -0,0 +1,84 @@
+#ifndef CS248_PROGRAM_CACHE_H
+#define CS248_PROGRAM_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "GL/glew.h"
+
+namespace CS248 {
+
+/**
+ * On-disk cache of linked GL program binaries (ARB_get_program_binary), so
+ * that programs built before are loaded instead of compiled and linked.
+ *
+ * Programs are keyed by a hash of their final source strings (after the
+ * content prefixes were inserted), the attribute locations bound before
+ * linking, the cache format and the GL vendor, renderer and version, so a
+ * driver update, a changed shader or changed program setup misses the
+ * cache. Drivers may
+ * still reject a binary they wrote earlier, callers then build the program
+ * from source and store it again.
+ *
+ * The cache lives in $CS248_SHADER_CACHE if set, else in
+ * $XDG_CACHE_HOME/cs248-shaders or ~/.cache/cs248-shaders. Setting
+ * CS248_SHADER_CACHE to an empty string turns it off.
+ */
+class ProgramCache {
+ public:
+
+  /**
+   * Programs loaded from and built into the cache so far, and the time the
+   * loads took compared to building the same programs when they were
+   * stored.
+   */
+  struct Stats {
+    int hits;
+    int misses;
+    int rejected;     // binaries the driver refused to load
+    double load_ms;   // spent loading binaries
+    double saved_ms;  // build time of the loaded programs minus load_ms
+  };
+
+  /**
+   * False if the driver can't save program binaries or there is no cache
+   * directory.
+   */
+  static bool enabled();
+
+  /**
+   * A vertex attribute location bound with glBindAttribLocation() before
+   * linking.
+   */
+  struct AttributeBinding {
+    const char *name;
+    GLuint location;
+  };
+
+  /**
+   * Key of the program built from sources, one per shader stage, with the
+   * given attribute locations bound.
+   */
+  static uint64_t key(const std::vector<const std::string *> &sources,
+                      const AttributeBinding *attributes, size_t num_attributes);
+
+  /**
+   * Loads the binary stored under key into program and returns true if it
+   * links. program must not have shaders attached.
+   */
+  static bool load(uint64_t key, GLuint program);
+
+  /**
+   * Stores the binary of the linked program under key. build_ms is the time
+   * compiling and linking it took. Programs should be linked with
+   * GL_PROGRAM_BINARY_RETRIEVABLE_HINT set.
+   */
+  static void store(uint64_t key, GLuint program, double build_ms);
+
+  static const Stats &stats();
+};
+
+}  // namespace CS248
+
+#endif  // CS248_PROGRAM_CACHE_H
@@ -1,4 +1,7 @@
 #include "shader.h"
+#include "program_cache.h"
+#include "uniform_buffers.h"
+#include <chrono>
 #include <fstream>
 #include <string>
 
@@ -6,22 +9,97 @@ using namespace CS248::StaticScene;
 
 namespace CS248 {
 
-Shader::Shader(std::string vertex_shader_filename, std::string fragment_shader_filename, std::string vertex_shader_content_prefix, std::string fragment_shader_content_prefix)
+// Attribute locations bound in every program before linking, part of the
+// program cache key
+static const ProgramCache::AttributeBinding attributeBindings[] = {
+    { "vtx_position",       VTX_POSITION_LOCATION },
+    { "vtx_normal",         VTX_NORMAL_LOCATION },
+    { "vtx_texcoord",       VTX_TEXCOORD_LOCATION },
+    { "vtx_tangent",        VTX_TANGENT_LOCATION },
+    { "vtx_diffuse_color",  VTX_DIFFUSE_COLOR_LOCATION },
+    { "instance_sphere",    VTX_INSTANCE_SPHERE_LOCATION },
+    { "instance_material",  VTX_INSTANCE_MATERIAL_LOCATION },
+};
+static const size_t NUM_ATTRIBUTE_BINDINGS = sizeof(attributeBindings) / sizeof(attributeBindings[0]);
+
+// Whether the driver builds programs in the background, in which case it
+// is told to use as many threads as it likes (the first time only).
+static bool parallelCompile()
+{
+    static int supported = -1;
+    if( supported < 0 ) {
+        supported = GLEW_ARB_parallel_shader_compile ? 1 : 0;
+        if( supported )
+            glMaxShaderCompilerThreadsARB( 0xFFFFFFFF );
+    }
+    return supported;
+}
+
+Shader::Shader(std::string vertex_shader_filename, std::string fragment_shader_filename, std::string vertex_shader_content_prefix, std::string fragment_shader_content_prefix, std::string geometry_shader_filename)
 {
     _printErrors = true;
 	_vertexShaderFilename = vertex_shader_filename;
+	_geometryShaderFilename = geometry_shader_filename;
+    _geometryShaderID = 0;
 	_fragmentShaderFilename = fragment_shader_filename;
 
+    _vertexShaderID = 0;
+    _fragmentShaderID = 0;
+
+    _status = BUILD_FAILED;
+    _cacheKey = 0;
+    _cacheStore = false;
+
+    parallelCompile();
     _programID = glCreateProgram();
 
+    // the final sources, the geometry shader is optional and gets the
+    // vertex shader's prefix
+    if( !loadSource( _vertexShaderFilename, _vertexShaderString, vertex_shader_content_prefix ) ||
+        !loadSource( _geometryShaderFilename, _geometryShaderString, vertex_shader_content_prefix ) ||
+        !loadSource( _fragmentShaderFilename, _fragmentShaderString, fragment_shader_content_prefix ) )
+        return;
+
+    // a program built from the same sources before may be in the cache
+    bool useCache = ProgramCache::enabled();
+    uint64_t cacheKey = 0;
+    if( useCache ) {
+        std::vector<const std::string*> sources;
+        sources.push_back( &_vertexShaderString );
+        sources.push_back( &_geometryShaderString );
+        sources.push_back( &_fragmentShaderString );
+        cacheKey = ProgramCache::key( sources, attributeBindings, NUM_ATTRIBUTE_BINDINGS );
+
+        if( ProgramCache::load( cacheKey, _programID ) ) {
+            resolveLocations();
+            _status = BUILD_READY;
+            return;
+        }
+    }
+
+    _buildStart = std::chrono::steady_clock::now();
+
     // compile and attach the different shader objects
-    if( !compileAndAttachShader( _vertexShaderID, GL_VERTEX_SHADER, "Vertex Shader", _vertexShaderFilename, _vertexShaderString, vertex_shader_content_prefix ) )
+    if( !compileAndAttachShader( _vertexShaderID, GL_VERTEX_SHADER, "Vertex Shader", _vertexShaderFilename, _vertexShaderString ) )
         return;
 
-    if( !compileAndAttachShader( _fragmentShaderID, GL_FRAGMENT_SHADER, "Fragment Shader", _fragmentShaderFilename, _fragmentShaderString, fragment_shader_content_prefix ) )
+    if( !compileAndAttachShader( _geometryShaderID, GL_GEOMETRY_SHADER, "Geometry Shader", _geometryShaderFilename, _geometryShaderString ) )
         return;
 
+    if( !compileAndAttachShader( _fragmentShaderID, GL_FRAGMENT_SHADER, "Fragment Shader", _fragmentShaderFilename, _fragmentShaderString ) )
+        return;
+
+    for( size_t i = 0; i < NUM_ATTRIBUTE_BINDINGS; i++ )
+        glBindAttribLocation( _programID, attributeBindings[i].location, attributeBindings[i].name );
+
+    if( useCache )
+        glProgramParameteri( _programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+    _cacheKey = cacheKey;
+    _cacheStore = useCache;
+
+    // whether all this worked is only asked in finish()
     link();
+    _status = BUILD_PENDING;
 }
 
 Shader::~Shader()
@@ -51,6 +129,32 @@ bool Shader::read(std::string filename, std::string& contents) {
   return true;
 }
 
+bool Shader::loadSource( const std::string& filename, std::string &contents, const std::string& prefix )
+{
+    // no shader for this stage
+    if( !filename.length() && !contents.length() )
+        return true;
+
+    // If a shader was passed in, just use that. Otherwise try and load from the filename.
+    if( !contents.length() ) {
+
+        // try and load the file
+        if( !read( filename, contents ) ) {
+            printf( "DGLShader: Error reading file %s\n", filename.c_str() );
+            return false;
+        }
+    }
+
+    // the prefix has to go after the #version directive, if there is one
+    size_t insertAt = 0;
+    if( contents.compare( 0, 8, "#version" ) == 0 ) {
+        insertAt = contents.find( '\n' );
+        insertAt = (insertAt == std::string::npos) ? contents.size() : insertAt + 1;
+    }
+    contents.insert( insertAt, prefix );
+    return true;
+}
+
 bool Shader::compileAndAttachShader( GLuint& shaderID, GLenum shaderType, const char* shaderTypeStr, std::string filename, std::string &contents, std::string prefix )
 {
 
@@ -66,23 +170,25 @@ bool Shader::compileAndAttachShader( GLuint& shaderID, GLenum shaderType, const
     //if( !shaderID )
         shaderID = glCreateShader( shaderType );
 
-    // If a shader was passed in, just use that. Otherwise try and load from the filename.
-    if( !contents.length() ) {
-
-        // try and load the file
-        if( !read( filename, contents ) ) {
-            printf( "DGLShader: Error reading file %s\n", filename.c_str() );
-            return false;
-        }
-    }
-
-    contents = prefix + contents;
+    if( !loadSource( filename, contents, prefix ) )
+        return false;
 
-    // try to compile the shader
+    // start compiling the shader, finish() checks the result
     const char* source = contents.c_str();
     glShaderSource( shaderID, 1, &source, NULL );
     glCompileShader( shaderID );
 
+    // attach it to the program object
+    glAttachShader( _programID, shaderID );
+    return true;
+}
+
+bool Shader::compileStatus( GLuint shaderID, const char* shaderTypeStr, const std::string& filename )
+{
+    // no shader for this stage
+    if( !shaderID )
+        return true;
+
     // if it didn't work, print the error message
     GLint compileStatus;
     glGetShaderiv( shaderID, GL_COMPILE_STATUS, &compileStatus );
@@ -126,16 +232,51 @@ bool Shader::compileAndAttachShader( GLuint& shaderID, GLenum shaderType, const
         return false;
     }
 
-    // attach it to the program object
-    glAttachShader( _programID, shaderID );
     return true;
 }
 
-bool Shader::link()
+void Shader::link()
 {
     // link the different shaders that are attached to the program object
     glLinkProgram( _programID );
+}
 
+bool Shader::isReady()
+{
+    // without the extension, asking is the same as waiting
+    if( _status == BUILD_PENDING && parallelCompile() ) {
+        GLint done = GL_FALSE;
+        glGetProgramiv( _programID, GL_COMPLETION_STATUS_ARB, &done );
+        if( !done )
+            return false;
+    }
+    return finish();
+}
+
+bool Shader::finish()
+{
+    if( _status != BUILD_PENDING )
+        return _status == BUILD_READY;
+
+    _status = BUILD_FAILED;
+    if( !compileStatus( _vertexShaderID, "Vertex Shader", _vertexShaderFilename ) ||
+        !compileStatus( _geometryShaderID, "Geometry Shader", _geometryShaderFilename ) ||
+        !compileStatus( _fragmentShaderID, "Fragment Shader", _fragmentShaderFilename ) ||
+        !linkStatus() )
+        return false;
+
+    if( _cacheStore ) {
+        std::chrono::duration<double, std::milli> buildTime = std::chrono::steady_clock::now() - _buildStart;
+        ProgramCache::store( _cacheKey, _programID, buildTime.count() );
+    }
+
+    resolveLocations();
+    _status = BUILD_READY;
+    return true;
+}
+
+bool Shader::linkStatus()
+{
     // did the link work?
     GLint linkedOK = 0;
     glGetProgramiv( _programID, GL_LINK_STATUS, &linkedOK);
@@ -169,4 +310,70 @@ bool Shader::link()
 }
 
 
+ShaderLocations::ShaderLocations()
+    : diffuseTextureSampler(-1), normalTextureSampler(-1),
+      environmentTextureSampler(-1), shadowTextureArray(-1), shadowMomentsArray(-1),
+      shadowMapTransforms(-1),
+      clusterLights(-1), clusterGrid(-1), clusterLightIndices(-1),
+      gbufferAlbedo(-1), gbufferNormal(-1), gbufferDepth(-1), clip2world(-1),
+      impostorSphere(-1),
+      blurLayer(-1), blurStep(-1), blurScale(-1), blurDepthRange(-1),
+      vtx_position(-1), vtx_diffuse_color(-1), vtx_normal(-1),
+      vtx_texcoord(-1), vtx_tangent(-1) {}
+
+void Shader::resolveLocations()
+{
+    ShaderLocations& loc = _locations;
+
+    loc.diffuseTextureSampler     = glGetUniformLocation( _programID, "diffuseTextureSampler" );
+    loc.normalTextureSampler      = glGetUniformLocation( _programID, "normalTextureSampler" );
+    loc.environmentTextureSampler = glGetUniformLocation( _programID, "environmentTextureSampler" );
+    loc.shadowTextureArray        = glGetUniformLocation( _programID, "shadowTextureArray" );
+    loc.shadowMomentsArray        = glGetUniformLocation( _programID, "shadowMomentsArray" );
+    loc.shadowMapTransforms       = glGetUniformLocation( _programID, "shadowMapTransforms" );
+
+    loc.clusterLights       = glGetUniformLocation( _programID, "clusterLights" );
+    loc.clusterGrid         = glGetUniformLocation( _programID, "clusterGrid" );
+    loc.clusterLightIndices = glGetUniformLocation( _programID, "clusterLightIndices" );
+
+    loc.gbufferAlbedo = glGetUniformLocation( _programID, "gbufferAlbedo" );
+    loc.gbufferNormal = glGetUniformLocation( _programID, "gbufferNormal" );
+    loc.gbufferDepth  = glGetUniformLocation( _programID, "gbufferDepth" );
+    loc.clip2world    = glGetUniformLocation( _programID, "clip2world" );
+    loc.impostorSphere = glGetUniformLocation( _programID, "impostorSphere" );
+
+    loc.blurLayer      = glGetUniformLocation( _programID, "layer" );
+    loc.blurStep       = glGetUniformLocation( _programID, "blur_step" );
+    loc.blurScale      = glGetUniformLocation( _programID, "scale" );
+    loc.blurDepthRange = glGetUniformLocation( _programID, "depth_range" );
+
+    loc.vtx_position      = glGetAttribLocation( _programID, "vtx_position" );
+    loc.vtx_diffuse_color = glGetAttribLocation( _programID, "vtx_diffuse_color" );
+    loc.vtx_normal        = glGetAttribLocation( _programID, "vtx_normal" );
+    loc.vtx_texcoord      = glGetAttribLocation( _programID, "vtx_texcoord" );
+    loc.vtx_tangent       = glGetAttribLocation( _programID, "vtx_tangent" );
+
+    GLuint frameBlock = glGetUniformBlockIndex( _programID, "FrameUniforms" );
+    if( frameBlock != GL_INVALID_INDEX )
+        glUniformBlockBinding( _programID, frameBlock, FRAME_UNIFORMS_BINDING );
+
+    GLuint objectBlock = glGetUniformBlockIndex( _programID, "ObjectUniforms" );
+    if( objectBlock != GL_INVALID_INDEX )
+        glUniformBlockBinding( _programID, objectBlock, OBJECT_UNIFORMS_BINDING );
+
+    GLuint passBlock = glGetUniformBlockIndex( _programID, "PassUniforms" );
+    if( passBlock != GL_INVALID_INDEX )
+        glUniformBlockBinding( _programID, passBlock, PASS_UNIFORMS_BINDING );
+
+    GLuint layeredPassBlock = glGetUniformBlockIndex( _programID, "LayeredPassUniforms" );
+    if( layeredPassBlock != GL_INVALID_INDEX )
+        glUniformBlockBinding( _programID, layeredPassBlock, LAYERED_PASS_UNIFORMS_BINDING );
+
+    if( GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_program_interface_query ) {
+        GLuint objectBuffer = glGetProgramResourceIndex( _programID, GL_SHADER_STORAGE_BLOCK, "ObjectBuffer" );
+        if( objectBuffer != GL_INVALID_INDEX )
+            glShaderStorageBlockBinding( _programID, objectBuffer, OBJECT_BUFFER_BINDING );
+    }
+}
+
 }  // namespace CS248
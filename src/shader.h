@@ -6,11 +6,76 @@ using CS248::StaticScene::Scene;
 
 #include "GL/glew.h"
 
+#include <stdint.h>
+#include <chrono>
+
 namespace CS248 {
 
+// Vertex attribute locations bound in every program before linking, so
+// that programs can share one vertex array layout (see GeometryArena).
+#define VTX_POSITION_LOCATION       0
+#define VTX_NORMAL_LOCATION         1
+#define VTX_TEXCOORD_LOCATION       2
+#define VTX_TANGENT_LOCATION        3
+#define VTX_DIFFUSE_COLOR_LOCATION  4
+
+// Per-instance attributes of instanced draws (see InstanceData)
+#define VTX_INSTANCE_SPHERE_LOCATION    5
+#define VTX_INSTANCE_MATERIAL_LOCATION  6
+
+/**
+ * Locations of the uniforms and vertex attributes the renderer binds,
+ * resolved once after a program is linked so that drawing doesn't have to
+ * query (or build the names of) any of them. Locations of names the program
+ * doesn't use are -1. Per-frame and per-object data is passed in uniform
+ * blocks instead, see uniform_buffers.h.
+ */
+struct ShaderLocations {
+  ShaderLocations();
+
+  // texture samplers
+  GLint diffuseTextureSampler;
+  GLint normalTextureSampler;
+  GLint environmentTextureSampler;
+  GLint shadowTextureArray;  // one layer per shadowed light
+  GLint shadowMomentsArray;  // the same layers, filtered for VSM
+  GLint shadowMapTransforms; // buffer texture of per layer transforms
+
+  // light cluster buffer textures, see DynamicScene::LightClusters
+  GLint clusterLights;
+  GLint clusterGrid;
+  GLint clusterLightIndices;
+
+  // deferred_lighting.frag
+  GLint gbufferAlbedo;
+  GLint gbufferNormal;
+  GLint gbufferDepth;
+  GLint clip2world;
+  GLint impostorSphere;  // built with IMPOSTOR
+
+  // shadow_blur.frag
+  GLint blurLayer;
+  GLint blurStep;
+  GLint blurScale;
+  GLint blurDepthRange;
+
+  // vertex attributes
+  GLint vtx_position;
+  GLint vtx_diffuse_color;
+  GLint vtx_normal;
+  GLint vtx_texcoord;
+  GLint vtx_tangent;
+};
 
 /**
  * A shader
+ *
+ * The constructor only submits the program to the driver: it compiles and
+ * links without asking whether that worked, so creating several programs
+ * before querying any lets the driver build them in parallel
+ * (ARB_parallel_shader_compile). isReady() polls without blocking where the
+ * driver supports that, finish() waits. _programID and _locations can only
+ * be used once either returned true.
  */
 class Shader {
  public:
@@ -19,7 +84,7 @@ class Shader {
    * Default constructor.
    * Creates a new pathtracer instance.
    */
-  Shader(std::string vertex_shader_filename, std::string fragment_shader_filename, std::string vertex_shader_content_prefix = "", std::string fragment_shader_content_prefix = "");
+  Shader(std::string vertex_shader_filename, std::string fragment_shader_filename, std::string vertex_shader_content_prefix = "", std::string fragment_shader_content_prefix = "", std::string geometry_shader_filename = "");
 
   /**
    * Destructor.
@@ -28,8 +93,34 @@ class Shader {
   ~Shader();
 
   bool read(std::string filename, std::string& contents);
+
+  // Reads filename into contents unless contents were given, and inserts
+  // prefix after the #version line. Stages with neither are left empty,
+  // false if the file can't be read.
+  bool loadSource( const std::string& filename, std::string &contents, const std::string& prefix );
   bool compileAndAttachShader( GLuint& shaderID, GLenum shaderType, const char* shaderTypeStr, std::string filename, std::string &contents, std::string prefix = "" );
-  bool link();
+  void link();
+
+  // true once the program is linked; false while it's still being built
+  // or if building failed. Only blocks if the driver can't tell whether
+  // a build is done.
+  bool isReady();
+
+  // true once building the program is known to have failed (by isReady()
+  // or finish()); it never becomes ready then
+  bool isFailed() const { return _status == BUILD_FAILED; }
+
+  // waits for the program to be built and returns whether that worked,
+  // printing any compile or link errors
+  bool finish();
+
+  // the status queries finish() makes, true for a stage with no shader
+  bool compileStatus( GLuint shaderID, const char* shaderTypeStr, const std::string& filename );
+  bool linkStatus();
+
+  // fills _locations and attaches the program's uniform and storage blocks
+  // to their binding points, called after a successful link
+  void resolveLocations();
 
     // contents/filenames for the shaders
     std::string _vertexShaderFilename;
@@ -47,6 +138,18 @@ class Shader {
     GLuint _fragmentShaderID;
     GLuint _programID;
 
+    // uniform and attribute locations of the linked program
+    ShaderLocations _locations;
+
+    enum BuildStatus { BUILD_PENDING, BUILD_READY, BUILD_FAILED };
+    BuildStatus _status;
+
+    // when the build was submitted, and the program cache entry it is
+    // stored under once linked (if _cacheStore)
+    std::chrono::steady_clock::time_point _buildStart;
+    uint64_t _cacheKey;
+    bool _cacheStore;
+
     // where we keep track of the textures and where they are bound
     int _firstAvailableTextureUnit;
     //std::vector<BoundTexture> _boundTextures;
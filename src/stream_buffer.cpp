@@ -0,0 +1,145 @@
+#include "stream_buffer.h"
+#include "CS248/glstate.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace CS248 {
+
+// n rounded up to a multiple of alignment
+static size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+StreamBuffer::StreamBuffer(GLenum target, size_t frame_capacity, size_t alignment)
+  : target(target), buffer_id(0), mapping(NULL), alignment(alignment), frame(0) {
+  persistent = persistent_supported();
+  for (int i = 0; i < FRAMES; i++)
+    fences[i] = 0;
+  counters.bytes = 0;
+  counters.wait_ms = 0;
+  allocate(align_up(frame_capacity, alignment));
+}
+
+StreamBuffer::~StreamBuffer() {
+  for (int i = 0; i < FRAMES; i++)
+    if (fences[i]) glDeleteSync(fences[i]);
+  GLState::delete_buffers(1, &buffer_id);
+  release_retired();
+}
+
+bool StreamBuffer::persistent_supported() {
+  return GLEW_ARB_buffer_storage;
+}
+
+void StreamBuffer::release_retired() {
+  if (!retired.empty())
+    GLState::delete_buffers(retired.size(), &retired[0]);
+  retired.clear();
+}
+
+void StreamBuffer::allocate(size_t frame_capacity) {
+  // the old buffer still holds data of this frame that ranges bound
+  // earlier point at, deleting it would unbind them. It is kept until the
+  // next frame starts.
+  if (buffer_id)
+    retired.push_back(buffer_id);
+  for (int i = 0; i < FRAMES; i++) {
+    if (fences[i]) glDeleteSync(fences[i]);
+    fences[i] = 0;
+  }
+
+  capacity = frame_capacity;
+  glGenBuffers(1, &buffer_id);
+  GLState::bind_buffer(target, buffer_id);
+
+  if (persistent) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(target, FRAMES * capacity, NULL, flags);
+    mapping = (char *) glMapBufferRange(target, 0, FRAMES * capacity, flags);
+    frame = 0;
+  } else {
+    glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+  }
+
+  offset = persistent ? frame * capacity : 0;
+  frame_end = offset + capacity;
+}
+
+void StreamBuffer::begin_frame() {
+  counters.bytes = 0;
+  counters.wait_ms = 0;
+
+  // nothing binds ranges of buffers replaced last frame any more (draws
+  // already issued keep their storage alive until they are done)
+  release_retired();
+
+  if (!persistent) {
+    // fresh storage, the old one is released once the GPU is done with it
+    GLState::bind_buffer(target, buffer_id);
+    glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+    offset = 0;
+    frame_end = capacity;
+    return;
+  }
+
+  // the commands reading the finished frame's region are all issued now
+  if (fences[frame]) glDeleteSync(fences[frame]);
+  fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  frame = (frame + 1) % FRAMES;
+  offset = frame * capacity;
+  frame_end = offset + capacity;
+
+  if (!fences[frame])
+    return;
+
+  auto start = std::chrono::steady_clock::now();
+  GLenum status = glClientWaitSync(fences[frame], 0, 0);
+  while (status == GL_TIMEOUT_EXPIRED)
+    status = glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+  counters.wait_ms += waited.count();
+
+  glDeleteSync(fences[frame]);
+  fences[frame] = 0;
+}
+
+void *StreamBuffer::map(size_t max_size, size_t &result_offset) {
+
+  // grow if the frame needs more than it holds, keeping the rest of the
+  // frame in the new buffer and what was written before in the old one
+  if (offset + max_size > frame_end) {
+    allocate(std::max(2 * capacity, align_up(max_size, alignment)));
+  }
+
+  result_offset = offset;
+  if (persistent)
+    return mapping + offset;
+
+  // no draw in flight reads this range, so there is no need to synchronize
+  GLState::bind_buffer(target, buffer_id);
+  return glMapBufferRange(target, offset, max_size,
+                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                          GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void StreamBuffer::unmap(size_t size) {
+  if (!persistent) {
+    GLState::bind_buffer(target, buffer_id);
+    glUnmapBuffer(target);
+  }
+  offset = align_up(offset + size, alignment);
+  counters.bytes += size;
+}
+
+size_t StreamBuffer::write(const void *data, size_t size) {
+  size_t result_offset;
+  void *ptr = map(size, result_offset);
+  memcpy(ptr, data, size);
+  unmap(size);
+  return result_offset;
+}
+
+}  // namespace CS248
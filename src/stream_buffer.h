@@ -0,0 +1,99 @@
+#ifndef CS248_STREAM_BUFFER_H
+#define CS248_STREAM_BUFFER_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "GL/glew.h"
+
+namespace CS248 {
+
+/**
+ * Ring buffer for data the CPU writes once per frame and the GPU reads in
+ * the same frame (uniform blocks, per-draw arrays, indirect commands).
+ *
+ * If ARB_buffer_storage is available the buffer is mapped persistently and
+ * coherently, split into one region per frame in flight, and a fence placed
+ * at the end of each frame tells when its region may be written again.
+ * Writes then go straight into GPU visible memory with no map/unmap calls.
+ * Otherwise the buffer is orphaned every frame and each allocation is
+ * mapped unsynchronized, which lets the driver hand out fresh storage.
+ *
+ * Allocations are only valid until the end of the frame. The buffer name
+ * can change when a frame outgrows the buffer, so bind buffer() after
+ * allocating. The outgrown buffer is kept until the next begin_frame(), so
+ * ranges of it bound earlier in the frame stay valid.
+ */
+class StreamBuffer {
+ public:
+
+  /**
+   * Bytes written and time spent waiting for the GPU to release a region,
+   * since the last begin_frame().
+   */
+  struct Stats {
+    size_t bytes;
+    double wait_ms;
+  };
+
+  // number of frames the CPU may run ahead of the GPU
+  static const int FRAMES = 3;
+
+  /**
+   * Creates a buffer bound to target when written, with room for
+   * frame_capacity bytes per frame. Offsets handed out are multiples of
+   * alignment.
+   */
+  StreamBuffer(GLenum target, size_t frame_capacity, size_t alignment);
+  ~StreamBuffer();
+
+  static bool persistent_supported();
+
+  /**
+   * Ends the current frame and starts writing the next one, waiting if the
+   * GPU still reads its region.
+   */
+  void begin_frame();
+
+  /**
+   * Returns a pointer to write up to max_size bytes to and their offset in
+   * buffer(). Call unmap() with the number of bytes actually written before
+   * drawing with them or allocating again.
+   */
+  void *map(size_t max_size, size_t &offset);
+  void unmap(size_t size);
+
+  /**
+   * Copies size bytes into the buffer and returns their offset.
+   */
+  size_t write(const void *data, size_t size);
+
+  GLuint buffer() const { return buffer_id; }
+  bool is_persistent() const { return persistent; }
+  const Stats &stats() const { return counters; }
+
+ private:
+  // (Re)creates storage for frame_capacity bytes per frame, retiring the
+  // old buffer.
+  void allocate(size_t frame_capacity);
+
+  // Deletes the buffers retired by allocate().
+  void release_retired();
+
+  GLenum target;
+  GLuint buffer_id;
+  bool persistent;
+  char *mapping;           // persistent mapping of the whole buffer
+  size_t capacity;         // bytes per frame
+  size_t alignment;
+  int frame;               // region being written, persistent mode only
+  size_t offset;           // next free byte in the current frame's range
+  size_t frame_end;        // end of the current frame's range
+  GLsync fences[FRAMES];
+  std::vector<GLuint> retired;  // outgrown buffers the frame may still bind
+  Stats counters;
+};
+
+}  // namespace CS248
+
+#endif  // CS248_STREAM_BUFFER_H
@@ -0,0 +1,125 @@
+#ifndef CS248_UNIFORM_BUFFERS_H
+#define CS248_UNIFORM_BUFFERS_H
+
+#include "GL/glew.h"
+
+/**
+ * Host side copies of the std140 uniform blocks declared by the mesh shaders
+ * in media/. The layouts have to be kept in sync with the GLSL declarations
+ * by hand. Remember that in std140 every element of a vec3 or scalar array
+ * takes up a full vec4, as does every column of a mat3.
+ */
+
+namespace CS248 {
+
+// Must match MAX_NUM_LIGHTS in the shaders: directional lights. Point and
+// spot lights are read from the light clusters (see
+// DynamicScene::LightClusters), there is no limit to them, nor to the
+// shadowed spot lights (see SHADOW_MAP_TEXELS).
+#define UNIFORM_MAX_LIGHTS          10
+
+// Must match NUM_CASCADES in the shaders: cascades of the shadow map of
+// the first directional light.
+#define UNIFORM_NUM_CASCADES        4
+
+// Must match MAX_SHADOW_MAPS in shadow_pass.vert: shadow maps one layered
+// shadow pass renders. Scenes with more are drawn in several passes.
+#define UNIFORM_MAX_SHADOW_MAPS     14
+
+// Must match SHADOW_MAP_TEXELS in the shaders: RGBA32F texels per shadow
+// map layer in the shadowMapTransforms buffer texture, the four columns of
+// its world to light space transform, then its scale in x.
+#define SHADOW_MAP_TEXELS           5
+
+// Binding points the blocks are attached to in every program.
+#define FRAME_UNIFORMS_BINDING  0
+#define OBJECT_UNIFORMS_BINDING 1
+#define PASS_UNIFORMS_BINDING   2
+#define LAYERED_PASS_UNIFORMS_BINDING 3
+
+// Shader storage binding of the ObjectBuffer block, an array of
+// ObjectUniforms that batched draws index with gl_DrawIDARB.
+#define OBJECT_BUFFER_BINDING   0
+
+/**
+ * Data that is the same for every draw in a frame: cascade transforms,
+ * camera and lights (uniform block FrameUniforms).
+ */
+struct FrameUniforms {
+  float camera_position[3];
+  GLint num_directional_lights;
+  GLint num_point_lights;
+  GLint num_spot_lights;
+  GLint num_shadowed_lights;  // the first spot lights are shadowed
+  GLint pad0;
+
+  float directional_light_vectors[UNIFORM_MAX_LIGHTS][4];
+
+  float world2cascade[UNIFORM_NUM_CASCADES][16];
+  float cascade_ends[UNIFORM_NUM_CASCADES];  // view depth each cascade ends at
+  float camera_direction[3];
+  GLint num_cascades;         // 0 if the directional light casts no shadow
+  GLint first_cascade_layer;  // shadow map array layer of cascade 0
+  GLint shadow_filter;        // a DynamicScene::ShadowFilter
+  float spot_shadow_near;     // depth range of the spot light shadow maps
+  float spot_shadow_far;
+
+  GLint cluster_count[4];     // light clusters across, up and along the view
+  float cluster_scale[4];     // clusters per pixel across and up, and the
+                              // depth slice scale and bias
+};
+
+/**
+ * Data that changes between the passes of a frame: the world to clip space
+ * transform of the camera or shadow-casting light, and where it looks from
+ * (uniform block PassUniforms). eye is a position with w = 1 for
+ * perspective views, the direction towards the eye with w = 0 for
+ * orthographic ones.
+ */
+struct PassUniforms {
+  float view_projection[16];
+  float eye[4];
+};
+
+/**
+ * Transforms and array layers of the shadow maps rendered together by a
+ * layered shadow pass, one per draw instance (uniform block
+ * LayeredPassUniforms in shadow_pass.vert).
+ */
+struct LayeredPassUniforms {
+  float layer_view_projection[UNIFORM_MAX_SHADOW_MAPS][16];
+  GLint layer_index[UNIFORM_MAX_SHADOW_MAPS][4];
+  float layer_scale[UNIFORM_MAX_SHADOW_MAPS][4];  // fraction of the layer used
+};
+
+/**
+ * Data for a single draw: transforms and material parameters
+ * (uniform block ObjectUniforms). Its std430 array stride is the same
+ * 144 bytes, so batched draws use it for ObjectBuffer entries as well.
+ */
+struct ObjectUniforms {
+  float obj2world[16];
+  float obj2worldNorm[12];
+
+  GLint useTextureMapping;
+  GLint useNormalMapping;
+  GLint useEnvironmentMapping;
+  GLint useMirrorBRDF;
+  float spec_exp;
+  float pad0[3];
+};
+
+/**
+ * Data of one instance of an instanced draw: a ray-cast sphere's world
+ * space center and radius, and its diffuse color and Phong exponent. Read
+ * as the vertex attributes instance_sphere and instance_material (see
+ * sphere.vert), advancing once per instance.
+ */
+struct InstanceData {
+  float sphere[4];
+  float material[4];
+};
+
+}  // namespace CS248
+
+#endif  // CS248_UNIFORM_BUFFERS_H